@@ -0,0 +1,100 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <limits>
+#include <glm/glm.hpp>
+
+// a ray set up for slab tests: 1 / direction, and for every axis the index of the plane it
+// enters a box through and the one it leaves through, in the order min x, y, z, max x, y, z
+struct SlabRay
+{
+	glm::vec3 origin, inv_dir;
+	int near[3], far[3];
+
+	SlabRay(const glm::vec3 &o, const glm::vec3 &direction) : origin(o), inv_dir(1.0f / direction)
+	{
+		for (int a = 0; a < 3; ++a) {
+			near[a] = inv_dir[a] < 0.0f ? 3 + a : a;
+			far[a] = inv_dir[a] < 0.0f ? a : 3 + a;
+		}
+	}
+};
+
+struct AABB
+{
+	glm::vec3 min;
+	glm::vec3 max;
+
+	// an empty box, the identity for expand()
+	AABB()
+		: min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+	AABB(const glm::vec3 &a, const glm::vec3 &b)
+		: min(a), max(b) {}
+
+	bool empty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+	void expand(const glm::vec3 &p)
+	{
+		min = glm::min(min, p);
+		max = glm::max(max, p);
+	}
+
+	void expand(const AABB &b)
+	{
+		min = glm::min(min, b.min);
+		max = glm::max(max, b.max);
+	}
+
+	glm::vec3 centroid() const { return 0.5f * (min + max); }
+	glm::vec3 diagonal() const { return max - min; }
+
+	int largest_axis() const
+	{
+		glm::vec3 d = diagonal();
+		if (d.x > d.y && d.x > d.z) {
+			return 0;
+		}
+		return d.y > d.z ? 1 : 2;
+	}
+
+	// slab test without branches. The planes come from the ray's signs rather than a min/max of
+	// the two distances, and the comparisons keep tmin and tmax where a distance is nan: a ray
+	// parallel to a slab that starts on one of its planes gives 0 * inf, and counts as inside.
+	bool hit(const SlabRay &ray, float tmin, float tmax) const
+	{
+		float t_enter;
+		return hit(ray, tmin, tmax, t_enter);
+	}
+
+	// the same, also giving where the ray enters the box (tmin if it starts inside)
+	bool hit(const SlabRay &ray, float tmin, float tmax, float &t_enter) const
+	{
+		const float planes[6] = { min.x, min.y, min.z, max.x, max.y, max.z };
+		for (int axis = 0; axis < 3; ++axis) {
+			float t0 = (planes[ray.near[axis]] - ray.origin[axis]) * ray.inv_dir[axis];
+			float t1 = (planes[ray.far[axis]] - ray.origin[axis]) * ray.inv_dir[axis];
+			tmin = t0 > tmin ? t0 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
+		}
+		t_enter = tmin;
+		return tmin <= tmax;
+	}
+
+	float surface_area() const
+	{
+		if (empty()) {
+			return 0.0f;
+		}
+		glm::vec3 d = diagonal();
+		return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+};
+
+inline AABB merge(const AABB &a, const AABB &b)
+{
+	AABB r = a;
+	r.expand(b);
+	return r;
+}
+
+#endif //AABB_H
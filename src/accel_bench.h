@@ -0,0 +1,163 @@
+#ifndef ACCEL_BENCH_H
+#define ACCEL_BENCH_H
+
+// Acceleration structure benchmark (--accel-bench): builds every structure over the primitives
+// of one scene and traces the same ray set through each, half camera rays and half rays leaving
+// the first hits in random directions, so both coherent and incoherent traversal count. Hits are
+// checked against the first structure. The plain list only runs on small scenes; node MB against
+// Mrays/s on large grids (--grid 150 and up) shows what the wide and quantized layouts trade.
+// The out of core rows page clusters from a temporary file under a quarter of the memory all of
+// them take decoded, once per ray through hit() and once batched through hit_batch().
+
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+#include "wide_bvh.h"
+#include "out_of_core.h"
+#include "random_generator.h"
+
+struct AccelBenchOptions
+{
+	std::string scene = "random";
+	int grid = 11;
+	float aspect = 2.0f;
+	int rays = 1 << 20;
+	int treelet_rounds = 2; // for the lbvh with treelet reordering
+	std::string cluster_file = "accel_bench.ooc"; // written for the out of core rows, removed after
+	int cluster_size = 1024;
+};
+
+int run_accel_bench(const AccelBenchOptions &opts)
+{
+	struct Variant
+	{
+		std::string name;
+		AccelOptions accel;
+		enum { IN_CORE, OUT_OF_CORE, OUT_OF_CORE_BATCH } mode = IN_CORE;
+	};
+	AccelOptions treelets = accel_from_string("lbvh");
+	treelets.treelet_rounds = opts.treelet_rounds;
+	auto quantized = [](const char *accel, int bits) {
+		AccelOptions o = accel_from_string(accel);
+		o.quantize_bits = bits;
+		return o;
+	};
+	std::vector<Variant> variants = {
+		{ "bvh", accel_from_string("bvh") },
+		{ "lbvh", accel_from_string("lbvh") },
+		{ "lbvh63", accel_from_string("lbvh63") },
+		{ "lbvh+treelets", treelets },
+		{ "bvh4", accel_from_string("bvh4") },
+		{ "bvh8", accel_from_string("bvh8") },
+		{ "lbvh8", accel_from_string("lbvh8") },
+		{ "bvh4 q8", quantized("bvh4", 8) },
+		{ "bvh8 q16", quantized("bvh8", 16) },
+		{ "bvh8 q8", quantized("bvh8", 8) },
+		{ "lbvh8 q8", quantized("lbvh8", 8) },
+		{ "ooc", accel_from_string("bvh"), Variant::OUT_OF_CORE },
+		{ "ooc batch", accel_from_string("bvh"), Variant::OUT_OF_CORE_BATCH },
+	};
+
+	// the ray set, traced through the first structure
+	std::vector<Ray> rays;
+	{
+		Scene scene = make_scene(opts.scene, opts.aspect, "", variants[0].accel, opts.grid);
+		if (dynamic_cast<const Accelerator *>(scene.world.get())->stats().primitives <= 4096) {
+			variants.insert(variants.begin() + 1, { "list", AccelOptions() });
+		}
+		RandomGenerator<float> rand;
+		rand.seed(SCENE_SEED);
+		const int primary = opts.rays / 2;
+		rays.reserve(size_t(opts.rays));
+		for (int i = 0; i < primary; ++i) {
+			rays.push_back(scene.camera.generate_ray(rand.gen(), rand.gen(), rand));
+		}
+		for (int i = 0; i < primary && int(rays.size()) < opts.rays; ++i) {
+			HitRecord rec;
+			if (scene.world->hit(rays[size_t(i)], 0.001f, std::numeric_limits<float>::max(), rec)) {
+				rays.push_back(Ray(rec.p, rand.random_unit_vector()));
+			}
+		}
+	}
+
+	std::cout << opts.scene << " grid " << opts.grid << ", " << rays.size() << " rays" << std::endl;
+	std::cout << std::left << std::setw(15) << "accel" << std::right << std::setw(11) << "build ms" << std::setw(12)
+		<< "Mprims/s" << std::setw(10) << "nodes" << std::setw(10) << "node MB" << std::setw(8) << "depth"
+		<< std::setw(9) << "sah" << std::setw(11) << "Mrays/s" << std::setw(10) << "vs bvh" << std::endl;
+	std::vector<float> reference;
+	double baseline = 0.0;
+	int failures = 0;
+	for (const Variant &v : variants) {
+		Scene scene = make_scene(opts.scene, opts.aspect, "", v.mode == Variant::IN_CORE ? v.accel : AccelOptions(), opts.grid);
+		OutOfCoreWorld *out_of_core = nullptr;
+		if (v.mode != Variant::IN_CORE) {
+			OutOfCoreOptions ooc;
+			ooc.blas = v.accel;
+			ooc.cluster_size = opts.cluster_size;
+			auto world = make_out_of_core(static_cast<HitableList &>(*scene.world).release(), opts.cluster_file, scene.lights, ooc);
+			if (!world) {
+				std::cout << std::left << std::setw(15) << v.name << "could not write " << opts.cluster_file << std::endl;
+				failures++;
+				continue;
+			}
+			world->set_budget(world->decoded_bytes() / 4);
+			out_of_core = world.get();
+			scene.world = std::move(world);
+		}
+		std::vector<float> ts(rays.size());
+		auto t0 = std::chrono::steady_clock::now();
+		if (v.mode == Variant::OUT_OF_CORE_BATCH) {
+			std::vector<HitRecord> recs(rays.size());
+			std::vector<uint8_t> hits(rays.size());
+			out_of_core->hit_batch(rays.data(), rays.size(), 0.001f, std::numeric_limits<float>::max(), recs.data(), hits.data());
+			for (size_t i = 0; i < rays.size(); ++i) {
+				ts[i] = hits[i] ? recs[i].t : -1.0f;
+			}
+		} else {
+            #pragma omp parallel for schedule(dynamic, 1024)
+			for (int64_t i = 0; i < int64_t(rays.size()); ++i) {
+				HitRecord rec;
+				ts[size_t(i)] = scene.world->hit(rays[size_t(i)], 0.001f, std::numeric_limits<float>::max(), rec) ? rec.t : -1.0f;
+			}
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		double mrays = double(rays.size()) / seconds * 1e-6;
+		if (reference.empty()) {
+			reference = ts;
+			baseline = mrays;
+		}
+		size_t mismatches = 0;
+		for (size_t i = 0; i < ts.size(); ++i) {
+			mismatches += ts[i] != reference[i];
+		}
+
+		std::cout << std::left << std::setw(15) << v.name << std::right << std::fixed << std::setprecision(2);
+		if (const Accelerator *bvh = dynamic_cast<const Accelerator *>(scene.world.get())) {
+			const BVHStats &st = bvh->stats();
+			std::cout << std::setw(11) << st.build_ms << std::setw(12) << double(st.primitives) / (st.build_ms * 1e3)
+				<< std::setw(10) << st.nodes << std::setw(10) << double(st.node_bytes) / (1 << 20) << std::setw(8) << st.depth
+				<< std::setw(9) << st.sah_cost;
+		} else {
+			std::cout << std::setw(11) << "-" << std::setw(12) << "-" << std::setw(10) << "-" << std::setw(10) << "-"
+				<< std::setw(8) << "-" << std::setw(9) << "-";
+		}
+		std::cout << std::setw(11) << mrays << std::setw(9) << mrays / baseline << "x";
+		if (out_of_core) {
+			std::cout << "  " << out_of_core->cluster_count() << " clusters, " << out_of_core->page_ins() << " page-ins";
+		}
+		if (mismatches) {
+			std::cout << "  " << mismatches << " hits differ";
+			failures++;
+		}
+		std::cout << std::defaultfloat << std::endl;
+	}
+	std::remove(opts.cluster_file.c_str());
+	return failures;
+}
+
+#endif //ACCEL_BENCH_H
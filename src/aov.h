@@ -0,0 +1,186 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "image_io.h"
+
+// Arbitrary output variables written alongside the beauty pass. Each kind is a bit in a mask
+// and its storage is only allocated when enabled.
+enum AOVKind : uint32_t
+{
+	AOV_ALBEDO      = 1u << 0, // first non-specular albedo, through perfect specular chains
+	AOV_NORMAL      = 1u << 1, // first hit normal
+	AOV_DEPTH       = 1u << 2, // first hit distance
+	AOV_VARIANCE    = 1u << 3, // variance of the pixel mean's luminance
+	AOV_MATERIAL_ID = 1u << 4, // of the first sample's first hit, 0 for background
+	AOV_OBJECT_ID   = 1u << 5,
+	AOV_BOUNCES     = 1u << 6, // radiance added at path vertex 0, 1, 2 and 3+
+};
+
+static const uint32_t AOV_DENOISE_FEATURES = AOV_ALBEDO | AOV_NORMAL | AOV_DEPTH | AOV_VARIANCE;
+static const int AOV_MAX_BOUNCES = 4;
+
+// comma separated list of albedo, normal, depth, variance, material_id, object_id, bounces
+inline uint32_t parse_aov_list(const std::string &list)
+{
+	uint32_t mask = 0;
+	std::stringstream ss(list);
+	std::string name;
+	while (std::getline(ss, name, ',')) {
+		if (name == "albedo") mask |= AOV_ALBEDO;
+		else if (name == "normal") mask |= AOV_NORMAL;
+		else if (name == "depth") mask |= AOV_DEPTH;
+		else if (name == "variance") mask |= AOV_VARIANCE;
+		else if (name == "material_id") mask |= AOV_MATERIAL_ID;
+		else if (name == "object_id") mask |= AOV_OBJECT_ID;
+		else if (name == "bounces") mask |= AOV_BOUNCES;
+		else if (!name.empty()) std::cerr << "unknown aov " << name << std::endl;
+	}
+	return mask;
+}
+
+// what one camera path reports, filled in by the integrator
+struct AOVSample
+{
+	glm::vec3 albedo;
+	glm::vec3 normal;
+	float depth;
+	uint32_t material_id;
+	uint32_t object_id;
+	glm::vec3 bounce[AOV_MAX_BOUNCES];
+};
+
+struct AOVBuffers
+{
+	uint32_t enabled = 0;
+	std::vector<glm::vec3> albedo;
+	std::vector<glm::vec3> normal;
+	std::vector<float> depth;
+	std::vector<float> variance;
+	std::vector<float> material_id;
+	std::vector<float> object_id;
+	std::vector<glm::vec3> bounce[AOV_MAX_BOUNCES];
+	// sums that the stored averages can't be taken apart into, so passes can add to them: the
+	// unnormalized normals, and sum and sum of squares of the sample luminances
+	std::vector<glm::vec3> normal_sum;
+	std::vector<glm::vec2> luminance;
+
+	void allocate(uint32_t mask, size_t pixels)
+	{
+		enabled = mask;
+		if (mask & AOV_NORMAL) normal_sum.assign(pixels, glm::vec3(0.0f));
+		if (mask & AOV_VARIANCE) luminance.assign(pixels, glm::vec2(0.0f));
+		if (mask & AOV_ALBEDO) albedo.assign(pixels, glm::vec3(0.0f));
+		if (mask & AOV_NORMAL) normal.assign(pixels, glm::vec3(0.0f));
+		if (mask & AOV_DEPTH) depth.assign(pixels, 0.0f);
+		if (mask & AOV_VARIANCE) variance.assign(pixels, 0.0f);
+		if (mask & AOV_MATERIAL_ID) material_id.assign(pixels, 0.0f);
+		if (mask & AOV_OBJECT_ID) object_id.assign(pixels, 0.0f);
+		if (mask & AOV_BOUNCES) {
+			for (auto &b : bounce) {
+				b.assign(pixels, glm::vec3(0.0f));
+			}
+		}
+	}
+
+	bool has(uint32_t mask) const { return (enabled & mask) == mask; }
+
+	// writes every enabled buffer as <prefix>.<name>.pfm
+	void write(const std::string &prefix, int width, int height) const
+	{
+		if (enabled & AOV_ALBEDO) write_image(prefix + ".albedo.pfm", width, height, albedo);
+		if (enabled & AOV_NORMAL) write_image(prefix + ".normal.pfm", width, height, normal);
+		if (enabled & AOV_DEPTH) write_image(prefix + ".depth.pfm", width, height, to_rgb(depth));
+		if (enabled & AOV_VARIANCE) write_image(prefix + ".variance.pfm", width, height, to_rgb(variance));
+		if (enabled & AOV_MATERIAL_ID) write_image(prefix + ".material_id.pfm", width, height, to_rgb(material_id));
+		if (enabled & AOV_OBJECT_ID) write_image(prefix + ".object_id.pfm", width, height, to_rgb(object_id));
+		if (enabled & AOV_BOUNCES) {
+			for (int i = 0; i < AOV_MAX_BOUNCES; ++i) {
+				write_image(prefix + ".bounce" + std::to_string(i) + ".pfm", width, height, bounce[i]);
+			}
+		}
+	}
+};
+
+// sums the samples of one pixel before they are stored
+struct AOVAccumulator
+{
+	AOVSample sum;
+	float lum_sq;
+	bool first;
+
+	AOVAccumulator()
+	{
+		sum.albedo = sum.normal = glm::vec3(0.0f);
+		sum.depth = 0.0f;
+		sum.material_id = sum.object_id = 0;
+		for (auto &b : sum.bounce) {
+			b = glm::vec3(0.0f);
+		}
+		lum_sq = 0.0f;
+		first = true;
+	}
+
+	void add(const AOVSample &s, float luminance)
+	{
+		sum.albedo += s.albedo;
+		sum.normal += s.normal;
+		sum.depth += s.depth;
+		for (int i = 0; i < AOV_MAX_BOUNCES; ++i) {
+			sum.bounce[i] += s.bounce[i];
+		}
+		// ids don't average, keep the first sample's
+		if (first) {
+			sum.material_id = s.material_id;
+			sum.object_id = s.object_id;
+			first = false;
+		}
+		lum_sq += luminance * luminance;
+	}
+
+	// adds num_samples samples to a pixel that already averages samples_before of them, as
+	// progressive passes do; the first pass stores the plain averages
+	void store(AOVBuffers &aovs, size_t idx, int samples_before, int num_samples, float mean_luminance) const
+	{
+		const float total = float(samples_before + num_samples);
+		const float inv = 1.0f / float(num_samples);
+		const float keep = float(samples_before) / total;
+		auto mean = [&](const auto &old, const auto &s) { return samples_before > 0 ? old * keep + s / total : s * inv; };
+		if (aovs.enabled & AOV_ALBEDO) aovs.albedo[idx] = mean(aovs.albedo[idx], sum.albedo);
+		if (aovs.enabled & AOV_NORMAL) {
+			glm::vec3 &n = aovs.normal_sum[idx];
+			n = samples_before > 0 ? n + sum.normal : sum.normal;
+			float len = glm::length(n);
+			aovs.normal[idx] = len > 0.0f ? n / len : glm::vec3(0.0f);
+		}
+		if (aovs.enabled & AOV_DEPTH) aovs.depth[idx] = mean(aovs.depth[idx], sum.depth);
+		if (aovs.enabled & AOV_VARIANCE) {
+			glm::vec2 &moments = aovs.luminance[idx];
+			moments += glm::vec2(mean_luminance * float(num_samples), lum_sq);
+			if (samples_before > 0) {
+				const float m = moments.x / total;
+				aovs.variance[idx] = std::max(0.0f, moments.y / total - m * m) / total;
+			} else {
+				aovs.variance[idx] = std::max(0.0f, lum_sq * inv - mean_luminance * mean_luminance) * inv;
+			}
+		}
+		// ids come from the first sample of the first pass
+		if (samples_before == 0) {
+			if (aovs.enabled & AOV_MATERIAL_ID) aovs.material_id[idx] = float(sum.material_id);
+			if (aovs.enabled & AOV_OBJECT_ID) aovs.object_id[idx] = float(sum.object_id);
+		}
+		if (aovs.enabled & AOV_BOUNCES) {
+			for (int i = 0; i < AOV_MAX_BOUNCES; ++i) {
+				aovs.bounce[i][idx] = mean(aovs.bounce[i][idx], sum.bounce[i]);
+			}
+		}
+	}
+};
+
+#endif //AOV_H
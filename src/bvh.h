@@ -0,0 +1,748 @@
+#ifndef BVH_H
+#define BVH_H
+
+// Binary bounding volume hierarchy over the primitives a HitableList would get. Two builders:
+//
+// SAH, top down with binned SAH. The build is parallel where it pays: primitive bounds in a
+// parallel loop, bounds and bins of large nodes in chunks on OpenMP tasks, and the two children
+// of every large node as tasks of their own.
+//
+// LBVH, for fast rebuilds: 30 or 63 bit morton codes of the centroids, a parallel radix sort,
+// then one top down pass that splits every range where its codes first differ (a binary
+// search), with the bounds coming back up from the leaves. Optionally followed by rounds of
+// treelet reordering (Karras and Aila 2013): below every node the 7 leaves of its treelet are
+// rearranged into the topology with the least internal surface area.
+//
+// Nodes come from one arena sized for the worst case of 2n - 1 and handed out in sibling pairs
+// by an atomic counter, so the tasks never allocate or lock. Primitives are reordered so that
+// every leaf owns a contiguous range of them; object ids are assigned before that, in list
+// order, so aovs match a HitableList render.
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "aabb.h"
+#include "ray.h"
+#include "hitable.h"
+#include "trace.h"
+#include "morton.h"
+
+// OpenMP 3.0 has tasks; older runtimes (msvc's 2.0) build the tree on one thread
+#if defined(_OPENMP) && _OPENMP >= 200805
+#define BVH_TASKS 1
+#else
+#define BVH_TASKS 0
+#endif
+
+enum class Accel { List, BVH };
+enum class BVHBuilder { SAH, LBVH };
+
+struct AccelOptions
+{
+	Accel type = Accel::List;
+	BVHBuilder builder = BVHBuilder::SAH;
+	int morton_bits = 30;   // 30 or 63
+	int treelet_rounds = 0; // lbvh only
+	int width = 2;          // children per node: 2, or 4 and 8 for a WideBVH collapsed from the binary one
+	int quantize_bits = 0;  // 8 or 16: wide nodes store their child boxes quantized (QuantizedBVH)
+};
+
+// "list", "bvh" (sah), "lbvh" (30 bit codes) or "lbvh63"; "bvh4", "bvh8", "lbvh4" and "lbvh8"
+// are the same builds collapsed to 4 or 8 wide nodes
+inline AccelOptions accel_from_string(std::string s)
+{
+	AccelOptions o;
+	if (s == "bvh4" || s == "bvh8" || s == "lbvh4" || s == "lbvh8") {
+		o.width = s.back() - '0';
+		s.pop_back();
+	}
+	if (s == "bvh" || s == "sah") {
+		o.type = Accel::BVH;
+	} else if (s == "lbvh" || s == "lbvh63") {
+		o.type = Accel::BVH;
+		o.builder = BVHBuilder::LBVH;
+		o.morton_bits = s == "lbvh63" ? 63 : 30;
+	}
+	return o;
+}
+
+struct BVHStats
+{
+	size_t primitives = 0;
+	size_t nodes = 0;
+	size_t leaves = 0;
+	size_t node_bytes = 0;
+	int depth = 0;
+	double build_ms = 0.0;
+	// expected node visits plus primitive tests of a random ray through the root box
+	double sah_cost = 0.0;
+};
+
+// a Hitable over other hitables that reports how it was built
+class Accelerator : public Hitable
+{
+public:
+	const BVHStats &stats() const { return m_stats; }
+
+protected:
+	BVHStats m_stats;
+};
+
+template<int N>
+class WideBVH;
+template<int N, class Q>
+class QuantizedBVH;
+class OutOfCoreWorld;
+
+class BVH : public Accelerator
+{
+public:
+	BVH(std::vector<std::unique_ptr<Hitable>> hitables, const AccelOptions &options = AccelOptions());
+
+	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override;
+	virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+	virtual AABB bounds() const override { return m_nodes.empty() ? AABB() : m_nodes[0].bounds; }
+
+	const std::vector<std::unique_ptr<Hitable>> &hitables() const { return m_hitables; }
+
+private:
+	template<int N>
+	friend class WideBVH;
+	template<int N, class Q>
+	friend class QuantizedBVH;
+	// stores cluster trees and restores them, primitives already in leaf order, with BVH()
+	friend class OutOfCoreWorld;
+
+	BVH() {}
+
+	// 32 bytes. Inner nodes have count 0 and their children at offset and offset + 1; leaves
+	// have their primitives at [offset, offset + count)
+	struct Node
+	{
+		AABB bounds;
+		uint32_t offset;
+		uint16_t count;
+		uint8_t axis;
+		uint8_t pad;
+	};
+
+	struct PrimRef
+	{
+		AABB bounds;
+		glm::vec3 centroid;
+		uint32_t index;
+	};
+
+	// bounds of the primitives and of their centroids
+	struct Extent
+	{
+		AABB bounds, centroids;
+
+		void expand(const PrimRef &r)
+		{
+			bounds.expand(r.bounds);
+			centroids.expand(r.centroid);
+		}
+
+		void expand(const Extent &e)
+		{
+			bounds.expand(e.bounds);
+			centroids.expand(e.centroids);
+		}
+	};
+
+	struct Bin
+	{
+		Extent extent;
+		uint32_t count = 0;
+	};
+
+	static const int BINS = 16;
+	static const int MAX_LEAF_SIZE = 4;
+	static const int MAX_DEPTH = 64;
+	// ranges below these sizes are binned, and their subtrees built, on the current task
+	static const size_t PARALLEL_BIN_SIZE = size_t(1) << 15;
+	static const size_t PARALLEL_TASK_SIZE = 1024;
+
+	void build_node(PrimRef *refs, uint32_t node, size_t begin, size_t end, const Extent &extent, int depth);
+	static Extent range_extent(const PrimRef *refs, size_t begin, size_t end);
+
+	template<class Key>
+	void build_lbvh(std::vector<PrimRef> &refs, const Extent &extent);
+	template<class Key>
+	AABB emit_lbvh(const PrimRef *refs, const Key *codes, uint32_t node, size_t begin, size_t end, int depth);
+	void optimize_treelets(uint32_t node, int depth);
+	void reorder_treelet(uint32_t node);
+
+	int wide_children(uint32_t node, int width, uint32_t *children) const;
+
+	int subtree_depth(uint32_t node) const;
+	void finish_stats(uint32_t node, int depth);
+
+private:
+	std::vector<std::unique_ptr<Hitable>> m_hitables;
+	std::vector<Node> m_nodes;
+	std::atomic<uint32_t> m_node_count{ 0 };
+};
+
+namespace detail
+{
+
+// runs chunk(begin, end, partial) over pieces of the range, as tasks when it is large enough,
+// and folds the partial results into one with merge
+template<class T, class Chunk, class Merge>
+T reduce_range(size_t begin, size_t end, size_t parallel_size, Chunk chunk, Merge merge)
+{
+	const size_t count = end - begin;
+	if (!BVH_TASKS || count < parallel_size) {
+		T result;
+		chunk(begin, end, result);
+		return result;
+	}
+	const size_t pieces = std::min<size_t>(64, count / (parallel_size / 4));
+	std::vector<T> partial(pieces);
+	for (size_t p = 0; p < pieces; ++p) {
+        #pragma omp task firstprivate(p) shared(partial, chunk)
+		chunk(begin + count * p / pieces, begin + count * (p + 1) / pieces, partial[p]);
+	}
+    #pragma omp taskwait
+	T result = partial[0];
+	for (size_t p = 1; p < pieces; ++p) {
+		merge(result, partial[p]);
+	}
+	return result;
+}
+
+}
+
+BVH::BVH(std::vector<std::unique_ptr<Hitable>> hitables, const AccelOptions &options) : m_hitables(std::move(hitables))
+{
+	trace::Scope trace_build("bvh build", "build", "primitives", int64_t(m_hitables.size()));
+	auto t0 = std::chrono::steady_clock::now();
+	assign_object_ids(m_hitables);
+	const size_t n = m_hitables.size();
+	m_stats.primitives = n;
+	if (n == 0) {
+		return;
+	}
+
+	std::vector<PrimRef> refs(n);
+	{
+		trace::Scope trace_refs("bvh primitive bounds", "build");
+        #pragma omp parallel for
+		for (int64_t i = 0; i < int64_t(n); ++i) {
+			AABB b = m_hitables[size_t(i)]->bounds();
+			refs[size_t(i)] = { b, b.centroid(), uint32_t(i) };
+		}
+	}
+
+	m_nodes.resize(2 * n - 1);
+	m_node_count = 1;
+	if (options.builder == BVHBuilder::LBVH) {
+		Extent extent;
+        #pragma omp parallel
+        #pragma omp single
+		extent = range_extent(refs.data(), 0, n);
+		if (options.morton_bits > 30) {
+			build_lbvh<uint64_t>(refs, extent);
+		} else {
+			build_lbvh<uint32_t>(refs, extent);
+		}
+		for (int round = 0; round < options.treelet_rounds; ++round) {
+			trace::Scope trace_treelets("bvh treelets", "build", "round", round);
+            #pragma omp parallel
+            #pragma omp single
+			optimize_treelets(0, 0);
+		}
+		if (options.treelet_rounds > 0 && subtree_depth(0) > MAX_DEPTH) {
+			// reordering can deepen the tree; too deep for the traversal stack, go without
+			m_node_count = 1;
+			if (options.morton_bits > 30) {
+				build_lbvh<uint64_t>(refs, extent);
+			} else {
+				build_lbvh<uint32_t>(refs, extent);
+			}
+		}
+	} else {
+		trace::Scope trace_nodes("bvh nodes", "build");
+        #pragma omp parallel
+        #pragma omp single
+		build_node(refs.data(), 0, 0, n, range_extent(refs.data(), 0, n), 0);
+	}
+	m_nodes.resize(m_node_count);
+	m_nodes.shrink_to_fit();
+
+	// leaves index the primitives in build order
+	std::vector<std::unique_ptr<Hitable>> ordered(n);
+	for (size_t i = 0; i < n; ++i) {
+		ordered[i] = std::move(m_hitables[refs[i].index]);
+	}
+	m_hitables.swap(ordered);
+
+	finish_stats(0, 1);
+	m_stats.node_bytes = m_nodes.size() * sizeof(Node);
+	m_stats.sah_cost /= std::max(m_nodes[0].bounds.surface_area(), std::numeric_limits<float>::min());
+	m_stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+BVH::Extent BVH::range_extent(const PrimRef *refs, size_t begin, size_t end)
+{
+	return detail::reduce_range<Extent>(begin, end, PARALLEL_BIN_SIZE,
+		[refs](size_t b, size_t e, Extent &out) {
+			for (size_t i = b; i < e; ++i) {
+				out.expand(refs[i]);
+			}
+		},
+		[](Extent &a, const Extent &b) { a.expand(b); });
+}
+
+// extent comes from the parent's bins, so every level takes one pass for binning and one for
+// partitioning
+void BVH::build_node(PrimRef *refs, uint32_t index, size_t begin, size_t end, const Extent &extent, int depth)
+{
+	Node &node = m_nodes[index];
+	node.bounds = extent.bounds;
+	const size_t count = end - begin;
+	auto make_leaf = [&] {
+		node.offset = uint32_t(begin);
+		node.count = uint16_t(count);
+		node.axis = 0;
+	};
+	if (count <= 1) {
+		make_leaf();
+		return;
+	}
+
+	// binned sah along the widest axis of the centroids (Wald 2007)
+	const int axis = extent.centroids.largest_axis();
+	const float cmin = extent.centroids.min[axis];
+	const float cext = extent.centroids.max[axis] - cmin;
+	const float scale = cext > 0.0f ? BINS / cext : 0.0f;
+	auto bin_of = [=](const PrimRef &r) { return std::min(BINS - 1, int((r.centroid[axis] - cmin) * scale)); };
+	int best_split = -1;
+	float best_cost = std::numeric_limits<float>::max();
+	Extent child_extent[2];
+	if (scale > 0.0f && depth < MAX_DEPTH - 32) {
+		struct Bins
+		{
+			Bin bins[BINS];
+		};
+		Bins bins = detail::reduce_range<Bins>(begin, end, PARALLEL_BIN_SIZE,
+			[&](size_t b, size_t e, Bins &out) {
+				for (size_t i = b; i < e; ++i) {
+					Bin &bin = out.bins[bin_of(refs[i])];
+					bin.extent.expand(refs[i]);
+					bin.count++;
+				}
+			},
+			[](Bins &a, const Bins &b) {
+				for (int k = 0; k < BINS; ++k) {
+					a.bins[k].extent.expand(b.bins[k].extent);
+					a.bins[k].count += b.bins[k].count;
+				}
+			});
+
+		// sweep from the right for the right side costs, then from the left; cost of a split is
+		// 1 traversal + the intersections weighted by the probability of entering each child
+		const float inv_area = 1.0f / std::max(extent.bounds.surface_area(), std::numeric_limits<float>::min());
+		const Bin *b = bins.bins;
+		float right_cost[BINS];
+		AABB acc;
+		uint32_t n = 0;
+		for (int k = BINS - 1; k > 0; --k) {
+			acc.expand(b[k].extent.bounds);
+			n += b[k].count;
+			right_cost[k] = acc.surface_area() * float(n);
+		}
+		acc = AABB();
+		n = 0;
+		for (int k = 0; k < BINS - 1; ++k) {
+			acc.expand(b[k].extent.bounds);
+			n += b[k].count;
+			float cost = 1.0f + (acc.surface_area() * float(n) + right_cost[k + 1]) * inv_area;
+			if (n > 0 && n < count && cost < best_cost) {
+				best_cost = cost;
+				best_split = k + 1;
+			}
+		}
+		for (int k = 0; k < BINS && best_split >= 0; ++k) {
+			child_extent[k < best_split ? 0 : 1].expand(b[k].extent);
+		}
+	}
+
+	if (count <= MAX_LEAF_SIZE && (best_split < 0 || best_cost >= float(count))) {
+		make_leaf();
+		return;
+	}
+
+	PrimRef *mid;
+	if (best_split >= 0) {
+		mid = std::partition(refs + begin, refs + end, [&](const PrimRef &r) { return bin_of(r) < best_split; });
+	} else {
+		// all centroids in one point, or the tree got too deep for sah: halve, which bounds the
+		// depth (and the traversal stack) by MAX_DEPTH
+		mid = refs + begin + count / 2;
+		std::nth_element(refs + begin, mid, refs + end,
+			[axis](const PrimRef &a, const PrimRef &b) { return a.centroid[axis] < b.centroid[axis]; });
+		child_extent[0] = range_extent(refs, begin, size_t(mid - refs));
+		child_extent[1] = range_extent(refs, size_t(mid - refs), end);
+	}
+	const size_t split = size_t(mid - refs);
+
+	const uint32_t left = m_node_count.fetch_add(2, std::memory_order_relaxed);
+	node.offset = left;
+	node.count = 0;
+	node.axis = uint8_t(axis);
+	if (BVH_TASKS && count >= PARALLEL_TASK_SIZE) {
+		const Extent left_extent = child_extent[0];
+        #pragma omp task firstprivate(refs, left, begin, split, left_extent, depth)
+		build_node(refs, left, begin, split, left_extent, depth + 1);
+	} else {
+		build_node(refs, left, begin, split, child_extent[0], depth + 1);
+	}
+	build_node(refs, left + 1, split, end, child_extent[1], depth + 1);
+}
+
+template<class Key>
+void BVH::build_lbvh(std::vector<PrimRef> &refs, const Extent &extent)
+{
+	struct Item
+	{
+		Key code;
+		uint32_t ref;
+	};
+	const size_t n = refs.size();
+	std::vector<Item> items(n);
+	{
+		trace::Scope trace_codes("bvh morton codes", "build");
+		const glm::vec3 origin = extent.centroids.min;
+		const glm::vec3 d = extent.centroids.diagonal();
+		const glm::vec3 scale(d.x > 0.0f ? 1.0f / d.x : 0.0f, d.y > 0.0f ? 1.0f / d.y : 0.0f, d.z > 0.0f ? 1.0f / d.z : 0.0f);
+        #pragma omp parallel for
+		for (int64_t i = 0; i < int64_t(n); ++i) {
+			items[size_t(i)] = { morton::encode<Key>((refs[size_t(i)].centroid - origin) * scale), uint32_t(i) };
+		}
+	}
+	{
+		trace::Scope trace_sort("bvh radix sort", "build");
+		morton::radix_sort(items, [](const Item &it) { return it.code; });
+	}
+
+	std::vector<PrimRef> sorted(n);
+	std::vector<Key> codes(n);
+    #pragma omp parallel for
+	for (int64_t i = 0; i < int64_t(n); ++i) {
+		sorted[size_t(i)] = refs[items[size_t(i)].ref];
+		codes[size_t(i)] = items[size_t(i)].code;
+	}
+	refs.swap(sorted);
+
+	trace::Scope trace_nodes("bvh nodes", "build");
+    #pragma omp parallel
+    #pragma omp single
+	emit_lbvh(refs.data(), codes.data(), 0, 0, n, 0);
+}
+
+// returns the bounds of the subtree
+template<class Key>
+AABB BVH::emit_lbvh(const PrimRef *refs, const Key *codes, uint32_t index, size_t begin, size_t end, int depth)
+{
+	Node &node = m_nodes[index];
+	const size_t count = end - begin;
+	const Key diff = codes[begin] ^ codes[end - 1];
+	if (count == 1 || (diff == 0 && count <= MAX_LEAF_SIZE)) {
+		node.bounds = AABB();
+		for (size_t i = begin; i < end; ++i) {
+			node.bounds.expand(refs[i].bounds);
+		}
+		node.offset = uint32_t(begin);
+		node.count = uint16_t(count);
+		node.axis = 0;
+		return node.bounds;
+	}
+
+	size_t split = begin + count / 2;
+	int axis = 0;
+	if (diff != 0 && depth < MAX_DEPTH - 32) {
+		// the codes of the range share all bits above the highest differing one, so the ones
+		// with that bit clear come first
+		int bit = int(8 * sizeof(Key)) - 1;
+		while (!((diff >> bit) & 1)) {
+			bit--;
+		}
+		const Key mask = Key(1) << bit;
+		split = size_t(std::partition_point(codes + begin, codes + end, [mask](Key c) { return !(c & mask); }) - codes);
+		axis = morton::axis_of_bit(bit);
+	}
+	// else identical codes (or too deep): halve, which bounds the depth by MAX_DEPTH
+
+	const uint32_t left = m_node_count.fetch_add(2, std::memory_order_relaxed);
+	node.offset = left;
+	node.count = 0;
+	node.axis = uint8_t(axis);
+	AABB left_bounds, right_bounds;
+	if (BVH_TASKS && count >= PARALLEL_TASK_SIZE) {
+        #pragma omp task shared(left_bounds) firstprivate(refs, codes, left, begin, split, depth)
+		left_bounds = emit_lbvh(refs, codes, left, begin, split, depth + 1);
+		right_bounds = emit_lbvh(refs, codes, left + 1, split, end, depth + 1);
+        #pragma omp taskwait
+	} else {
+		left_bounds = emit_lbvh(refs, codes, left, begin, split, depth + 1);
+		right_bounds = emit_lbvh(refs, codes, left + 1, split, end, depth + 1);
+	}
+	node.bounds = merge(left_bounds, right_bounds);
+	return node.bounds;
+}
+
+// bottom up, so every treelet is formed from already optimized subtrees; the subtrees of the
+// top levels are tasks
+void BVH::optimize_treelets(uint32_t index, int depth)
+{
+	const Node &node = m_nodes[index];
+	if (node.count > 0) {
+		return;
+	}
+	const uint32_t left = node.offset;
+	if (BVH_TASKS && depth < 8) {
+        #pragma omp task firstprivate(left, depth)
+		optimize_treelets(left, depth + 1);
+		optimize_treelets(left + 1, depth + 1);
+        #pragma omp taskwait
+	} else {
+		optimize_treelets(left, depth + 1);
+		optimize_treelets(left + 1, depth + 1);
+	}
+	reorder_treelet(index);
+}
+
+void BVH::reorder_treelet(uint32_t root)
+{
+	const int TREELET = 7;
+	// grow the treelet by opening the leaf with the largest area; every opened node brings
+	// its pair of child slots, which the new topology reuses
+	uint32_t leaves[TREELET];
+	uint32_t slots[TREELET - 1];
+	int leaf_count = 2, slot_count = 1;
+	leaves[0] = m_nodes[root].offset;
+	leaves[1] = m_nodes[root].offset + 1;
+	slots[0] = m_nodes[root].offset;
+	float old_cost = 0.0f;
+	while (leaf_count < TREELET) {
+		int best = -1;
+		float best_area = -1.0f;
+		for (int i = 0; i < leaf_count; ++i) {
+			const Node &n = m_nodes[leaves[i]];
+			if (n.count == 0 && n.bounds.surface_area() > best_area) {
+				best = i;
+				best_area = n.bounds.surface_area();
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		const uint32_t opened = leaves[best];
+		old_cost += best_area;
+		slots[slot_count++] = m_nodes[opened].offset;
+		leaves[best] = m_nodes[opened].offset;
+		leaves[leaf_count++] = m_nodes[opened].offset + 1;
+	}
+	if (leaf_count < 4) {
+		return; // three leaves have three topologies, not worth it
+	}
+
+	// least internal area of every subset of leaves; the treelet root's area is fixed
+	const int full = (1 << leaf_count) - 1;
+	Node leaf_nodes[TREELET];
+	AABB bounds[1 << TREELET];
+	float cost[1 << TREELET];
+	int choice[1 << TREELET];
+	for (int i = 0; i < leaf_count; ++i) {
+		leaf_nodes[i] = m_nodes[leaves[i]];
+	}
+	for (int s = 1; s <= full; ++s) {
+		int low = 0;
+		while (!((s >> low) & 1)) {
+			low++;
+		}
+		bounds[s] = s == (1 << low) ? leaf_nodes[low].bounds : merge(bounds[s & (s - 1)], leaf_nodes[low].bounds);
+		if (s == (1 << low)) {
+			cost[s] = 0.0f;
+			continue;
+		}
+		// partitions with the lowest leaf on the left side, each unordered split once
+		float best = std::numeric_limits<float>::max();
+		const int rest = s & ~(1 << low);
+		for (int sub = rest; ; sub = (sub - 1) & rest) {
+			const int p = sub | (1 << low);
+			if (p != s) {
+				float c = cost[p] + cost[s ^ p];
+				if (c < best) {
+					best = c;
+					choice[s] = p;
+				}
+			}
+			if (sub == 0) {
+				break;
+			}
+		}
+		cost[s] = best + (s == full ? 0.0f : bounds[s].surface_area());
+	}
+	if (!(cost[full] < old_cost * 0.999f)) {
+		return;
+	}
+
+	// write the new topology into the freed slots, children ordered along the axis that
+	// separates their centroids the most so traversal still goes near child first
+	int next_slot = 0;
+	auto emit = [&](auto &self, int s, uint32_t index) -> void {
+		if ((s & (s - 1)) == 0) {
+			int i = 0;
+			while (s != (1 << i)) {
+				i++;
+			}
+			m_nodes[index] = leaf_nodes[i];
+			return;
+		}
+		int a = choice[s], b = s ^ a;
+		const glm::vec3 d = bounds[b].centroid() - bounds[a].centroid();
+		const glm::vec3 ad = glm::abs(d);
+		const int axis = ad.x > ad.y && ad.x > ad.z ? 0 : (ad.y > ad.z ? 1 : 2);
+		if (d[axis] < 0.0f) {
+			std::swap(a, b);
+		}
+		const uint32_t pair = slots[next_slot++];
+		Node &node = m_nodes[index];
+		node.bounds = bounds[s];
+		node.offset = pair;
+		node.count = 0;
+		node.axis = uint8_t(axis);
+		self(self, a, pair);
+		self(self, b, pair + 1);
+	};
+	emit(emit, full, root);
+}
+
+// the descendants that become the children of a wide node replacing inner node index: the inner
+// child with the largest surface area is opened until there are width of them
+int BVH::wide_children(uint32_t index, int width, uint32_t *children) const
+{
+	children[0] = m_nodes[index].offset;
+	children[1] = m_nodes[index].offset + 1;
+	int count = 2;
+	while (count < width) {
+		int best = -1;
+		float best_area = -1.0f;
+		for (int i = 0; i < count; ++i) {
+			const Node &c = m_nodes[children[i]];
+			if (c.count == 0 && c.bounds.surface_area() > best_area) {
+				best = i;
+				best_area = c.bounds.surface_area();
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		const uint32_t opened = m_nodes[children[best]].offset;
+		children[best] = opened;
+		children[count++] = opened + 1;
+	}
+	return count;
+}
+
+int BVH::subtree_depth(uint32_t index) const
+{
+	const Node &node = m_nodes[index];
+	return node.count > 0 ? 1 : 1 + std::max(subtree_depth(node.offset), subtree_depth(node.offset + 1));
+}
+
+void BVH::finish_stats(uint32_t index, int depth)
+{
+	const Node &node = m_nodes[index];
+	m_stats.nodes++;
+	m_stats.depth = std::max(m_stats.depth, depth);
+	if (node.count > 0) {
+		m_stats.leaves++;
+		m_stats.sah_cost += node.bounds.surface_area() * node.count;
+		return;
+	}
+	m_stats.sah_cost += node.bounds.surface_area();
+	finish_stats(node.offset, depth + 1);
+	finish_stats(node.offset + 1, depth + 1);
+}
+
+bool BVH::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
+{
+	if (m_nodes.empty()) {
+		return false;
+	}
+	const SlabRay ray(r.origin(), r.direction());
+	uint32_t stack[MAX_DEPTH];
+	int top = 0;
+	uint32_t index = 0;
+	HitRecord temp_rec;
+	bool hit_any = false;
+	float closest_so_far = tmax;
+	for (;;) {
+		const Node &node = m_nodes[index];
+		if (node.bounds.hit(ray, tmin, closest_so_far)) {
+			if (node.count == 0) {
+				// near child first, the far one waits on the stack
+				const uint32_t negative = ray.near[node.axis] >= 3 ? 1 : 0;
+				uint32_t near = node.offset + negative;
+				stack[top++] = node.offset + (1 - negative);
+				index = near;
+				continue;
+			}
+			for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+				if (m_hitables[i]->hit(r, tmin, closest_so_far, temp_rec)) {
+					hit_any = true;
+					closest_so_far = temp_rec.t;
+					rec = temp_rec;
+				}
+			}
+		}
+		if (top == 0) {
+			break;
+		}
+		index = stack[--top];
+	}
+	return hit_any;
+}
+
+bool BVH::occluded(const Ray &r, float tmin, float tmax) const
+{
+	if (m_nodes.empty()) {
+		return false;
+	}
+	const SlabRay ray(r.origin(), r.direction());
+	uint32_t stack[MAX_DEPTH];
+	int top = 0;
+	uint32_t index = 0;
+	for (;;) {
+		const Node &node = m_nodes[index];
+		if (node.bounds.hit(ray, tmin, tmax)) {
+			if (node.count == 0) {
+				stack[top++] = node.offset + 1;
+				index = node.offset;
+				continue;
+			}
+			for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+				if (m_hitables[i]->occluded(r, tmin, tmax)) {
+					return true;
+				}
+			}
+		}
+		if (top == 0) {
+			break;
+		}
+		index = stack[--top];
+	}
+	return false;
+}
+
+#endif //BVH_H
@@ -5,49 +5,83 @@
 #include <glm/glm.hpp>
 #include "ray.h"
 #include "random_generator.h"
-
-namespace detail 
-{
-
-float pi() { return std::atan(1.0f)*4.0f; }
-
-}
+#include "sampling.h"
 
 class Camera
 {
 public:
 	Camera(const glm::vec3 &position, const glm::vec3 &lookat, const glm::vec3 &up, 
 		float vfov, float aspect, float aperture, float focus_disk) //vfov is top to bottom in degrees
+		: m_position(position), m_lookat(lookat), m_up(up), m_vfov(vfov), m_aspect(aspect),
+		m_aperture(aperture), m_focus_disk(focus_disk), m_ny(0)
 	{
-		m_lens_radius = aperture / 2.0f;
-		float theta = vfov * detail::pi() / 180.0f;
-		float half_height = std::tan(theta / 2.0f);
-		float half_width = aspect * half_height;
-		m_origin = position;
-		m_w = glm::normalize(position - lookat);
-		m_u = glm::normalize(glm::cross(up, m_w));
-		m_v = glm::cross(m_w, m_u);
-		m_lower_left_corner = m_origin - half_width * focus_disk * m_u - half_height * focus_disk * m_v -  focus_disk * m_w;
-		m_horizontal = 2.0f * half_width * focus_disk * m_u;
-		m_vertical = 2.0f * half_height * focus_disk * m_v;
+		update();
 	}
 
+	// lets generated rays carry a ray cone one pixel wide
+	void set_resolution(int nx, int ny)
+	{
+		m_ny = ny;
+		update();
+	}
+
+	// moves the camera keeping the lens and the field of view
+	void set_view(const glm::vec3 &position, const glm::vec3 &lookat)
+	{
+		m_position = position;
+		m_lookat = lookat;
+		update();
+	}
+
+	void set_fov(float vfov)
+	{
+		m_vfov = vfov;
+		update();
+	}
+
+	const glm::vec3 &position() const { return m_position; }
+	const glm::vec3 &lookat() const { return m_lookat; }
+	const glm::vec3 &up() const { return m_up; }
+	float fov() const { return m_vfov; }
+
 	Ray generate_ray(float s, float t, RandomGenerator<float> &generator) const 
 	{
 		glm::vec3 rd = m_lens_radius * generator.random_in_unit_disk();
 		glm::vec3 offset = m_u * rd.x + m_v * rd.y;
-		return Ray(m_origin + offset, m_lower_left_corner + s * m_horizontal + t * m_vertical - m_origin - offset);
+		Ray r(m_origin + offset, m_lower_left_corner + s * m_horizontal + t * m_vertical - m_origin - offset);
+		r.cone_spread = m_pixel_spread;
+		return r;
 	}
 
 private:
+	void update()
+	{
+		m_lens_radius = m_aperture / 2.0f;
+		float theta = m_vfov * detail::pi() / 180.0f;
+		float half_height = std::tan(theta / 2.0f);
+		float half_width = m_aspect * half_height;
+		m_origin = m_position;
+		m_w = glm::normalize(m_position - m_lookat);
+		m_u = glm::normalize(glm::cross(m_up, m_w));
+		m_v = glm::cross(m_w, m_u);
+		m_lower_left_corner = m_origin - half_width * m_focus_disk * m_u - half_height * m_focus_disk * m_v -  m_focus_disk * m_w;
+		m_horizontal = 2.0f * half_width * m_focus_disk * m_u;
+		m_vertical = 2.0f * half_height * m_focus_disk * m_v;
+		m_pixel_spread = m_ny > 0 ? 2.0f * half_height / float(m_ny) : 0.0f;
+	}
 
 private:
+	glm::vec3 m_position, m_lookat, m_up;
+	float m_vfov, m_aspect, m_aperture, m_focus_disk;
+	int m_ny;
+
 	glm::vec3 m_origin;
 	glm::vec3 m_lower_left_corner;
 	glm::vec3 m_horizontal;
 	glm::vec3 m_vertical;
 	glm::vec3 m_u, m_v, m_w;
 	float m_lens_radius;
+	float m_pixel_spread;
 };
 
 #endif
\ No newline at end of file
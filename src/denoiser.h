@@ -0,0 +1,94 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "framebuffer.h"
+#include "sampling.h"
+
+struct DenoiseParams
+{
+	int iterations = 3;       // a-trous steps with holes 1, 2, 4, ...
+	float sigma_color = 4.0f; // in standard deviations of the pixel estimate
+	float sigma_normal = 128.0f;
+	float sigma_depth = 1.0f; // relative depth difference
+};
+
+// edge avoiding a-trous wavelet filter (Dammertz et al. 2010) on the albedo demodulated color,
+// with edge stopping on normals, depth and the per-pixel noise level. Parallel over 32x32 tiles.
+void denoise(Framebuffer &fb, const DenoiseParams &params = DenoiseParams())
+{
+	if (!fb.aovs.has(AOV_DENOISE_FEATURES)) {
+		return;
+	}
+	const AOVBuffers &aov = fb.aovs;
+	const int w = fb.width;
+	const int h = fb.height;
+	const size_t n = fb.color.size();
+	const float eps = 1e-3f;
+	static const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+	static const int TILE = 32;
+
+	// filter irradiance so that texture detail carried by the albedo survives
+	std::vector<glm::vec3> src(n), dst(n);
+	std::vector<float> sigma_l(n);
+	for (size_t i = 0; i < n; ++i) {
+		src[i] = fb.color[i] / glm::max(aov.albedo[i], eps);
+		float albedo_l = std::max(detail::luminance(aov.albedo[i]), eps);
+		sigma_l[i] = params.sigma_color * std::sqrt(aov.variance[i]) / albedo_l + eps;
+	}
+
+	const int tiles_x = (w + TILE - 1) / TILE;
+	const int tiles_y = (h + TILE - 1) / TILE;
+	for (int it = 0; it < params.iterations; ++it) {
+		const int step = 1 << it;
+        #pragma omp parallel for schedule(dynamic, 1)
+		for (int tile = 0; tile < tiles_x * tiles_y; ++tile) {
+			const int x0 = (tile % tiles_x) * TILE;
+			const int y0 = (tile / tiles_x) * TILE;
+			for (int y = y0; y < std::min(y0 + TILE, h); ++y) {
+				for (int x = x0; x < std::min(x0 + TILE, w); ++x) {
+					const size_t p = size_t(y) * w + x;
+					const float lp = detail::luminance(src[p]);
+					const glm::vec3 np = aov.normal[p];
+					const float dp = aov.depth[p];
+					glm::vec3 sum(0.0f);
+					float wsum = 0.0f;
+					for (int dy = -2; dy <= 2; ++dy) {
+						const int qy = y + dy * step;
+						if (qy < 0 || qy >= h) {
+							continue;
+						}
+						for (int dx = -2; dx <= 2; ++dx) {
+							const int qx = x + dx * step;
+							if (qx < 0 || qx >= w) {
+								continue;
+							}
+							const size_t q = size_t(qy) * w + qx;
+							float wl = std::abs(lp - detail::luminance(src[q])) / sigma_l[p];
+							float wn = std::pow(std::max(0.0f, glm::dot(np, aov.normal[q])), params.sigma_normal);
+							float wd = std::abs(dp - aov.depth[q]) / (params.sigma_depth * std::max(dp, eps) * float(step) + eps);
+							float weight = kernel[std::abs(dx)] * kernel[std::abs(dy)] * wn * std::exp(-wl - wd);
+							sum += weight * src[q];
+							wsum += weight;
+						}
+					}
+					dst[p] = wsum > 0.0f ? sum / wsum : src[p];
+				}
+			}
+		}
+		std::swap(src, dst);
+		// the noise level drops with every pass
+		for (size_t i = 0; i < n; ++i) {
+			sigma_l[i] *= 0.5f;
+		}
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		fb.color[i] = src[i] * glm::max(aov.albedo[i], eps);
+	}
+}
+
+#endif //DENOISER_H
@@ -0,0 +1,514 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+// Coordinator/worker rendering over tcp or unix sockets. The coordinator hands out batches of
+// tiles of the global tile grid, workers render them with render_tile() and stream back the raw
+// float film tiles, and the coordinator merges them in tile order. Tiles are seeded from their
+// grid position, so the merged image is bit identical to a single process render no matter how
+// the work was split. Tiles held by a worker that goes away or stops answering are put back into
+// the queue.
+//
+// Floats travel in host byte order; all processes are expected to run the same build on
+// machines of the same endianness, which the config hash exchanged on connect partly checks.
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+#include "film.h"
+#include "framebuffer.h"
+#include "renderer.h"
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <algorithm>
+#include <poll.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+namespace net {
+
+enum MessageType : uint32_t
+{
+	MSG_HELLO = 1, // worker -> coordinator: Hello
+	MSG_ASSIGN,    // coordinator -> worker: int32 tile indices
+	MSG_RESULT,    // worker -> coordinator: int32 tile index, film tile sums then weights
+	MSG_DONE,      // coordinator -> worker: no more work, exit
+};
+
+struct MessageHeader
+{
+	uint32_t type;
+	uint32_t size;
+};
+
+// far above any assignment or film tile; larger headers drop the connection before allocating
+static const uint32_t MAX_MESSAGE_SIZE = 16u << 20;
+
+struct Hello
+{
+	uint64_t config; // hash of everything that changes the image
+	uint32_t threads;
+	uint32_t pad;
+};
+
+inline bool send_all(int fd, const void *data, size_t size)
+{
+	const char *p = static_cast<const char *>(data);
+	while (size > 0) {
+		ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= size_t(n);
+	}
+	return true;
+}
+
+inline bool recv_all(int fd, void *data, size_t size)
+{
+	char *p = static_cast<char *>(data);
+	while (size > 0) {
+		ssize_t n = ::recv(fd, p, size, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= size_t(n);
+	}
+	return true;
+}
+
+inline bool send_message(int fd, uint32_t type, const void *payload, size_t size)
+{
+	MessageHeader header = { type, uint32_t(size) };
+	return send_all(fd, &header, sizeof(header)) && (size == 0 || send_all(fd, payload, size));
+}
+
+inline bool recv_message(int fd, uint32_t &type, std::vector<char> &payload)
+{
+	MessageHeader header;
+	if (!recv_all(fd, &header, sizeof(header))) {
+		return false;
+	}
+	if (header.size > MAX_MESSAGE_SIZE) {
+		return false;
+	}
+	type = header.type;
+	payload.resize(header.size);
+	return header.size == 0 || recv_all(fd, payload.data(), header.size);
+}
+
+inline void set_nodelay(int fd)
+{
+	// assignments are tiny and latency bound; fails harmlessly on unix sockets
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// a blocked recv or send fails after seconds, and on tcp the kernel probes idle connections, so
+// a peer that hangs or whose host disappears without closing the connection is noticed
+inline void set_timeouts(int fd, double seconds)
+{
+	timeval tv;
+	tv.tv_sec = time_t(seconds);
+	tv.tv_usec = suseconds_t((seconds - double(tv.tv_sec)) * 1e6);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+#ifdef TCP_KEEPIDLE
+	// fail harmlessly on unix sockets
+	int idle = 10, interval = 5, count = 3;
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+}
+
+// "unix:/path/to/socket" or "host:port". An empty host is the loopback interface, listening on
+// every interface takes an explicit "*:port".
+inline int open_socket(const std::string &address, bool listening)
+{
+	if (address.compare(0, 5, "unix:") == 0) {
+		std::string path = address.substr(5);
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+			return -1;
+		}
+		std::strcpy(addr.sun_path, path.c_str());
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			return -1;
+		}
+		if (listening) {
+			::unlink(path.c_str());
+			if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 && listen(fd, 64) == 0) {
+				return fd;
+			}
+		} else if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0) {
+			return fd;
+		}
+		::close(fd);
+		return -1;
+	}
+
+	size_t colon = address.rfind(':');
+	if (colon == std::string::npos) {
+		return -1;
+	}
+	std::string host = address.substr(0, colon);
+	std::string port = address.substr(colon + 1);
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	// connecting to "*" goes to the loopback interface, like an empty host
+	const bool any = host == "*";
+	hints.ai_flags = listening && any ? AI_PASSIVE : 0;
+	addrinfo *res = nullptr;
+	if (getaddrinfo(host.empty() || any ? nullptr : host.c_str(), port.c_str(), &hints, &res) != 0) {
+		return -1;
+	}
+	int fd = -1;
+	for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0) {
+			continue;
+		}
+		if (listening) {
+			int one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) {
+				break;
+			}
+		} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			set_nodelay(fd);
+			break;
+		}
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+} // namespace net
+
+// starts count local workers by re-running this executable with the given arguments
+std::vector<pid_t> spawn_workers(const std::vector<std::string> &args, int count)
+{
+	std::vector<pid_t> pids;
+	std::vector<char *> argv;
+	for (const std::string &a : args) {
+		argv.push_back(const_cast<char *>(a.c_str()));
+	}
+	argv.push_back(nullptr);
+	for (int i = 0; i < count; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			execv("/proc/self/exe", argv.data());
+			execvp(argv[0], argv.data());
+			_exit(127);
+		}
+		if (pid > 0) {
+			pids.push_back(pid);
+		}
+	}
+	return pids;
+}
+
+// hands the tiles of region out to whichever workers connect to address and merges their results
+// into fb. spawned are the local worker processes, if any: when all of them are gone and nobody
+// else is connected the render fails instead of waiting forever. A worker that holds tiles and
+// sends nothing for timeout seconds counts as lost, like one whose connection closed.
+bool render_coordinator(const std::string &address, uint64_t config, const Filter &filter,
+	const PixelBounds &region, Framebuffer &fb, const std::vector<pid_t> &spawned, double timeout = 300.0)
+{
+	using Clock = std::chrono::steady_clock;
+	struct Worker
+	{
+		int fd;
+		uint32_t threads;
+		std::vector<int> outstanding;
+		Clock::time_point deadline; // for the next message while tiles are outstanding
+	};
+	const auto patience = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(timeout));
+
+	int listen_fd = net::open_socket(address, true);
+	if (listen_fd < 0) {
+		std::cerr << "could not listen on " << address << std::endl;
+		return false;
+	}
+
+	Film film(fb.width, fb.height, filter);
+	TileGrid grid(region.intersect({ 0, 0, fb.width, fb.height }));
+	std::deque<int> queue;
+	for (int i = 0; i < grid.count(); ++i) {
+		queue.push_back(i);
+	}
+	std::vector<char> done(grid.count(), 0);
+	int remaining = grid.count();
+	std::vector<Worker> workers;
+	std::vector<pid_t> children = spawned; // not reaped yet
+	auto reap = [&children]() {
+		pid_t pid;
+		while (!children.empty() && (pid = waitpid(-1, nullptr, WNOHANG)) > 0) {
+			children.erase(std::remove(children.begin(), children.end(), pid), children.end());
+		}
+	};
+	std::vector<char> payload;
+	bool ok = true;
+
+	auto drop = [&](Worker &w) {
+		// whatever it was rendering goes to the front so the ordered merge isn't held up
+		for (auto it = w.outstanding.rbegin(); it != w.outstanding.rend(); ++it) {
+			queue.push_front(*it);
+		}
+		if (!w.outstanding.empty()) {
+			std::cerr << "worker lost, reissuing " << w.outstanding.size() << " tiles" << std::endl;
+		}
+		w.outstanding.clear();
+		::close(w.fd);
+		w.fd = -1;
+	};
+
+	while (remaining > 0) {
+		// keep two batches in flight per worker so it never waits on the network
+		for (Worker &w : workers) {
+			if (w.threads == 0 || w.outstanding.size() > w.threads) {
+				continue;
+			}
+			std::vector<int32_t> batch;
+			while (!queue.empty() && batch.size() < w.threads) {
+				int tile = queue.front();
+				queue.pop_front();
+				if (!done[tile]) {
+					batch.push_back(tile);
+				}
+			}
+			if (batch.empty()) {
+				break;
+			}
+			if (!net::send_message(w.fd, net::MSG_ASSIGN, batch.data(), batch.size() * sizeof(int32_t))) {
+				queue.insert(queue.begin(), batch.begin(), batch.end());
+				drop(w);
+				continue;
+			}
+			if (w.outstanding.empty()) {
+				w.deadline = Clock::now() + patience;
+			}
+			w.outstanding.insert(w.outstanding.end(), batch.begin(), batch.end());
+		}
+		workers.erase(std::remove_if(workers.begin(), workers.end(),
+			[](const Worker &w) { return w.fd < 0; }), workers.end());
+
+		std::vector<pollfd> fds(1 + workers.size());
+		fds[0] = { listen_fd, POLLIN, 0 };
+		for (size_t i = 0; i < workers.size(); ++i) {
+			fds[i + 1] = { workers[i].fd, POLLIN, 0 };
+		}
+		if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) {
+			ok = false;
+			break;
+		}
+
+		for (size_t i = 0; i < workers.size(); ++i) {
+			if (!fds[i + 1].revents) {
+				continue;
+			}
+			Worker &w = workers[i];
+			uint32_t type;
+			if (!net::recv_message(w.fd, type, payload)) {
+				drop(w);
+				continue;
+			}
+			w.deadline = Clock::now() + patience;
+			if (type == net::MSG_HELLO && payload.size() == sizeof(net::Hello)) {
+				net::Hello hello;
+				std::memcpy(&hello, payload.data(), sizeof(hello));
+				if (hello.config != config) {
+					std::cerr << "worker rejected, it was started with different render options" << std::endl;
+					net::send_message(w.fd, net::MSG_DONE, nullptr, 0);
+					drop(w);
+					continue;
+				}
+				w.threads = std::max(1u, hello.threads);
+			} else if (type == net::MSG_RESULT && payload.size() >= sizeof(int32_t)) {
+				int32_t index;
+				std::memcpy(&index, payload.data(), sizeof(index));
+				auto it = std::find(w.outstanding.begin(), w.outstanding.end(), index);
+				if (it == w.outstanding.end()) {
+					drop(w);
+					continue;
+				}
+				FilmTile tile = film.make_tile(grid.tile(index).x0, grid.tile(index).y0,
+					grid.tile(index).x1, grid.tile(index).y1);
+				size_t n = tile.weights().size();
+				if (payload.size() != sizeof(int32_t) + n * (sizeof(glm::vec3) + sizeof(float))) {
+					drop(w);
+					continue;
+				}
+				w.outstanding.erase(it);
+				const char *p = payload.data() + sizeof(int32_t);
+				std::memcpy(&tile.sums()[0].x, p, n * sizeof(glm::vec3));
+				std::memcpy(tile.weights().data(), p + n * sizeof(glm::vec3), n * sizeof(float));
+				if (!done[index]) {
+					done[index] = 1;
+					remaining--;
+					film.merge_tile(index, std::move(tile));
+				}
+			} else {
+				drop(w);
+			}
+		}
+
+		const Clock::time_point now = Clock::now();
+		for (Worker &w : workers) {
+			if (w.fd >= 0 && !w.outstanding.empty() && now > w.deadline) {
+				std::cerr << "worker sent nothing for " << timeout << " s" << std::endl;
+				drop(w);
+			}
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, nullptr, nullptr);
+			if (fd >= 0) {
+				net::set_nodelay(fd);
+				net::set_timeouts(fd, timeout);
+				workers.push_back({ fd, 0, {}, now + patience });
+			}
+		}
+
+		reap();
+		if (!spawned.empty() && children.empty() && workers.empty() && remaining > 0) {
+			std::cerr << "all workers exited with " << remaining << " tiles left" << std::endl;
+			ok = false;
+			break;
+		}
+	}
+
+	for (Worker &w : workers) {
+		if (w.fd >= 0) {
+			net::send_message(w.fd, net::MSG_DONE, nullptr, 0);
+			::close(w.fd);
+		}
+	}
+	::close(listen_fd);
+	if (address.compare(0, 5, "unix:") == 0) {
+		::unlink(address.c_str() + 5);
+	}
+	// spawned workers that hang don't get to hold up the exit
+	const Clock::time_point give_up = Clock::now() + patience;
+	for (reap(); !children.empty() && Clock::now() < give_up; reap()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	for (pid_t pid : children) {
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+	}
+
+	film.flush();
+	film.resolve(fb.color);
+	return ok;
+}
+
+// renders the tiles the coordinator at address assigns until it says it is done. fail_after > 0
+// makes the worker die without a word after that many tiles, to exercise the reissue path.
+int render_worker(const std::string &address, uint64_t config, const Scene &scene, int num_samples,
+	const Filter &filter, const PixelBounds &region, int width, int height, int fail_after = 0)
+{
+	int fd = -1;
+	// the coordinator may still be starting up
+	for (int attempt = 0; attempt < 100 && fd < 0; ++attempt) {
+		fd = net::open_socket(address, false);
+		if (fd < 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+	if (fd < 0) {
+		std::cerr << "could not connect to coordinator at " << address << std::endl;
+		return 1;
+	}
+
+	net::Hello hello = { config, std::max(1u, std::thread::hardware_concurrency()), 0 };
+	if (!net::send_message(fd, net::MSG_HELLO, &hello, sizeof(hello))) {
+		::close(fd);
+		return 1;
+	}
+
+	Film film(width, height, filter);
+	TileGrid grid(region.intersect({ 0, 0, width, height }));
+	std::vector<char> payload;
+	int sent = 0;
+	bool connected = true;
+	uint32_t type;
+	while (connected && net::recv_message(fd, type, payload) && type == net::MSG_ASSIGN) {
+		std::vector<int32_t> batch(payload.size() / sizeof(int32_t));
+		std::memcpy(batch.data(), payload.data(), batch.size() * sizeof(int32_t));
+
+        #pragma omp parallel for schedule(dynamic, 1)
+		for (int i = 0; i < int(batch.size()); ++i) {
+			if (batch[i] < 0 || batch[i] >= grid.count()) {
+				continue;
+			}
+			FilmTile tile = render_tile<false>(scene, VirtualWorld(scene), num_samples, grid, batch[i], film, nullptr);
+			size_t n = tile.weights().size();
+			std::vector<char> result(sizeof(int32_t) + n * (sizeof(glm::vec3) + sizeof(float)));
+			std::memcpy(result.data(), &batch[i], sizeof(int32_t));
+			std::memcpy(result.data() + sizeof(int32_t), &tile.sums()[0].x, n * sizeof(glm::vec3));
+			std::memcpy(result.data() + sizeof(int32_t) + n * sizeof(glm::vec3), tile.weights().data(), n * sizeof(float));
+            #pragma omp critical(worker_send)
+			{
+				if (connected && fail_after > 0 && sent == fail_after) {
+					_exit(3);
+				}
+				connected = connected && net::send_message(fd, net::MSG_RESULT, result.data(), result.size());
+				sent++;
+			}
+		}
+	}
+	::close(fd);
+	return connected ? 0 : 1;
+}
+
+#else
+
+inline std::vector<int> spawn_workers(const std::vector<std::string> &, int) { return {}; }
+
+inline bool render_coordinator(const std::string &, uint64_t, const Filter &, const PixelBounds &,
+	Framebuffer &, const std::vector<int> &, double = 300.0)
+{
+	std::cerr << "distributed rendering needs posix sockets" << std::endl;
+	return false;
+}
+
+inline int render_worker(const std::string &, uint64_t, const Scene &, int, const Filter &,
+	const PixelBounds &, int, int, int = 0)
+{
+	std::cerr << "distributed rendering needs posix sockets" << std::endl;
+	return 1;
+}
+
+#endif
+
+#endif //DISTRIBUTED_H
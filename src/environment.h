@@ -0,0 +1,156 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "light.h"
+#include "sampling.h"
+#include "image_io.h"
+
+// equirectangular float image plus the 2d distribution used to importance sample it,
+// built once per file and shared by every light and frame that uses it
+class EnvironmentMap
+{
+public:
+	EnvironmentMap(int width, int height, std::vector<float> rgb);
+
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+
+	glm::vec3 lookup(const glm::vec2 &uv) const
+	{
+		int x = std::min(int(uv.x * float(m_width)), m_width - 1);
+		int y = std::min(int(uv.y * float(m_height)), m_height - 1);
+		const float *p = &m_rgb[3 * (size_t(y) * m_width + x)];
+		return glm::vec3(p[0], p[1], p[2]);
+	}
+
+	const Distribution2D &distribution() const { return m_distribution; }
+	glm::vec3 average() const { return m_average; }
+
+	static std::shared_ptr<const EnvironmentMap> load(const std::string &path);
+
+private:
+	int m_width, m_height;
+	std::vector<float> m_rgb;
+	Distribution2D m_distribution;
+	glm::vec3 m_average;
+};
+
+EnvironmentMap::EnvironmentMap(int width, int height, std::vector<float> rgb)
+	: m_width(width), m_height(height), m_rgb(std::move(rgb)), m_average(0.0f)
+{
+	// weight by sin(theta) so that the stretched rows near the poles aren't oversampled
+	std::vector<float> func(size_t(width) * height);
+	for (int y = 0; y < height; ++y) {
+		float sin_theta = std::sin(detail::pi() * (float(y) + 0.5f) / float(height));
+		for (int x = 0; x < width; ++x) {
+			const float *p = &m_rgb[3 * (size_t(y) * width + x)];
+			glm::vec3 c(p[0], p[1], p[2]);
+			func[size_t(y) * width + x] = detail::luminance(c) * sin_theta;
+			m_average += c * sin_theta;
+		}
+	}
+	m_average *= detail::pi() / (2.0f * float(width) * float(height));
+	m_distribution = Distribution2D(func.data(), size_t(width), size_t(height));
+}
+
+std::shared_ptr<const EnvironmentMap> EnvironmentMap::load(const std::string &path)
+{
+	static std::mutex mutex;
+	static std::map<std::string, std::weak_ptr<const EnvironmentMap>> cache;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (auto cached = cache[path].lock()) {
+		return cached;
+	}
+	int w, h;
+	std::vector<float> rgb;
+	if (!load_pfm(path, w, h, rgb)) {
+		return nullptr;
+	}
+	auto map = std::make_shared<const EnvironmentMap>(w, h, std::move(rgb));
+	cache[path] = map;
+	return map;
+}
+
+// infinitely distant light given by an environment map, y is up
+class EnvironmentLight : public Light
+{
+public:
+	EnvironmentLight(std::shared_ptr<const EnvironmentMap> map, float scale = 1.0f)
+		: m_map(map), m_scale(scale) {}
+
+	virtual bool sample(const glm::vec3 &p, RandomGenerator<float> &rand, LightSample &ls) const override;
+	virtual float pdf(const glm::vec3 &p, const glm::vec3 &wi, const HitRecord &rec) const override
+	{
+		return pdf(wi);
+	}
+	virtual glm::vec3 power() const override
+	{
+		// per unit of projected area, there is no finite extent to scale with
+		return m_scale * detail::pi() * m_map->average();
+	}
+	virtual AABB bounds() const override { return AABB(); }
+	virtual bool infinite() const override { return true; }
+
+	glm::vec3 radiance(const glm::vec3 &dir) const
+	{
+		return m_scale * m_map->lookup(direction_to_uv(glm::normalize(dir)));
+	}
+
+	float pdf(const glm::vec3 &wi) const;
+
+private:
+	static glm::vec2 direction_to_uv(const glm::vec3 &d)
+	{
+		float theta = std::acos(glm::clamp(d.y, -1.0f, 1.0f));
+		float phi = std::atan2(d.z, d.x);
+		if (phi < 0.0f) {
+			phi += 2.0f * detail::pi();
+		}
+		return glm::vec2(std::min(phi / (2.0f * detail::pi()), 0.99999994f), std::min(theta / detail::pi(), 0.99999994f));
+	}
+
+private:
+	std::shared_ptr<const EnvironmentMap> m_map;
+	float m_scale;
+};
+
+bool EnvironmentLight::sample(const glm::vec3 &p, RandomGenerator<float> &rand, LightSample &ls) const
+{
+	float map_pdf;
+	glm::vec2 uv = m_map->distribution().sample(rand.gen(), rand.gen(), map_pdf);
+	if (map_pdf <= 0.0f) {
+		return false;
+	}
+	float theta = uv.y * detail::pi();
+	float phi = uv.x * 2.0f * detail::pi();
+	float sin_theta = std::sin(theta);
+	if (sin_theta <= 0.0f) {
+		return false;
+	}
+	ls.wi = glm::vec3(sin_theta * std::cos(phi), std::cos(theta), sin_theta * std::sin(phi));
+	ls.dist = std::numeric_limits<float>::max();
+	// uv area to solid angle
+	ls.pdf = map_pdf / (2.0f * detail::pi() * detail::pi() * sin_theta);
+	ls.radiance = m_scale * m_map->lookup(uv);
+	return true;
+}
+
+float EnvironmentLight::pdf(const glm::vec3 &wi) const
+{
+	glm::vec2 uv = direction_to_uv(glm::normalize(wi));
+	float sin_theta = std::sin(uv.y * detail::pi());
+	if (sin_theta <= 0.0f) {
+		return 0.0f;
+	}
+	return m_map->distribution().pdf(uv) / (2.0f * detail::pi() * detail::pi() * sin_theta);
+}
+
+#endif //ENVIRONMENT_H
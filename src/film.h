@@ -0,0 +1,246 @@
+#ifndef FILM_H
+#define FILM_H
+
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "sampling.h"
+
+// half-open pixel rectangle [x0, x1) x [y0, y1)
+struct PixelBounds
+{
+	int x0, y0, x1, y1;
+
+	bool empty() const { return x0 >= x1 || y0 >= y1; }
+	int area() const { return empty() ? 0 : (x1 - x0) * (y1 - y0); }
+
+	PixelBounds intersect(const PixelBounds &b) const
+	{
+		return { std::max(x0, b.x0), std::max(y0, b.y0), std::min(x1, b.x1), std::min(y1, b.y1) };
+	}
+
+	PixelBounds expand(int margin) const
+	{
+		return { x0 - margin, y0 - margin, x1 + margin, y1 + margin };
+	}
+};
+
+enum class FilterType { Box, Gaussian, Mitchell, BlackmanHarris };
+
+inline FilterType filter_from_string(const std::string &name)
+{
+	if (name == "box") return FilterType::Box;
+	if (name == "mitchell") return FilterType::Mitchell;
+	if (name == "blackman-harris") return FilterType::BlackmanHarris;
+	return FilterType::Gaussian;
+}
+
+// separable reconstruction filter, tabulated over |x| in [0, radius)
+class Filter
+{
+public:
+	static const int TABLE_SIZE = 64;
+
+	Filter(FilterType type = FilterType::Gaussian, float radius = 1.5f);
+
+	float radius() const { return m_radius; }
+
+	// x and y are offsets from the pixel center in pixels
+	float weight(float x, float y) const
+	{
+		x = std::abs(x);
+		y = std::abs(y);
+		if (x >= m_radius || y >= m_radius) {
+			return 0.0f;
+		}
+		// x just below the radius can round up to TABLE_SIZE
+		return m_table[std::min(int(x * m_inv_step), TABLE_SIZE - 1)] * m_table[std::min(int(y * m_inv_step), TABLE_SIZE - 1)];
+	}
+
+private:
+	static float evaluate(FilterType type, float x, float radius);
+
+private:
+	float m_radius;
+	float m_inv_step;
+	float m_table[TABLE_SIZE];
+};
+
+Filter::Filter(FilterType type, float radius)
+	: m_radius(radius), m_inv_step(float(TABLE_SIZE) / radius)
+{
+	for (int i = 0; i < TABLE_SIZE; ++i) {
+		// sample the middle of each table cell
+		m_table[i] = evaluate(type, (float(i) + 0.5f) / m_inv_step, radius);
+	}
+}
+
+float Filter::evaluate(FilterType type, float x, float radius)
+{
+	switch (type) {
+	case FilterType::Box:
+		return 1.0f;
+	case FilterType::Gaussian: {
+		// falls to ~2% at the radius, shifted down to reach 0 there
+		const float alpha = 4.0f / (radius * radius);
+		return std::max(0.0f, std::exp(-alpha * x * x) - std::exp(-alpha * radius * radius));
+	}
+	case FilterType::Mitchell: {
+		// B = C = 1/3, the kernel spans [-2, 2] scaled to the radius
+		const float B = 1.0f / 3.0f, C = 1.0f / 3.0f;
+		float t = 2.0f * x / radius;
+		if (t < 1.0f) {
+			return ((12 - 9 * B - 6 * C) * t * t * t + (-18 + 12 * B + 6 * C) * t * t + (6 - 2 * B)) / 6.0f;
+		}
+		if (t < 2.0f) {
+			return ((-B - 6 * C) * t * t * t + (6 * B + 30 * C) * t * t + (-12 * B - 48 * C) * t + (8 * B + 24 * C)) / 6.0f;
+		}
+		return 0.0f;
+	}
+	case FilterType::BlackmanHarris: {
+		const float a0 = 0.35875f, a1 = 0.48829f, a2 = 0.14128f, a3 = 0.01168f;
+		float t = 0.5f + 0.5f * x / radius; // window peak at the center
+		float w = 2.0f * detail::pi() * t;
+		return a0 - a1 * std::cos(w) + a2 * std::cos(2.0f * w) - a3 * std::cos(3.0f * w);
+	}
+	}
+	return 0.0f;
+}
+
+// weighted sample sums of a rectangle of pixels, extended by the filter radius so that samples
+// near the tile border can splat into the neighbours. Owned by one thread, no synchronization.
+class FilmTile
+{
+public:
+	FilmTile() : m_x0(0), m_y0(0), m_width(0), m_height(0), m_filter(nullptr) {}
+	FilmTile(int x0, int y0, int x1, int y1, const Filter &filter)
+		: m_x0(x0), m_y0(y0), m_width(x1 - x0), m_height(y1 - y0), m_filter(&filter),
+		m_sum(size_t(m_width) * m_height, glm::vec3(0.0f)), m_weight(size_t(m_width) * m_height, 0.0f) {}
+
+	// pos is the continuous film position in pixels
+	void add_sample(const glm::vec2 &pos, const glm::vec3 &color)
+	{
+		const float r = m_filter->radius();
+		int px0 = std::max(m_x0, int(std::ceil(pos.x - 0.5f - r)));
+		int px1 = std::min(m_x0 + m_width - 1, int(std::floor(pos.x - 0.5f + r)));
+		int py0 = std::max(m_y0, int(std::ceil(pos.y - 0.5f - r)));
+		int py1 = std::min(m_y0 + m_height - 1, int(std::floor(pos.y - 0.5f + r)));
+		for (int y = py0; y <= py1; ++y) {
+			for (int x = px0; x <= px1; ++x) {
+				float w = m_filter->weight(pos.x - (float(x) + 0.5f), pos.y - (float(y) + 0.5f));
+				size_t i = size_t(y - m_y0) * m_width + (x - m_x0);
+				m_sum[i] += w * color;
+				m_weight[i] += w;
+			}
+		}
+	}
+
+	PixelBounds bounds() const { return { m_x0, m_y0, m_x0 + m_width, m_y0 + m_height }; }
+	std::vector<glm::vec3> &sums() { return m_sum; }
+	std::vector<float> &weights() { return m_weight; }
+	const std::vector<glm::vec3> &sums() const { return m_sum; }
+	const std::vector<float> &weights() const { return m_weight; }
+
+private:
+	int m_x0, m_y0, m_width, m_height;
+	const Filter *m_filter;
+	std::vector<glm::vec3> m_sum;
+	std::vector<float> m_weight;
+};
+
+// accumulates filtered samples over the whole image; pixel (x, y) has y going up like the camera's v
+class Film
+{
+public:
+	Film(int width, int height, const Filter &filter)
+		: m_width(width), m_height(height), m_filter(filter),
+		m_sum(size_t(width) * height, glm::vec3(0.0f)), m_weight(size_t(width) * height, 0.0f) {}
+
+	const Filter &filter() const { return m_filter; }
+	int width() const { return m_width; }
+	int height() const { return m_height; }
+
+	// tile for the sample positions inside pixels [x0, x1) x [y0, y1)
+	FilmTile make_tile(int x0, int y0, int x1, int y1) const
+	{
+		int margin = int(std::ceil(m_filter.radius()));
+		return FilmTile(std::max(0, x0 - margin), std::max(0, y0 - margin),
+			std::min(m_width, x1 + margin), std::min(m_height, y1 + margin), m_filter);
+	}
+
+	// called once per finished tile, so one lock is cheap. Tiles overlap by the filter radius and
+	// float sums depend on order, so tiles are added strictly by index: early arrivals wait in
+	// m_pending until their predecessors are in, which keeps the image independent of scheduling.
+	void merge_tile(int index, FilmTile tile)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pending.emplace(index, std::move(tile));
+		while (!m_pending.empty() && m_pending.begin()->first == m_next) {
+			add(m_pending.begin()->second);
+			m_pending.erase(m_pending.begin());
+			m_next++;
+		}
+	}
+
+	// adds tiles still waiting on a predecessor that never arrived, in index order
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto &p : m_pending) {
+			add(p.second);
+		}
+		m_pending.clear();
+	}
+
+	// drops everything accumulated so far, tile numbering starts again at 0
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::fill(m_sum.begin(), m_sum.end(), glm::vec3(0.0f));
+		std::fill(m_weight.begin(), m_weight.end(), 0.0f);
+		m_pending.clear();
+		m_next = 0;
+	}
+
+	// normalized pixels, top row first
+	void resolve(std::vector<glm::vec3> &out) const
+	{
+		out.resize(m_sum.size());
+		for (int y = 0; y < m_height; ++y) {
+			for (int x = 0; x < m_width; ++x) {
+				size_t i = size_t(y) * m_width + x;
+				out[size_t(m_height - 1 - y) * m_width + x] = m_weight[i] > 0.0f ? m_sum[i] / m_weight[i] : glm::vec3(0.0f);
+			}
+		}
+	}
+
+private:
+	void add(const FilmTile &tile)
+	{
+		const PixelBounds b = tile.bounds();
+		const int tw = b.x1 - b.x0;
+		for (int y = b.y0; y < b.y1; ++y) {
+			for (int x = b.x0; x < b.x1; ++x) {
+				size_t src = size_t(y - b.y0) * tw + (x - b.x0);
+				size_t dst = size_t(y) * m_width + x;
+				m_sum[dst] += tile.sums()[src];
+				m_weight[dst] += tile.weights()[src];
+			}
+		}
+	}
+
+private:
+	int m_width, m_height;
+	Filter m_filter;
+	std::mutex m_mutex;
+	std::map<int, FilmTile> m_pending;
+	int m_next = 0;
+	std::vector<glm::vec3> m_sum;
+	std::vector<float> m_weight;
+};
+
+#endif //FILM_H
@@ -0,0 +1,229 @@
+#ifndef FLIP_H
+#define FLIP_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+// LDR FLIP (Andersson et al. 2020, "FLIP: A Difference Evaluator for Alternating Images"):
+// a per pixel perceptual difference in [0, 1] from a color pipeline (contrast sensitivity
+// filtering in YCxCz, Hunt adjusted HyAB distance in L*a*b*) raised to a power that edge and
+// point differences pull down. Images are compared as displayed: clamped, gamma 2 like
+// write_image. ppd is the pixels per degree of visual angle, 67 for a 0.7 m wide 4k screen at 0.7 m.
+namespace flip
+{
+
+namespace detail
+{
+
+// D65 reference white
+const glm::vec3 WHITE(0.950428545f, 1.0f, 1.088900371f);
+
+inline glm::vec3 linear_rgb_to_xyz(const glm::vec3 &c)
+{
+	return glm::vec3(0.4124564f * c.r + 0.3575761f * c.g + 0.1804375f * c.b,
+		0.2126729f * c.r + 0.7151522f * c.g + 0.0721750f * c.b,
+		0.0193339f * c.r + 0.1191920f * c.g + 0.9503041f * c.b);
+}
+
+inline glm::vec3 xyz_to_linear_rgb(const glm::vec3 &c)
+{
+	return glm::vec3(3.2404542f * c.x - 1.5371385f * c.y - 0.4985314f * c.z,
+		-0.9692660f * c.x + 1.8760108f * c.y + 0.0415560f * c.z,
+		0.0556434f * c.x - 0.2040259f * c.y + 1.0572252f * c.z);
+}
+
+inline glm::vec3 xyz_to_ycxcz(const glm::vec3 &c)
+{
+	glm::vec3 n = c / WHITE;
+	return glm::vec3(116.0f * n.y - 16.0f, 500.0f * (n.x - n.y), 200.0f * (n.y - n.z));
+}
+
+inline glm::vec3 ycxcz_to_xyz(const glm::vec3 &c)
+{
+	float y = (c.x + 16.0f) / 116.0f;
+	return glm::vec3(c.y / 500.0f + y, y, y - c.z / 200.0f) * WHITE;
+}
+
+inline glm::vec3 xyz_to_lab(const glm::vec3 &c)
+{
+	auto f = [](float t) {
+		const float delta = 6.0f / 29.0f;
+		return t > delta * delta * delta ? std::cbrt(t) : t / (3.0f * delta * delta) + 4.0f / 29.0f;
+	};
+	glm::vec3 n = c / WHITE;
+	return glm::vec3(116.0f * f(n.y) - 16.0f, 500.0f * (f(n.x) - f(n.y)), 200.0f * (f(n.y) - f(n.z)));
+}
+
+inline glm::vec3 hunt(const glm::vec3 &lab)
+{
+	return glm::vec3(lab.x, 0.01f * lab.x * lab.y, 0.01f * lab.x * lab.z);
+}
+
+inline float hyab(const glm::vec3 &a, const glm::vec3 &b)
+{
+	glm::vec3 d = a - b;
+	return std::abs(d.x) + std::sqrt(d.y * d.y + d.z * d.z);
+}
+
+inline float srgb_to_linear(float c)
+{
+	return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+// square kernel of side 2 * radius + 1
+struct Kernel
+{
+	int radius;
+	std::vector<float> w;
+
+	float at(int x, int y) const { return w[size_t(y + radius) * (2 * radius + 1) + (x + radius)]; }
+};
+
+// contrast sensitivity of one opponent channel as a sum of two gaussians, normalized to 1
+inline Kernel csf_kernel(float a1, float b1, float a2, float b2, float ppd, int radius)
+{
+	const float pi = 3.14159265f;
+	Kernel k{ radius, std::vector<float>(size_t(2 * radius + 1) * (2 * radius + 1)) };
+	float sum = 0.0f;
+	for (int y = -radius; y <= radius; ++y) {
+		for (int x = -radius; x <= radius; ++x) {
+			float d2 = float(x * x + y * y) / (ppd * ppd);
+			float g = a1 * std::sqrt(pi / b1) * std::exp(-pi * pi * d2 / b1) +
+				a2 * std::sqrt(pi / b2) * std::exp(-pi * pi * d2 / b2);
+			k.w[size_t(y + radius) * (2 * radius + 1) + (x + radius)] = g;
+			sum += g;
+		}
+	}
+	for (float &v : k.w) {
+		v /= sum;
+	}
+	return k;
+}
+
+// first (edge) or second (point) derivative of a gaussian along x, with the positive and the
+// negative lobes each normalized to a sum of 1
+inline Kernel feature_kernel(float sigma, int radius, bool second)
+{
+	Kernel k{ radius, std::vector<float>(size_t(2 * radius + 1) * (2 * radius + 1)) };
+	float pos = 0.0f, neg = 0.0f;
+	for (int y = -radius; y <= radius; ++y) {
+		for (int x = -radius; x <= radius; ++x) {
+			float g = std::exp(-float(x * x + y * y) / (2.0f * sigma * sigma));
+			float v = second ? (float(x * x) / (sigma * sigma) - 1.0f) * g : -float(x) * g;
+			k.w[size_t(y + radius) * (2 * radius + 1) + (x + radius)] = v;
+			(v > 0.0f ? pos : neg) += v;
+		}
+	}
+	for (float &v : k.w) {
+		v /= v > 0.0f ? pos : -neg;
+	}
+	return k;
+}
+
+// convolution with clamped borders; transpose swaps the kernel axes (the y derivative)
+template<typename P>
+P convolve(const std::vector<P> &img, int w, int h, int x, int y, const Kernel &k, bool transpose = false)
+{
+	P sum(0.0f);
+	for (int dy = -k.radius; dy <= k.radius; ++dy) {
+		int sy = std::min(std::max(y + dy, 0), h - 1);
+		for (int dx = -k.radius; dx <= k.radius; ++dx) {
+			int sx = std::min(std::max(x + dx, 0), w - 1);
+			sum += (transpose ? k.at(dy, dx) : k.at(dx, dy)) * img[size_t(sy) * w + sx];
+		}
+	}
+	return sum;
+}
+
+}
+
+// per pixel FLIP error of test against reference, both linear rgb
+inline std::vector<float> error_map(const std::vector<glm::vec3> &reference, const std::vector<glm::vec3> &test,
+	int width, int height, float ppd = 67.0f)
+{
+	using namespace detail;
+	const float pi = 3.14159265f;
+	const float qc = 0.7f, qf = 0.5f, pc = 0.4f, pt = 0.95f;
+	const size_t n = size_t(width) * height;
+
+	// displayed values back to linear light, then to the opponent space
+	auto prepare = [&](const std::vector<glm::vec3> &img, std::vector<glm::vec3> &ycxcz, std::vector<float> &luma) {
+		ycxcz.resize(n);
+		luma.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			glm::vec3 d = glm::sqrt(glm::clamp(img[i], 0.0f, 1.0f));
+			glm::vec3 lin(srgb_to_linear(d.r), srgb_to_linear(d.g), srgb_to_linear(d.b));
+			glm::vec3 xyz = linear_rgb_to_xyz(lin);
+			ycxcz[i] = xyz_to_ycxcz(xyz);
+			luma[i] = xyz.y;
+		}
+	};
+	std::vector<glm::vec3> ref_c, test_c;
+	std::vector<float> ref_y, test_y;
+	prepare(reference, ref_c, ref_y);
+	prepare(test, test_c, test_y);
+
+	// csf parameters (a1, b1, a2, b2) of the achromatic, red-green and blue-yellow channels
+	const float b_max = 0.04f;
+	const int csf_radius = int(std::ceil(3.0f * std::sqrt(b_max / (2.0f * pi * pi)) * ppd));
+	const Kernel csf[3] = {
+		csf_kernel(1.0f, 0.0047f, 0.0f, 1e-5f, ppd, csf_radius),
+		csf_kernel(1.0f, 0.0053f, 0.0f, 1e-5f, ppd, csf_radius),
+		csf_kernel(34.1f, 0.04f, 13.5f, 0.025f, ppd, csf_radius),
+	};
+	const float sigma = 0.5f * 0.082f * ppd;
+	const int feature_radius = int(std::ceil(3.0f * sigma));
+	const Kernel edge = feature_kernel(sigma, feature_radius, false);
+	const Kernel point = feature_kernel(sigma, feature_radius, true);
+
+	const glm::vec3 green = hunt(xyz_to_lab(linear_rgb_to_xyz(glm::vec3(0.0f, 1.0f, 0.0f))));
+	const glm::vec3 blue = hunt(xyz_to_lab(linear_rgb_to_xyz(glm::vec3(0.0f, 0.0f, 1.0f))));
+	const float cmax = std::pow(hyab(green, blue), qc);
+
+	std::vector<float> err(n);
+    #pragma omp parallel for schedule(dynamic, 4)
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			glm::vec3 lab[2];
+			float edge_mag[2], point_mag[2];
+			for (int k = 0; k < 2; ++k) {
+				const std::vector<glm::vec3> &c = k == 0 ? ref_c : test_c;
+				const std::vector<float> &l = k == 0 ? ref_y : test_y;
+				glm::vec3 filtered(0.0f);
+				for (int ch = 0; ch < 3; ++ch) {
+					filtered[ch] = convolve(c, width, height, x, y, csf[ch])[ch];
+				}
+				glm::vec3 rgb = glm::clamp(xyz_to_linear_rgb(ycxcz_to_xyz(filtered)), 0.0f, 1.0f);
+				lab[k] = hunt(xyz_to_lab(linear_rgb_to_xyz(rgb)));
+				float ex = convolve(l, width, height, x, y, edge), ey = convolve(l, width, height, x, y, edge, true);
+				float px = convolve(l, width, height, x, y, point), py = convolve(l, width, height, x, y, point, true);
+				edge_mag[k] = std::sqrt(ex * ex + ey * ey);
+				point_mag[k] = std::sqrt(px * px + py * py);
+			}
+			// compress large color differences into the top 5% of the range
+			float dc = std::pow(hyab(lab[0], lab[1]), qc);
+			dc = dc < pc * cmax ? pt * dc / (pc * cmax) : pt + (dc - pc * cmax) / (cmax - pc * cmax) * (1.0f - pt);
+			float df = std::max(std::abs(edge_mag[0] - edge_mag[1]), std::abs(point_mag[0] - point_mag[1]));
+			df = std::pow(df / std::sqrt(2.0f), qf);
+			err[size_t(y) * width + x] = std::pow(std::min(dc, 1.0f), 1.0f - std::min(df, 1.0f));
+		}
+	}
+	return err;
+}
+
+inline double mean_error(const std::vector<glm::vec3> &reference, const std::vector<glm::vec3> &test,
+	int width, int height, float ppd = 67.0f)
+{
+	std::vector<float> err = error_map(reference, test, width, height, ppd);
+	double sum = 0.0;
+	for (float e : err) {
+		sum += e;
+	}
+	return err.empty() ? 0.0 : sum / double(err.size());
+}
+
+}
+
+#endif //FLIP_H
@@ -0,0 +1,25 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "aov.h"
+
+// linear radiance of a render, top row first, plus whichever aovs were requested
+struct Framebuffer
+{
+	int width = 0;
+	int height = 0;
+	std::vector<glm::vec3> color;
+	AOVBuffers aovs;
+
+	Framebuffer() {}
+	Framebuffer(int w, int h, uint32_t aov_mask = 0)
+		: width(w), height(h), color(size_t(w) * h, glm::vec3(0.0f))
+	{
+		aovs.allocate(aov_mask, color.size());
+	}
+};
+
+#endif //FRAMEBUFFER_H
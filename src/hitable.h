@@ -3,7 +3,11 @@
 
 #include <vector>
 #include <memory>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
 #include "ray.h"
+#include "aabb.h"
 
 class Material;
 
@@ -13,19 +17,82 @@ struct HitRecord
 	glm::vec3 p;
 	glm::vec3 normal;
 	Material *mat_ptr;
+	glm::vec2 uv;
+	float uv_scale;      // world space length covered by one unit of uv, for texture lod
+	float footprint = 0; // world space width of the ray cone at p, filled in by the integrator
+	uint32_t object_id;
 };
 
 class Hitable
 {
 public:
+	virtual ~Hitable() {}
 	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const = 0;
+	// any-hit query for shadow rays: stops at the first intersection in (tmin, tmax)
+	virtual bool occluded(const Ray &r, float tmin, float tmax) const
+	{
+		HitRecord rec;
+		return hit(r, tmin, tmax, rec);
+	}
+	// world space box around everything hit() can return, for acceleration structures
+	virtual AABB bounds() const = 0;
+
+	// hit() of count rays, recs[i] is set where hits[i] is 1. Overridden where rays are cheaper
+	// to trace together, like OutOfCoreWorld.
+	virtual void hit_batch(const Ray *rays, size_t count, float tmin, float tmax, HitRecord *recs, uint8_t *hits) const
+	{
+		for (size_t i = 0; i < count; ++i) {
+			hits[i] = hit(rays[i], tmin, tmax, recs[i]);
+		}
+	}
+	// occluded() of count shadow rays, ray i ends at tmax[i]
+	virtual void occluded_batch(const Ray *rays, const float *tmax, size_t count, float tmin, uint8_t *occluded) const
+	{
+		for (size_t i = 0; i < count; ++i) {
+			occluded[i] = this->occluded(rays[i], tmin, tmax[i]);
+		}
+	}
+
+	// identifies the primitive in object id aovs, 0 is reserved for the background
+	uint32_t id() const { return m_id; }
+	void set_id(uint32_t id) { m_id = id; }
+
+protected:
+	uint32_t m_id = 0;
 };
 
-class Sphere : public Hitable
+// numbers primitives 1..n in list order
+inline void assign_object_ids(const std::vector<std::unique_ptr<Hitable>> &hitables)
+{
+	for (size_t i = 0; i < hitables.size(); ++i) {
+		hitables[i]->set_id(uint32_t(i + 1));
+	}
+}
+
+class Sphere final : public Hitable
 {
 public:
 	Sphere(glm::vec3 c, float r, std::shared_ptr<Material> mat) : m_center(c), m_radius(r), m_material(mat) {}
 	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override;
+	virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+	virtual AABB bounds() const override
+	{
+		glm::vec3 r(std::abs(m_radius));
+		return AABB(m_center - r, m_center + r);
+	}
+
+	glm::vec3 center() const { return m_center; }
+	float radius() const { return m_radius; }
+	Material *material() const { return m_material.get(); }
+	const std::shared_ptr<Material> &shared_material() const { return m_material; }
+
+private:
+	static glm::vec2 sphere_uv(const glm::vec3 &n)
+	{
+		float theta = std::acos(glm::clamp(-n.y, -1.0f, 1.0f));
+		float phi = std::atan2(-n.z, n.x) + 3.14159265f;
+		return glm::vec2(phi * 0.15915494f, theta * 0.31830989f);
+	}
 
 private:
 	glm::vec3 m_center;
@@ -40,8 +107,10 @@ bool Sphere::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
 	glm::vec3 oc = r.origin() - m_center;
 	float a = glm::dot(r.direction(), r.direction());
 	float b = glm::dot(oc, r.direction());
-	float c = glm::dot(oc, oc) - m_radius * m_radius;
-	float discr = b * b - a*c;
+	// b*b - a*c, with c = |oc|^2 - R*R, cancels for small spheres far away and lets rays that
+	// miss by a few percent of R through; the squared distance of C from the line doesn't
+	glm::vec3 l = oc - (b / a) * r.direction();
+	float discr = a * (m_radius * m_radius - glm::dot(l, l));
 	if (discr > 0) {
 		float temp = (-b - std::sqrt(discr)) / a;
 		if (temp < tmax && temp > tmin) {
@@ -49,6 +118,9 @@ bool Sphere::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
 			rec.p = r.pt(temp);
 			rec.normal = (rec.p - m_center) / m_radius;
 			rec.mat_ptr = m_material.get();
+			rec.object_id = m_id;
+			rec.uv = sphere_uv(rec.normal);
+			rec.uv_scale = 4.44288294f * m_radius; // sqrt(2pi * pi) * r
 			return true;
 		}
 		temp = (-b + std::sqrt(discr)) / a;
@@ -57,29 +129,144 @@ bool Sphere::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
 			rec.p = r.pt(temp);
 			rec.normal = (rec.p - m_center) / m_radius;
 			rec.mat_ptr = m_material.get();
+			rec.object_id = m_id;
+			rec.uv = sphere_uv(rec.normal);
+			rec.uv_scale = 4.44288294f * m_radius; // sqrt(2pi * pi) * r
 			return true;
 		}
 	}
 	return false;
 }
 
+bool Sphere::occluded(const Ray &r, float tmin, float tmax) const
+{
+	glm::vec3 oc = r.origin() - m_center;
+	float a = glm::dot(r.direction(), r.direction());
+	float b = glm::dot(oc, r.direction());
+	glm::vec3 l = oc - (b / a) * r.direction();
+	float discr = a * (m_radius * m_radius - glm::dot(l, l));
+	if (discr <= 0) {
+		return false;
+	}
+	float sq = std::sqrt(discr);
+	float t0 = (-b - sq) / a;
+	float t1 = (-b + sq) / a;
+	return (t0 < tmax && t0 > tmin) || (t1 < tmax && t1 > tmin);
+}
+
+// parallelogram spanned by the edges u and v from the corner q, two-sided
+class Quad final : public Hitable
+{
+public:
+	Quad(const glm::vec3 &q, const glm::vec3 &u, const glm::vec3 &v, std::shared_ptr<Material> mat)
+		: m_q(q), m_u(u), m_v(v), m_material(mat)
+	{
+		glm::vec3 n = glm::cross(u, v);
+		m_normal = glm::normalize(n);
+		m_d = glm::dot(m_normal, q);
+		m_w = n / glm::dot(n, n);
+		m_uv_scale = std::sqrt(glm::length(n));
+	}
+	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override;
+	virtual AABB bounds() const override
+	{
+		AABB b;
+		for (const glm::vec3 &p : { m_q, m_q + m_u, m_q + m_v, m_q + m_u + m_v }) {
+			b.expand(p);
+		}
+		// axis aligned quads would give a flat box, which slab tests can miss edge on
+		glm::vec3 pad(1e-4f * std::max(1.0f, std::max(glm::length(m_u), glm::length(m_v))));
+		return AABB(b.min - pad, b.max + pad);
+	}
+
+	glm::vec3 corner() const { return m_q; }
+	glm::vec3 edge_u() const { return m_u; }
+	glm::vec3 edge_v() const { return m_v; }
+	Material *material() const { return m_material.get(); }
+	const std::shared_ptr<Material> &shared_material() const { return m_material; }
+
+private:
+	glm::vec3 m_q, m_u, m_v;
+	glm::vec3 m_normal;
+	glm::vec3 m_w;
+	float m_d;
+	float m_uv_scale;
+	std::shared_ptr<Material> m_material;
+};
+
+bool Quad::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
+{
+	float denom = glm::dot(m_normal, r.direction());
+	if (std::abs(denom) < 1e-8f) {
+		return false;
+	}
+	float t = (m_d - glm::dot(m_normal, r.origin())) / denom;
+	if (t >= tmax || t <= tmin) {
+		return false;
+	}
+	glm::vec3 p = r.pt(t);
+	glm::vec3 planar = p - m_q;
+	float alpha = glm::dot(m_w, glm::cross(planar, m_v));
+	float beta = glm::dot(m_w, glm::cross(m_u, planar));
+	if (alpha < 0.0f || alpha > 1.0f || beta < 0.0f || beta > 1.0f) {
+		return false;
+	}
+	rec.t = t;
+	rec.p = p;
+	// face the incoming ray so that walls can be hit from either side
+	rec.normal = denom < 0.0f ? m_normal : -m_normal;
+	rec.mat_ptr = m_material.get();
+	rec.object_id = m_id;
+	rec.uv = glm::vec2(alpha, beta);
+	rec.uv_scale = m_uv_scale;
+	return true;
+}
+
+// the primitives' boxes are kept next to them, so rays skip the hit() calls of everything they
+// pass by with a slab test on contiguous memory
 class HitableList: public Hitable
 {
 public:
-	HitableList(std::vector<std::unique_ptr<Hitable>> hitables) : m_hitables(std::move(hitables)) {}
+	HitableList(std::vector<std::unique_ptr<Hitable>> hitables) : m_hitables(std::move(hitables))
+	{
+		assign_object_ids(m_hitables);
+		m_bounds.reserve(m_hitables.size());
+		for (const auto &h : m_hitables) {
+			m_bounds.push_back(h->bounds());
+		}
+	}
 	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override;
+	virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+	virtual AABB bounds() const override
+	{
+		AABB b;
+		for (const AABB &o : m_bounds) {
+			b.expand(o);
+		}
+		return b;
+	}
+
+	const std::vector<std::unique_ptr<Hitable>> &hitables() const { return m_hitables; }
+	// hands the primitives over, e.g. to an acceleration structure, and leaves the list empty
+	std::vector<std::unique_ptr<Hitable>> release()
+	{
+		m_bounds.clear();
+		return std::move(m_hitables);
+	}
 
 private:
 	std::vector<std::unique_ptr<Hitable>> m_hitables;
+	std::vector<AABB> m_bounds;
 };
 
 bool HitableList::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
 {
+	const SlabRay ray(r.origin(), r.direction());
 	HitRecord temp_rec;
 	bool hit_any = false;
 	float closest_so_far = tmax;
 	for (size_t i = 0; i < m_hitables.size(); ++i) {
-		if (m_hitables[i]->hit(r, tmin, closest_so_far, temp_rec)) {
+		if (m_bounds[i].hit(ray, tmin, closest_so_far) && m_hitables[i]->hit(r, tmin, closest_so_far, temp_rec)) {
 			hit_any = true;
 			closest_so_far = temp_rec.t;
 			rec = temp_rec;
@@ -88,6 +275,16 @@ bool HitableList::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) cons
 	return hit_any;
 }
 
+bool HitableList::occluded(const Ray &r, float tmin, float tmax) const
+{
+	const SlabRay ray(r.origin(), r.direction());
+	for (size_t i = 0; i < m_hitables.size(); ++i) {
+		if (m_bounds[i].hit(ray, tmin, tmax) && m_hitables[i]->occluded(r, tmin, tmax)) {
+			return true;
+		}
+	}
+	return false;
+}
 
 
 #endif
\ No newline at end of file
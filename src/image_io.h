@@ -0,0 +1,119 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "stb_image_write.h"
+
+// Portable Float Map (.pfm) RGB images. Pixels are stored top row first in memory,
+// the file itself is bottom row first.
+
+inline bool host_is_little_endian()
+{
+	uint32_t one = 1;
+	uint8_t first;
+	std::memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+inline bool load_pfm(const std::string &path, int &width, int &height, std::vector<float> &rgb)
+{
+	FILE *f = std::fopen(path.c_str(), "rb");
+	if (!f) {
+		return false;
+	}
+	char magic[3] = {};
+	float scale = 0.0f;
+	if (std::fscanf(f, "%2s %d %d %f", magic, &width, &height, &scale) != 4 || std::strcmp(magic, "PF") != 0
+		|| width <= 0 || height <= 0) {
+		std::fclose(f);
+		return false;
+	}
+	std::fgetc(f); // single whitespace before the raster
+	const size_t row = size_t(width) * 3;
+	rgb.resize(row * size_t(height));
+	bool swap = (scale < 0.0f) != host_is_little_endian();
+	for (int y = height - 1; y >= 0; --y) {
+		if (std::fread(&rgb[size_t(y) * row], sizeof(float), row, f) != row) {
+			std::fclose(f);
+			return false;
+		}
+	}
+	std::fclose(f);
+	if (swap) {
+		for (float &v : rgb) {
+			uint8_t b[4];
+			std::memcpy(b, &v, 4);
+			std::swap(b[0], b[3]);
+			std::swap(b[1], b[2]);
+			std::memcpy(&v, b, 4);
+		}
+	}
+	return true;
+}
+
+inline bool write_pfm(const std::string &path, int width, int height, const float *rgb)
+{
+	FILE *f = std::fopen(path.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	std::fprintf(f, "PF\n%d %d\n%s\n", width, height, host_is_little_endian() ? "-1.0" : "1.0");
+	const size_t row = size_t(width) * 3;
+	bool ok = true;
+	for (int y = height - 1; y >= 0 && ok; --y) {
+		ok = std::fwrite(rgb + size_t(y) * row, sizeof(float), row, f) == row;
+	}
+	std::fclose(f);
+	return ok;
+}
+
+inline bool ends_with(const std::string &s, const std::string &suffix)
+{
+	return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// .pfm keeps the linear floats, anything else is gamma corrected 8 bit png
+inline bool write_image(const std::string &path, int width, int height, const std::vector<glm::vec3> &pixels)
+{
+	if (ends_with(path, ".pfm")) {
+		return write_pfm(path, width, height, &pixels[0].x);
+	}
+	std::vector<uint8_t> img(size_t(width) * height * 3);
+	for (size_t i = 0; i < pixels.size(); ++i) {
+		// gamma correct it
+		glm::vec3 c = glm::clamp(glm::vec3(glm::sqrt(glm::max(pixels[i], 0.0f))), 0.0f, 1.0f);
+		img[3 * i + 0] = uint8_t(255.99f*c.r);
+		img[3 * i + 1] = uint8_t(255.99f*c.g);
+		img[3 * i + 2] = uint8_t(255.99f*c.b);
+	}
+	return stbi_write_png(path.c_str(), width, height, 3, img.data(), 0) != 0;
+}
+
+inline std::vector<glm::vec3> to_rgb(const std::vector<float> &v)
+{
+	std::vector<glm::vec3> r(v.size());
+	for (size_t i = 0; i < v.size(); ++i) {
+		r[i] = glm::vec3(v[i]);
+	}
+	return r;
+}
+
+// on display values (clamped, gamma 2), so emitters and fireflies don't dominate the error
+inline double rmse(const std::vector<glm::vec3> &a, const std::vector<glm::vec3> &b)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		glm::vec3 d = glm::sqrt(glm::clamp(a[i], 0.0f, 1.0f)) - glm::sqrt(glm::clamp(b[i], 0.0f, 1.0f));
+		sum += double(glm::dot(d, d)) / 3.0;
+	}
+	return a.empty() ? 0.0 : std::sqrt(sum / double(a.size()));
+}
+
+#endif //IMAGE_IO_H
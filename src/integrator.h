@@ -0,0 +1,214 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "ray.h"
+#include "hitable.h"
+#include "material.h"
+#include "light.h"
+#include "light_sampler.h"
+#include "environment.h"
+#include "scene.h"
+#include "aov.h"
+#include "random_generator.h"
+
+static const int DEPTH = 16;
+static const float SHADOW_EPSILON = 0.001f;
+// ray cone spread after a diffuse bounce, coarse enough to keep indirect texture lookups on small mips
+static const float DIFFUSE_CONE_SPREAD = 0.2f;
+
+namespace detail
+{
+// rays traced by this thread; the renderer collects it per tile for throughput numbers
+inline thread_local uint64_t rays_traced = 0;
+}
+
+// the scene's own polymorphic world: every hit and material call goes through a vtable.
+// StaticWorld (static_integrator.h) provides the same interface with concrete types.
+struct VirtualWorld
+{
+	const Hitable &root;
+
+	explicit VirtualWorld(const Scene &scene) : root(*scene.world) {}
+
+	bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const { return root.hit(r, tmin, tmax, rec); }
+	bool occluded(const Ray &r, float tmin, float tmax) const { return root.occluded(r, tmin, tmax); }
+
+	// for the wavefront integrator, see Hitable::hit_batch()
+	void hit_batch(const Ray *rays, size_t count, float tmin, float tmax, HitRecord *recs, uint8_t *hits) const
+	{
+		root.hit_batch(rays, count, tmin, tmax, recs, hits);
+	}
+
+	void occluded_batch(const Ray *rays, const float *tmax, size_t count, float tmin, uint8_t *occluded) const
+	{
+		root.occluded_batch(rays, tmax, count, tmin, occluded);
+	}
+
+	// calls f with the material of the hit
+	template<class F>
+	auto visit_material(const HitRecord &rec, F &&f) const { return f(*rec.mat_ptr); }
+};
+
+// a light sample of next event estimation: contribution is added where the shadow ray, which
+// ends at tmax, is unoccluded
+struct DirectSample
+{
+	Ray shadow;
+	float tmax;
+	glm::vec3 contribution;
+};
+
+// one light sample, weighted against bsdf sampling of the same direction. False where there is
+// nothing to add whether or not the light is visible.
+template<class Mat>
+bool sample_light(const Ray &r, const HitRecord &rec, const Mat &mat, const Scene &scene, RandomGenerator<float> &generator,
+	DirectSample &ds)
+{
+	float select_pdf;
+	const Light *light = scene.lights.sample(rec.p, generator.gen(), select_pdf);
+	if (!light) {
+		return false;
+	}
+	LightSample ls;
+	if (!light->sample(rec.p, generator, ls) || ls.pdf <= 0.0f) {
+		return false;
+	}
+	glm::vec3 f = mat.eval(r, rec, ls.wi);
+	if (f == glm::vec3(0.0f)) {
+		return false;
+	}
+	float light_pdf = select_pdf * ls.pdf;
+	float weight = detail::power_heuristic(light_pdf, mat.pdf(r, rec, ls.wi));
+	ds.shadow = Ray(rec.p, ls.wi);
+	ds.tmax = ls.dist * (1.0f - SHADOW_EPSILON);
+	ds.contribution = f * ls.radiance * (weight / light_pdf);
+	return true;
+}
+
+// next event estimation: sample_light() and its shadow ray
+template<class World, class Mat>
+glm::vec3 sample_direct(const Ray &r, const HitRecord &rec, const Mat &mat, const Scene &scene, const World &world,
+	RandomGenerator<float> &generator)
+{
+	DirectSample ds;
+	if (!sample_light(r, rec, mat, scene, generator, ds)) {
+		return glm::vec3(0.0f);
+	}
+	detail::rays_traced++;
+	if (world.occluded(ds.shadow, SHADOW_EPSILON, ds.tmax)) {
+		return glm::vec3(0.0f);
+	}
+	return ds.contribution;
+}
+
+// WithAOV is a template parameter so that the plain beauty pass carries none of the aov bookkeeping.
+// World supplies intersection and the material dispatch, see VirtualWorld.
+template<bool WithAOV, class World>
+glm::vec3 trace_path(const Ray &r, const Scene &scene, const World &world, RandomGenerator<float> &generator,
+	AOVSample *aov)
+{
+	glm::vec3 radiance(0.0f);
+	glm::vec3 throughput(1.0f);
+	Ray ray = r;
+	// state of the previous bounce, needed to mis-weight emitters hit by bsdf sampling
+	bool specular_bounce = true;
+	float bsdf_pdf = 0.0f;
+	glm::vec3 prev_p;
+	bool need_albedo = WithAOV;
+	if (WithAOV) {
+		aov->albedo = glm::vec3(1.0f);
+		aov->normal = glm::vec3(0.0f);
+		aov->depth = 0.0f;
+		aov->material_id = aov->object_id = 0;
+		for (auto &b : aov->bounce) {
+			b = glm::vec3(0.0f);
+		}
+	}
+
+	for (int depth = 0; ; depth++) {
+		HitRecord rec;
+		detail::rays_traced++;
+		if (!world.hit(ray, 0.001f, std::numeric_limits<float>::max(), rec)) {
+			glm::vec3 background = scene.background(ray);
+			if (scene.environment && !specular_bounce) {
+				float light_pdf = scene.lights.pdf(prev_p, scene.environment) * scene.environment->pdf(ray.direction());
+				background *= detail::power_heuristic(bsdf_pdf, light_pdf);
+			}
+			radiance += throughput * background;
+			if (WithAOV) {
+				aov->bounce[std::min(depth, AOV_MAX_BOUNCES - 1)] += throughput * background;
+				if (need_albedo) {
+					aov->albedo = throughput * background;
+				}
+			}
+			break;
+		}
+		float ray_length = glm::length(ray.direction());
+		rec.footprint = ray.cone_width + ray.cone_spread * rec.t * ray_length;
+
+		// one dispatch per bounce, everything below sees the concrete material type when World has it
+		bool terminated = world.visit_material(rec, [&](const auto &mat) {
+			if (WithAOV) {
+				if (depth == 0) {
+					aov->normal = rec.normal;
+					aov->depth = rec.t * ray_length;
+					aov->material_id = mat.id();
+					aov->object_id = rec.object_id;
+				}
+				if (need_albedo && (!mat.is_specular() || mat.light())) {
+					aov->albedo = throughput * mat.albedo(rec);
+					need_albedo = false;
+				}
+			}
+
+			glm::vec3 emitted = mat.emitted(ray, rec);
+			const Light *light = mat.light();
+			if (light && !specular_bounce) {
+				float light_pdf = scene.lights.pdf(prev_p, light) * light->pdf(prev_p, glm::normalize(ray.direction()), rec);
+				emitted *= detail::power_heuristic(bsdf_pdf, light_pdf);
+			}
+			glm::vec3 contribution = throughput * emitted;
+
+			Ray scattered;
+			glm::vec3 attenuation;
+			if (depth >= DEPTH || !mat.scatter(ray, rec, generator, attenuation, scattered)) {
+				radiance += contribution;
+				if (WithAOV) {
+					aov->bounce[std::min(depth, AOV_MAX_BOUNCES - 1)] += contribution;
+				}
+				return true;
+			}
+			specular_bounce = mat.is_specular();
+			if (!specular_bounce) {
+				contribution += throughput * sample_direct(ray, rec, mat, scene, world, generator);
+				bsdf_pdf = mat.pdf(ray, rec, glm::normalize(scattered.direction()));
+			}
+			radiance += contribution;
+			if (WithAOV) {
+				aov->bounce[std::min(depth, AOV_MAX_BOUNCES - 1)] += contribution;
+			}
+			throughput *= attenuation;
+			prev_p = rec.p;
+			scattered.cone_width = rec.footprint;
+			scattered.cone_spread = specular_bounce ? ray.cone_spread : std::max(ray.cone_spread, DIFFUSE_CONE_SPREAD);
+			ray = scattered;
+			return false;
+		});
+		if (terminated) {
+			break;
+		}
+	}
+	return radiance;
+}
+
+template<bool WithAOV>
+glm::vec3 output_color(const Ray &r, const Scene &scene, RandomGenerator<float> &generator, AOVSample *aov)
+{
+	return trace_path<WithAOV>(r, scene, VirtualWorld(scene), generator, aov);
+}
+
+#endif //INTEGRATOR_H
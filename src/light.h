@@ -0,0 +1,172 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "hitable.h"
+#include "aabb.h"
+#include "random_generator.h"
+#include "sampling.h"
+
+struct LightSample
+{
+	glm::vec3 wi;       // unit direction from the shading point towards the light
+	float dist;         // distance to the sampled point on the light
+	float pdf;          // solid angle density of wi
+	glm::vec3 radiance; // emitted radiance arriving along -wi
+};
+
+class Light
+{
+public:
+	virtual ~Light() {}
+	// samples a direction towards the light as seen from p
+	virtual bool sample(const glm::vec3 &p, RandomGenerator<float> &rand, LightSample &ls) const = 0;
+	// solid angle density of having sampled wi from p, given a ray from p that hit the light at rec
+	virtual float pdf(const glm::vec3 &p, const glm::vec3 &wi, const HitRecord &rec) const = 0;
+	// total emitted power, used to weight light selection
+	virtual glm::vec3 power() const = 0;
+	// spatial extent of the emitter, used by the light bvh
+	virtual AABB bounds() const = 0;
+	// infinitely distant lights have no bounds and are never hit by a ray
+	virtual bool infinite() const { return false; }
+};
+
+// sphere emitter, sampled uniformly inside the cone it subtends
+class SphereLight : public Light
+{
+public:
+	SphereLight(const glm::vec3 &c, float r, const glm::vec3 &emit)
+		: m_center(c), m_radius(r), m_emit(emit) {}
+
+	virtual bool sample(const glm::vec3 &p, RandomGenerator<float> &rand, LightSample &ls) const override;
+	virtual float pdf(const glm::vec3 &p, const glm::vec3 &wi, const HitRecord &rec) const override;
+	virtual glm::vec3 power() const override
+	{
+		return m_emit * 4.0f * detail::pi() * detail::pi() * m_radius * m_radius;
+	}
+	virtual AABB bounds() const override
+	{
+		return AABB(m_center - glm::vec3(m_radius), m_center + glm::vec3(m_radius));
+	}
+
+	glm::vec3 center() const { return m_center; }
+	float radius() const { return m_radius; }
+	glm::vec3 emission() const { return m_emit; }
+
+private:
+	float cos_theta_max(const glm::vec3 &p) const
+	{
+		float sin2 = m_radius * m_radius / glm::dot(m_center - p, m_center - p);
+		return std::sqrt(std::max(0.0f, 1.0f - sin2));
+	}
+
+private:
+	glm::vec3 m_center;
+	float m_radius;
+	glm::vec3 m_emit;
+};
+
+bool SphereLight::sample(const glm::vec3 &p, RandomGenerator<float> &rand, LightSample &ls) const
+{
+	glm::vec3 to_center = m_center - p;
+	float dc2 = glm::dot(to_center, to_center);
+	if (dc2 <= m_radius * m_radius) {
+		return false; // inside the emitter, nothing to sample
+	}
+	float dc = std::sqrt(dc2);
+	glm::vec3 w = to_center / dc;
+	glm::vec3 s, t;
+	detail::build_onb(w, s, t);
+
+	float cos_max = cos_theta_max(p);
+	float cos_theta = 1.0f - rand.gen() * (1.0f - cos_max);
+	float sin_theta = std::sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+	float phi = 2.0f * detail::pi() * rand.gen();
+	ls.wi = w * cos_theta + (s * std::cos(phi) + t * std::sin(phi)) * sin_theta;
+	// distance to the near intersection of the sampled direction with the sphere
+	float disc = m_radius * m_radius - dc2 * sin_theta * sin_theta;
+	ls.dist = dc * cos_theta - std::sqrt(std::max(0.0f, disc));
+	ls.pdf = 1.0f / (2.0f * detail::pi() * (1.0f - cos_max));
+	ls.radiance = m_emit;
+	return true;
+}
+
+float SphereLight::pdf(const glm::vec3 &p, const glm::vec3 &wi, const HitRecord &rec) const
+{
+	if (glm::dot(m_center - p, m_center - p) <= m_radius * m_radius) {
+		return 0.0f;
+	}
+	return 1.0f / (2.0f * detail::pi() * (1.0f - cos_theta_max(p)));
+}
+
+// two-sided parallelogram emitter, sampled uniformly by area
+class QuadLight : public Light
+{
+public:
+	QuadLight(const glm::vec3 &q, const glm::vec3 &u, const glm::vec3 &v, const glm::vec3 &emit)
+		: m_q(q), m_u(u), m_v(v), m_emit(emit)
+	{
+		glm::vec3 n = glm::cross(u, v);
+		m_area = std::sqrt(glm::dot(n, n));
+		m_normal = n / m_area;
+	}
+
+	virtual bool sample(const glm::vec3 &p, RandomGenerator<float> &rand, LightSample &ls) const override;
+	virtual float pdf(const glm::vec3 &p, const glm::vec3 &wi, const HitRecord &rec) const override;
+	virtual glm::vec3 power() const override
+	{
+		return m_emit * 2.0f * detail::pi() * m_area;
+	}
+	virtual AABB bounds() const override
+	{
+		AABB b;
+		b.expand(m_q);
+		b.expand(m_q + m_u);
+		b.expand(m_q + m_v);
+		b.expand(m_q + m_u + m_v);
+		return b;
+	}
+
+	glm::vec3 corner() const { return m_q; }
+	glm::vec3 edge_u() const { return m_u; }
+	glm::vec3 edge_v() const { return m_v; }
+	glm::vec3 emission() const { return m_emit; }
+
+private:
+	glm::vec3 m_q, m_u, m_v;
+	glm::vec3 m_normal;
+	float m_area;
+	glm::vec3 m_emit;
+};
+
+bool QuadLight::sample(const glm::vec3 &p, RandomGenerator<float> &rand, LightSample &ls) const
+{
+	glm::vec3 x = m_q + rand.gen() * m_u + rand.gen() * m_v;
+	glm::vec3 d = x - p;
+	float dist2 = glm::dot(d, d);
+	if (dist2 <= 0.0f) {
+		return false;
+	}
+	ls.dist = std::sqrt(dist2);
+	ls.wi = d / ls.dist;
+	float cos_l = std::abs(glm::dot(m_normal, ls.wi));
+	if (cos_l < 1e-6f) {
+		return false;
+	}
+	ls.pdf = dist2 / (cos_l * m_area);
+	ls.radiance = m_emit;
+	return true;
+}
+
+float QuadLight::pdf(const glm::vec3 &p, const glm::vec3 &wi, const HitRecord &rec) const
+{
+	float cos_l = std::abs(glm::dot(m_normal, wi));
+	if (cos_l < 1e-6f) {
+		return 0.0f;
+	}
+	glm::vec3 d = rec.p - p;
+	return glm::dot(d, d) / (cos_l * m_area);
+}
+
+#endif //LIGHT_H
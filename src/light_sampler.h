@@ -0,0 +1,343 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include <glm/gtx/norm.hpp>
+#include "aabb.h"
+#include "light.h"
+#include "sampling.h"
+#include "trace.h"
+
+enum class LightSampling { Uniform, Power, BVH };
+
+inline LightSampling light_sampling_from_string(const std::string &name)
+{
+	if (name == "uniform") return LightSampling::Uniform;
+	if (name == "power") return LightSampling::Power;
+	return LightSampling::BVH;
+}
+
+// picks one light index for a shading point
+class LightSampler
+{
+public:
+	virtual ~LightSampler() {}
+	virtual bool sample(const glm::vec3 &p, float u, size_t &light, float &pdf) const = 0;
+	virtual float pdf(const glm::vec3 &p, size_t light) const = 0;
+};
+
+class UniformLightSampler : public LightSampler
+{
+public:
+	UniformLightSampler(size_t count) : m_count(count) {}
+
+	virtual bool sample(const glm::vec3 &p, float u, size_t &light, float &pdf) const override
+	{
+		if (m_count == 0) {
+			return false;
+		}
+		light = std::min(size_t(u * float(m_count)), m_count - 1);
+		pdf = 1.0f / float(m_count);
+		return true;
+	}
+
+	virtual float pdf(const glm::vec3 &p, size_t light) const override
+	{
+		return 1.0f / float(m_count);
+	}
+
+private:
+	size_t m_count;
+};
+
+// O(1) selection proportional to emitted power, ignores the shading point
+class PowerLightSampler : public LightSampler
+{
+public:
+	PowerLightSampler(const std::vector<const Light *> &lights)
+	{
+		std::vector<float> weights(lights.size());
+		for (size_t i = 0; i < lights.size(); ++i) {
+			weights[i] = detail::luminance(lights[i]->power());
+		}
+		m_table = AliasTable(weights);
+	}
+
+	virtual bool sample(const glm::vec3 &p, float u, size_t &light, float &pdf) const override
+	{
+		if (m_table.empty()) {
+			return false;
+		}
+		light = m_table.sample(u);
+		pdf = m_table.pdf(light);
+		return pdf > 0.0f;
+	}
+
+	virtual float pdf(const glm::vec3 &p, size_t light) const override
+	{
+		return m_table.pdf(light);
+	}
+
+private:
+	AliasTable m_table;
+};
+
+// binary tree over light bounds; each level picks a child by power over squared distance,
+// so nearby bright lights are preferred and selection cost grows with log(#lights)
+class BVHLightSampler : public LightSampler
+{
+public:
+	BVHLightSampler(const std::vector<const Light *> &lights);
+
+	virtual bool sample(const glm::vec3 &p, float u, size_t &light, float &pdf) const override;
+	virtual float pdf(const glm::vec3 &p, size_t light) const override;
+
+private:
+	struct Node
+	{
+		AABB bounds;
+		float power;
+		uint32_t left;  // light index for leaves
+		uint32_t right;
+		bool leaf;
+	};
+
+	struct BuildItem
+	{
+		AABB bounds;
+		glm::vec3 centroid;
+		float power;
+		uint32_t light;
+	};
+
+	uint32_t build(std::vector<BuildItem> &items, size_t begin, size_t end, uint64_t trail, int depth);
+
+	float importance(const glm::vec3 &p, const Node &node) const
+	{
+		if (node.power <= 0.0f) {
+			return 0.0f;
+		}
+		// keep the distance from collapsing for points inside or close to the bounds
+		float d2 = glm::length2(p - node.bounds.centroid());
+		d2 = std::max(d2, 0.25f * glm::length2(node.bounds.diagonal()));
+		return node.power / std::max(d2, 1e-8f);
+	}
+
+private:
+	static const int MAX_DEPTH = 64;
+
+	std::vector<Node> m_nodes;
+	// path from the root to each light's leaf, one bit per level (1 = right child)
+	std::vector<uint64_t> m_trail;
+	std::vector<bool> m_in_tree;
+};
+
+BVHLightSampler::BVHLightSampler(const std::vector<const Light *> &lights)
+	: m_trail(lights.size(), 0), m_in_tree(lights.size(), false)
+{
+	std::vector<BuildItem> items;
+	items.reserve(lights.size());
+	for (size_t i = 0; i < lights.size(); ++i) {
+		float phi = detail::luminance(lights[i]->power());
+		if (phi > 0.0f) {
+			AABB b = lights[i]->bounds();
+			items.push_back({ b, b.centroid(), phi, uint32_t(i) });
+		}
+	}
+	if (!items.empty()) {
+		m_nodes.reserve(2 * items.size() - 1);
+		build(items, 0, items.size(), 0, 0);
+	}
+}
+
+uint32_t BVHLightSampler::build(std::vector<BuildItem> &items, size_t begin, size_t end, uint64_t trail, int depth)
+{
+	uint32_t index = uint32_t(m_nodes.size());
+	m_nodes.emplace_back();
+	if (end - begin == 1 || depth == MAX_DEPTH - 1) {
+		// depth is bounded by the median split, so the cap only guards against degenerate input
+		const BuildItem &item = items[begin];
+		m_nodes[index] = { item.bounds, item.power, item.light, 0, true };
+		m_trail[item.light] = trail;
+		m_in_tree[item.light] = true;
+		return index;
+	}
+
+	AABB bounds, centroids;
+	float power = 0.0f;
+	for (size_t i = begin; i < end; ++i) {
+		bounds.expand(items[i].bounds);
+		centroids.expand(items[i].centroid);
+		power += items[i].power;
+	}
+	int axis = centroids.largest_axis();
+	size_t mid = (begin + end) / 2;
+	std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+		[axis](const BuildItem &a, const BuildItem &b) { return a.centroid[axis] < b.centroid[axis]; });
+
+	uint32_t left = build(items, begin, mid, trail, depth + 1);
+	uint32_t right = build(items, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+	m_nodes[index] = { bounds, power, left, right, false };
+	return index;
+}
+
+bool BVHLightSampler::sample(const glm::vec3 &p, float u, size_t &light, float &pdf) const
+{
+	if (m_nodes.empty()) {
+		return false;
+	}
+	uint32_t node = 0;
+	pdf = 1.0f;
+	while (!m_nodes[node].leaf) {
+		const Node &n = m_nodes[node];
+		float il = importance(p, m_nodes[n.left]);
+		float ir = importance(p, m_nodes[n.right]);
+		if (il + ir <= 0.0f) {
+			return false;
+		}
+		float pl = il / (il + ir);
+		if (u < pl) {
+			u = std::min(u / pl, 0.99999994f);
+			pdf *= pl;
+			node = n.left;
+		} else {
+			u = std::min((u - pl) / (1.0f - pl), 0.99999994f);
+			pdf *= 1.0f - pl;
+			node = n.right;
+		}
+	}
+	light = m_nodes[node].left;
+	return pdf > 0.0f;
+}
+
+float BVHLightSampler::pdf(const glm::vec3 &p, size_t light) const
+{
+	if (!m_in_tree[light]) {
+		return 0.0f;
+	}
+	uint64_t trail = m_trail[light];
+	uint32_t node = 0;
+	float pdf = 1.0f;
+	while (!m_nodes[node].leaf) {
+		const Node &n = m_nodes[node];
+		float il = importance(p, m_nodes[n.left]);
+		float ir = importance(p, m_nodes[n.right]);
+		if (il + ir <= 0.0f) {
+			return 0.0f;
+		}
+		bool go_right = (trail & 1) != 0;
+		pdf *= (go_right ? ir : il) / (il + ir);
+		node = go_right ? n.right : n.left;
+		trail >>= 1;
+	}
+	return pdf;
+}
+
+// the set of explicitly sampled lights of a scene and the structure used to pick one of them.
+// infinite lights can't live in the bvh, they share one extra slot of the selection probability
+class LightList
+{
+public:
+	LightList() {}
+	// build() has to be called before sampling, once the scene's lights are all added
+	LightList(std::vector<std::unique_ptr<Light>> lights)
+	{
+		for (auto &light : lights) {
+			add(std::move(light));
+		}
+	}
+
+	// build() has to be called again before sampling
+	void add(std::unique_ptr<Light> light)
+	{
+		if (light->infinite()) {
+			m_index[light.get()] = { true, m_infinite.size() };
+			m_infinite.push_back(light.get());
+		} else {
+			m_index[light.get()] = { false, m_bounded.size() };
+			m_bounded.push_back(light.get());
+		}
+		m_lights.push_back(std::move(light));
+	}
+
+	void build(LightSampling strategy)
+	{
+		trace::Scope trace_build("light sampler build", "build", "lights", int64_t(m_bounded.size()));
+		switch (strategy) {
+		case LightSampling::Uniform: m_sampler = std::make_unique<UniformLightSampler>(m_bounded.size()); break;
+		case LightSampling::Power: m_sampler = std::make_unique<PowerLightSampler>(m_bounded); break;
+		case LightSampling::BVH: m_sampler = std::make_unique<BVHLightSampler>(m_bounded); break;
+		}
+	}
+
+	bool empty() const { return m_lights.empty(); }
+	size_t size() const { return m_lights.size(); }
+	const Light *operator[](size_t i) const { return m_lights[i].get(); }
+
+	const Light *sample(const glm::vec3 &p, float u, float &select_pdf) const
+	{
+		float p_inf = infinite_probability();
+		if (u < p_inf) {
+			u /= p_inf;
+			size_t i = std::min(size_t(u * float(m_infinite.size())), m_infinite.size() - 1);
+			select_pdf = p_inf / float(m_infinite.size());
+			return m_infinite[i];
+		}
+		if (m_bounded.empty()) {
+			return nullptr;
+		}
+		u = std::min((u - p_inf) / (1.0f - p_inf), 0.99999994f);
+		size_t i;
+		if (!m_sampler->sample(p, u, i, select_pdf)) {
+			return nullptr;
+		}
+		select_pdf *= 1.0f - p_inf;
+		return m_bounded[i];
+	}
+
+	float pdf(const glm::vec3 &p, const Light *light) const
+	{
+		auto it = m_index.find(light);
+		if (it == m_index.end()) {
+			return 0.0f;
+		}
+		float p_inf = infinite_probability();
+		if (it->second.infinite) {
+			return p_inf / float(m_infinite.size());
+		}
+		return (1.0f - p_inf) * m_sampler->pdf(p, it->second.index);
+	}
+
+private:
+	float infinite_probability() const
+	{
+		if (m_infinite.empty()) {
+			return 0.0f;
+		}
+		if (m_bounded.empty()) {
+			return 1.0f;
+		}
+		return float(m_infinite.size()) / float(m_infinite.size() + 1);
+	}
+
+private:
+	struct Entry
+	{
+		bool infinite;
+		size_t index;
+	};
+
+	std::vector<std::unique_ptr<Light>> m_lights;
+	std::vector<const Light *> m_bounded;
+	std::vector<const Light *> m_infinite;
+	std::unordered_map<const Light *, Entry> m_index;
+	std::unique_ptr<LightSampler> m_sampler;
+};
+
+#endif //LIGHT_SAMPLER_H
@@ -2,6 +2,14 @@
 #include <vector>
 #include <limits>
 #include <random>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <csignal>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/glm.hpp>
@@ -11,106 +19,444 @@
 #include "hitable.h"
 #include "camera.h"
 #include "material.h"
+#include "light.h"
+#include "light_sampler.h"
+#include "environment.h"
+#include "scene.h"
+#include "framebuffer.h"
+#include "denoiser.h"
+#include "film.h"
+#include "integrator.h"
+#include "renderer.h"
+#include "distributed.h"
+#include "preview.h"
+#include "static_integrator.h"
+#include "regression.h"
+#include "profiler.h"
+#include "trace.h"
+#include "accel_bench.h"
+#include "out_of_core.h"
 
 static const char *IMG_PATH = "C:\\Users\\George\\Desktop\\img.png";
-static const int DEPTH = 16;
 
-static glm::vec3 output_color(const Ray &r, const Hitable *world, int depth, RandomGenerator<float> &generator)
+struct Options
 {
-	HitRecord rec;
-	if (world->hit(r, 0.001f, std::numeric_limits<float>::max(), rec)) {
-		Ray scattered;
-		glm::vec3 attenuation;
-		if (depth < DEPTH && rec.mat_ptr->scatter(r, rec, generator, attenuation, scattered)) {
-			return attenuation * output_color(scattered, world, depth + 1, generator);
+	std::string scene = "random";
+	std::string output = IMG_PATH;
+	std::string light_sampling = "bvh";
+	std::string accel = "list";  // list, bvh, lbvh, lbvh63, or bvh4, bvh8, lbvh4, lbvh8 for wide nodes
+	int treelet_rounds = 0;    // treelet reordering passes after an lbvh build
+	int quantize_bits = 0;     // 8 or 16 bit child boxes in the wide bvhs
+	bool accel_bench = false;  // compare build and traversal of the acceleration structures
+	int grid = 11;             // half extent of the random scenes' sphere field
+	std::string envmap;
+	std::string texture;
+	size_t texture_cache_mb = 256;
+	std::string out_of_core;   // cluster file the primitives are written to and paged in from, implies wavefront
+	size_t geometry_cache_mb = 256;
+	bool reuse_clusters = false; // render from the --out-of-core file an earlier run wrote, without rewriting it
+	bool denoise = false;
+	std::string filter = "gaussian";
+	float filter_radius = 1.5f;
+	PixelBounds crop = { 0, 0, 1 << 30, 1 << 30 }; // image pixels, top row is y = 0
+	std::string merge;         // .pfm the crop is pasted into
+	uint32_t aovs = 0;         // written next to the output as <out>.<name>.pfm
+	std::string reference;     // .pfm to report the rmse against
+	float env_scale = 1.0f;
+	std::string coordinator;   // address to hand tiles out on, "host:port" ("*:port" for every interface) or "unix:/path"
+	std::string worker;        // coordinator address to take tiles from
+	int spawn_workers = 0;     // local workers started by the coordinator
+	int worker_fail_after = 0; // worker exits after that many tiles, for testing
+	double worker_timeout = 300.0; // seconds a worker holding tiles may stay silent before they are reissued
+	std::string preview;       // serve the interactive preview on "-" (stdin) or an address
+	double time_budget = 0.0;  // seconds, 0 renders all samples
+	bool static_dispatch = false; // render through StockWorld instead of the virtual calls
+	bool wavefront = false;    // trace a bounce of many paths at a time, with the batched material kernels
+	bool profile = false;      // hardware counters per render phase, printed after the render
+	std::string trace;         // chrome trace json of the render threads
+	RegressionOptions regress; // --regress <dir> runs the regression cases instead of a render
+	int nx = 200;
+	int ny = 100;
+	int num_samples = 128;
+};
+
+static Options parse_options(int argc, char **argv)
+{
+	Options opts;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (arg == "--scene" && has_value) {
+			opts.scene = argv[++i];
+		} else if (arg == "--out" && has_value) {
+			opts.output = argv[++i];
+		} else if (arg == "--width" && has_value) {
+			opts.nx = std::atoi(argv[++i]);
+		} else if (arg == "--height" && has_value) {
+			opts.ny = std::atoi(argv[++i]);
+		} else if (arg == "--accel" && has_value) {
+			opts.accel = argv[++i];
+		} else if (arg == "--accel-bench") {
+			opts.accel_bench = true;
+		} else if (arg == "--treelets" && has_value) {
+			opts.treelet_rounds = std::atoi(argv[++i]);
+		} else if (arg == "--quantize" && has_value) {
+			opts.quantize_bits = std::atoi(argv[++i]);
+		} else if (arg == "--grid" && has_value) {
+			opts.grid = std::atoi(argv[++i]);
+		} else if (arg == "--light-sampler" && has_value) {
+			opts.light_sampling = argv[++i];
+		} else if (arg == "--envmap" && has_value) {
+			opts.envmap = argv[++i];
+		} else if (arg == "--env-scale" && has_value) {
+			opts.env_scale = float(std::atof(argv[++i]));
+		} else if (arg == "--texture" && has_value) {
+			opts.texture = argv[++i];
+		} else if (arg == "--texture-cache-mb" && has_value) {
+			opts.texture_cache_mb = size_t(std::atol(argv[++i]));
+		} else if (arg == "--out-of-core" && has_value) {
+			opts.out_of_core = argv[++i];
+		} else if (arg == "--geometry-cache-mb" && has_value) {
+			opts.geometry_cache_mb = size_t(std::atol(argv[++i]));
+		} else if (arg == "--reuse-clusters") {
+			opts.reuse_clusters = true;
+		} else if (arg == "--denoise") {
+			opts.denoise = true;
+		} else if (arg == "--filter" && has_value) {
+			opts.filter = argv[++i];
+		} else if (arg == "--filter-radius" && has_value) {
+			opts.filter_radius = float(std::atof(argv[++i]));
+		} else if (arg == "--crop" && has_value) {
+			PixelBounds &c = opts.crop;
+			if (std::sscanf(argv[++i], "%d,%d,%d,%d", &c.x0, &c.y0, &c.x1, &c.y1) != 4) {
+				std::cerr << "--crop expects x0,y0,x1,y1" << std::endl;
+			}
+		} else if (arg == "--merge" && has_value) {
+			opts.merge = argv[++i];
+		} else if (arg == "--aov" && has_value) {
+			opts.aovs |= parse_aov_list(argv[++i]);
+		} else if (arg == "--aux") {
+			opts.aovs |= AOV_ALBEDO | AOV_NORMAL | AOV_DEPTH;
+		} else if (arg == "--reference" && has_value) {
+			opts.reference = argv[++i];
+		} else if (arg == "--coordinator" && has_value) {
+			opts.coordinator = argv[++i];
+		} else if (arg == "--worker" && has_value) {
+			opts.worker = argv[++i];
+		} else if (arg == "--spawn-workers" && has_value) {
+			opts.spawn_workers = std::atoi(argv[++i]);
+		} else if (arg == "--worker-fail-after" && has_value) {
+			opts.worker_fail_after = std::atoi(argv[++i]);
+		} else if (arg == "--worker-timeout" && has_value) {
+			opts.worker_timeout = std::atof(argv[++i]);
+		} else if (arg == "--regress" && has_value) {
+			opts.regress.dir = argv[++i];
+		} else if (arg == "--regress-update") {
+			opts.regress.update = true;
+		} else if (arg == "--regress-tolerance" && has_value) {
+			opts.regress.tolerance = std::atof(argv[++i]);
+		} else if (arg == "--trace" && has_value) {
+			opts.trace = argv[++i];
+		} else if (arg == "--profile") {
+			opts.profile = true;
+		} else if (arg == "--static-dispatch") {
+			opts.static_dispatch = true;
+		} else if (arg == "--wavefront") {
+			opts.wavefront = true;
+		} else if (arg == "--time-budget" && has_value) {
+			opts.time_budget = std::atof(argv[++i]);
+		} else if (arg == "--preview" && has_value) {
+			opts.preview = argv[++i];
+		} else if (arg == "--spp" && has_value) {
+			opts.num_samples = std::atoi(argv[++i]);
 		} else {
-			return glm::vec3(0.0f);
+			std::cerr << "unknown option " << arg << std::endl;
 		}
-	} else {
-		glm::vec3 unit_dir = glm::normalize(r.direction());
-		float t = 0.5f * (unit_dir.y + 1.0f);
-		return (1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
 	}
+	return opts;
 }
 
-int main()
-{
-	int nx = 200;
-	int ny = 100;
-	std::vector<uint8_t> img(nx * ny * 3);
-
-	glm::vec3 cam_pos(13.0f, 2.0f, 3.0f);
-	glm::vec3 lookat(0.0f, 0.0f, 0.0f);
-	float dist_to_focus = 10.0f; 
-	float aperture = 0.1f;
+static RenderControl g_render_control;
 
-	Camera cam(cam_pos, lookat, glm::vec3(0.0f, 1.0f, 0.0f),
-		20, float(nx) / float(ny), aperture, dist_to_focus);
+// first ctrl-c stops the render at the next tile and still writes the image, the second one kills
+static void on_interrupt(int)
+{
+	g_render_control.cancel();
+	std::signal(SIGINT, SIG_DFL);
+}
 
-	std::vector<std::shared_ptr<Material>> materials = {
-		std::make_shared<Dielectric>(1.5f),
-		std::make_shared<Lambertian>(glm::vec3(0.4f, 0.2f, 0.1f)),
-		std::make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0f),
-		std::make_shared<Lambertian>(glm::vec3(0.5, 0.5, 0.5))
+// FNV-1a over every option that changes the rendered image, so a coordinator can turn away
+// workers that were started with a different scene or settings
+static uint64_t config_hash(const Options &opts)
+{
+	uint64_t h = 14695981039346656037ull;
+	auto add = [&h](const void *data, size_t size) {
+		const unsigned char *p = static_cast<const unsigned char *>(data);
+		for (size_t i = 0; i < size; ++i) {
+			h = (h ^ p[i]) * 1099511628211ull;
+		}
 	};
+	for (const std::string *s : { &opts.scene, &opts.accel, &opts.light_sampling, &opts.envmap, &opts.texture, &opts.filter }) {
+		add(s->data(), s->size() + 1);
+	}
+	add(&opts.filter_radius, sizeof(float));
+	add(&opts.env_scale, sizeof(float));
+	add(&opts.crop, sizeof(PixelBounds));
+	add(&opts.grid, sizeof(int));
+	add(&opts.treelet_rounds, sizeof(int));
+	add(&opts.quantize_bits, sizeof(int));
+	add(&opts.wavefront, sizeof(bool));
+	add(&opts.nx, sizeof(int));
+	add(&opts.ny, sizeof(int));
+	add(&opts.num_samples, sizeof(int));
+	// builds for another instruction set round differently (fma contraction, the avx2 kernels)
+	const uint32_t isa = 0
+#ifdef __AVX2__
+		| 1u
+#endif
+#ifdef __FMA__
+		| 2u
+#endif
+		;
+	add(&isa, sizeof(isa));
+	return h;
+}
 
-	std::vector<std::unique_ptr<Hitable>> objects;
-	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f, materials[3]));
-	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(0.0f, 1.0f, 0.0f), 1.0f, materials[0]));
-	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(-4.0f, 1.0f, 0.0f), 1.0f, materials[1]));
-	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(4.0f, 1.0f, 0.0f), 1.0f, materials[2]));
+int main(int argc, char **argv)
+{
+	Options opts = parse_options(argc, argv);
+	if (!(opts.filter_radius > 0.0f)) {
+		// the filter table would be sampled at an infinite rate and weigh every sample 0
+		std::cerr << "--filter-radius has to be above 0" << std::endl;
+		return 1;
+	}
+	if (!opts.out_of_core.empty()) {
+		// the wavefront integrator traces whole bounces through hit_batch, so a cluster page-in
+		// serves every ray of the wave that enters the cluster
+		opts.wavefront = true;
+	}
+	if (!opts.regress.dir.empty()) {
+		return run_regression(opts.regress) == 0 ? 0 : 1;
+	}
+	const int nx = opts.nx;
+	const int ny = opts.ny;
+	if (opts.accel_bench) {
+		AccelBenchOptions bench;
+		bench.scene = opts.scene;
+		bench.grid = opts.grid;
+		bench.aspect = float(nx) / float(ny);
+		if (opts.treelet_rounds > 0) {
+			bench.treelet_rounds = opts.treelet_rounds;
+		}
+		return run_accel_bench(bench) == 0 ? 0 : 1;
+	}
+	if (!opts.trace.empty()) {
+		trace::Tracer::instance().enable();
+	}
 
-	RandomGenerator<float> rand;
-	for (int a = -11; a < 11; a++) {
-		for (int b = -11; b < 11; b++) {
-			float choose_mat = rand.gen();
-			glm::vec3 center(a + 0.9f*rand.gen(), 0.2f, b + 0.9f*rand.gen());
-			if ((center - glm::vec3(4.0f, 0.2f, 0.0f)).length() > 0.9) {
-				if (choose_mat < 0.8) { // diffuse
-					objects.emplace_back(std::make_unique<Sphere>(
-						center, 0.2f, std::make_shared<Lambertian>(
-							glm::vec3(rand.gen()*rand.gen(), rand.gen()*rand.gen(), rand.gen()*rand.gen()))));
-				} else if (choose_mat < 0.95) { // metal
-					objects.emplace_back(std::make_unique<Sphere>(
-						center, 0.2f, std::make_shared<Metal>(
-							glm::vec3(0.5*(1 + rand.gen()), 0.5*(1 + rand.gen()), 0.5*(1 + rand.gen())), 0.5 *rand.gen())));
-				} else { // glass
-					objects.emplace_back(std::make_unique<Sphere>(
-						center, 0.2f, std::make_shared<Dielectric>(1.5f)));
-				}
+	TextureCache::instance().set_budget(opts.texture_cache_mb << 20);
+	AccelOptions accel = accel_from_string(opts.accel);
+	accel.treelet_rounds = opts.treelet_rounds;
+	accel.quantize_bits = opts.quantize_bits;
+	if (accel.quantize_bits != 0 && (accel.type != Accel::BVH || accel.width == 2 || (accel.quantize_bits != 8 && accel.quantize_bits != 16))) {
+		// only the wide nodes have quantized boxes, a binary bvh would be built without them
+		std::cerr << "--quantize expects 8 or 16 and one of --accel bvh4, bvh8, lbvh4 or lbvh8" << std::endl;
+		return 1;
+	}
+	Scene scene = make_scene(opts.scene, float(nx) / float(ny), opts.texture, opts.out_of_core.empty() ? accel : AccelOptions(), opts.grid);
+	const OutOfCoreWorld *out_of_core = nullptr;
+	if (!opts.out_of_core.empty()) {
+		OutOfCoreOptions ooc;
+		ooc.budget = opts.geometry_cache_mb << 20;
+		if (accel.type != Accel::List) {
+			ooc.blas = accel;
+			ooc.blas.width = 2;
+			ooc.blas.quantize_bits = 0;
+		}
+		std::unique_ptr<OutOfCoreWorld> world;
+		if (opts.reuse_clusters) {
+			// the camera and the lights still come from the scene, its primitives go unused
+			scene.world.reset();
+			world = OutOfCoreWorld::open(opts.out_of_core, scene.lights, ooc.budget);
+			if (!world) {
+				std::cerr << "could not open clusters in " << opts.out_of_core
+					<< " (files of scenes with textured materials can't be reused)" << std::endl;
+				return 1;
+			}
+		} else {
+			// the scene was built as a plain list for this, see make_scene above
+			HitableList *list = dynamic_cast<HitableList *>(scene.world.get());
+			if (!list) {
+				std::cerr << "--out-of-core needs the scene's primitives in a list" << std::endl;
+				return 1;
+			}
+			world = make_out_of_core(list->release(), opts.out_of_core, scene.lights, ooc);
+			if (!world) {
+				std::cerr << "could not write clusters to " << opts.out_of_core << std::endl;
+				return 1;
 			}
 		}
+		std::cout << "out of core: " << world->cluster_count() << " clusters, " << double(world->file_bytes()) / (1 << 20)
+			<< " MB on disk" << std::endl;
+		out_of_core = world.get();
+		scene.world = std::move(world);
+	}
+	if (const Accelerator *bvh = dynamic_cast<const Accelerator *>(scene.world.get())) {
+		const BVHStats &st = bvh->stats();
+		std::cout << opts.accel << ": " << st.primitives << " primitives, " << st.nodes << " nodes, depth " << st.depth
+			<< ", sah cost " << st.sah_cost << ", built in " << st.build_ms << " ms ("
+			<< double(st.primitives) / (st.build_ms * 1e3) << " Mprims/s)" << std::endl;
+	}
+	scene.camera.set_resolution(nx, ny);
+	scene.wavefront = opts.wavefront;
+	if (!opts.envmap.empty()) {
+		auto map = EnvironmentMap::load(opts.envmap);
+		if (!map) {
+			std::cerr << "could not load environment map " << opts.envmap << std::endl;
+			return 1;
+		}
+		scene.set_environment(map, opts.env_scale);
 	}
-	HitableList world(std::move(objects));
+	scene.lights.build(light_sampling_from_string(opts.light_sampling));
 
-	const int num_samples = 128;
+	Filter filter(filter_from_string(opts.filter), opts.filter_radius);
+	// crop in image rows (top first) to film rows (bottom first), plus enough margin for the
+	// filter to see the same samples at the crop border as a full render would
+	PixelBounds crop = { opts.crop.x0, ny - opts.crop.y1, opts.crop.x1, ny - opts.crop.y0 };
+	PixelBounds region = crop.expand(int(std::ceil(filter.radius())));
+	if (!opts.preview.empty()) {
+		PreviewServer server(scene, nx, ny, filter, opts.num_samples);
+		return run_preview(server, opts.preview);
+	}
+	if (!opts.worker.empty()) {
+		return render_worker(opts.worker, config_hash(opts), scene, opts.num_samples, filter, region, nx, ny,
+			opts.worker_fail_after);
+	}
+	const bool distributed = !opts.coordinator.empty();
+	if (distributed && (opts.aovs || opts.denoise)) {
+		// workers only send back the beauty film
+		std::cerr << "aovs and denoising are not available with --coordinator, ignoring them" << std::endl;
+		opts.aovs = 0;
+		opts.denoise = false;
+	}
 
-    #pragma omp parallel
-	{
-		RandomGenerator<float> rand;
-        #pragma omp for schedule(dynamic, 1)
-		for (int j = 0; j < ny; j++) {
-			for (int i = 0; i < nx; i++) {
-				const int idx = (ny - 1 - j) * nx + i;
-				glm::vec3 color(0.0f, 0.0f, 0.0f);
-				for (int s = 0; s < num_samples; s++) {
-					float u = (float(i) + rand.gen()) / float(nx);
-					float v = (float(j) + rand.gen()) / float(ny);
-					Ray ray = cam.generate_ray(u, v, rand);
-					color += output_color(ray, &world, 0, rand);
-				}
-				// super sampling averaging
-				color /= float(num_samples);
-				// gamma correct it
-				color = glm::vec3(glm::sqrt(color));
-				img[3 * idx + 0] = uint8_t(255.99f*color.r);
-				img[3 * idx + 1] = uint8_t(255.99f*color.g);
-				img[3 * idx + 2] = uint8_t(255.99f*color.b);
+	Framebuffer fb(nx, ny, opts.aovs | (opts.denoise ? AOV_DENOISE_FEATURES : 0));
+	auto t0 = std::chrono::steady_clock::now();
+	if (distributed) {
+		std::vector<std::string> args;
+		for (int i = 0; i < argc; ++i) {
+			std::string arg = argv[i];
+			if ((arg == "--coordinator" || arg == "--spawn-workers") && i + 1 < argc) {
+				i++;
+			} else {
+				args.push_back(arg);
 			}
 		}
+		if (out_of_core && out_of_core->self_contained() && !opts.reuse_clusters) {
+			// the clusters are written already; workers of scenes with textured materials need
+			// their own tables and write the file again, which replaces it without touching the
+			// copy mapped here
+			args.push_back("--reuse-clusters");
+		}
+		args.push_back("--worker");
+		args.push_back(opts.coordinator);
+		auto workers = spawn_workers(args, opts.spawn_workers);
+		if (!render_coordinator(opts.coordinator, config_hash(opts), filter, region, fb, workers, opts.worker_timeout)) {
+			return 1;
+		}
+	} else {
+		const RenderControl *control = nullptr;
+		if (opts.time_budget > 0.0) {
+			g_render_control.set_budget(opts.time_budget);
+			std::signal(SIGINT, on_interrupt);
+			control = &g_render_control;
+		}
+		StockWorld static_world;
+		if (opts.static_dispatch && !static_world.build(*scene.world)) {
+			std::cerr << "scene has types outside of the static world, using virtual dispatch" << std::endl;
+			opts.static_dispatch = false;
+		}
+		int done;
+		if (opts.profile) {
+			done = opts.static_dispatch ?
+				render(scene, prof::ProfiledWorld<StockWorld>{ static_world }, opts.num_samples, filter, region, fb, control) :
+				render(scene, prof::ProfiledWorld<VirtualWorld>{ VirtualWorld(scene) }, opts.num_samples, filter, region, fb, control);
+		} else {
+			done = opts.static_dispatch ?
+				render(scene, static_world, opts.num_samples, filter, region, fb, control) :
+				render(scene, opts.num_samples, filter, region, fb, control);
+		}
+		std::signal(SIGINT, SIG_DFL);
+		if (done < opts.num_samples) {
+			std::cout << "stopped at " << done << " of " << opts.num_samples << " spp" << std::endl;
+		}
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	if (opts.aovs) {
+		trace::Scope trace_aovs("write aovs", "output");
+		fb.aovs.write(opts.output, nx, ny);
+	}
+	if (opts.denoise) {
+		trace::Scope trace_denoise("denoise", "output");
+		denoise(fb);
+	}
+	auto t2 = std::chrono::steady_clock::now();
+	std::cout << "render " << std::chrono::duration<double>(t1 - t0).count() << " s";
+	if (opts.denoise) {
+		std::cout << ", denoise " << std::chrono::duration<double>(t2 - t1).count() << " s";
+	}
+	if (!opts.reference.empty()) {
+		int rw, rh;
+		std::vector<float> ref;
+		if (load_pfm(opts.reference, rw, rh, ref) && rw == nx && rh == ny) {
+			std::vector<glm::vec3> ref_rgb(size_t(nx) * ny);
+			std::memcpy(&ref_rgb[0].x, ref.data(), ref.size() * sizeof(float));
+			std::cout << ", rmse " << rmse(fb.color, ref_rgb);
+		} else {
+			std::cerr << "could not load reference " << opts.reference << std::endl;
+		}
+	}
+	std::cout << std::endl;
+	if (out_of_core) {
+		std::cout << "out of core: " << out_of_core->page_ins() << " cluster page-ins, "
+			<< double(out_of_core->resident_bytes()) / (1 << 20) << " MB resident" << std::endl;
 	}
 
-	stbi_write_png(IMG_PATH, nx, ny, 3, img.data(), 0);
+	PixelBounds image_crop = opts.crop.intersect({ 0, 0, nx, ny });
+	if (image_crop.area() < nx * ny || !opts.merge.empty()) {
+		// keep exactly the crop, pasted into an earlier full render or into black
+		std::vector<glm::vec3> base(fb.color.size(), glm::vec3(0.0f));
+		if (!opts.merge.empty()) {
+			int bw, bh;
+			std::vector<float> pixels;
+			if (!load_pfm(opts.merge, bw, bh, pixels) || bw != nx || bh != ny) {
+				std::cerr << "could not load " << opts.merge << " as a " << nx << "x" << ny << " pfm" << std::endl;
+				return 1;
+			}
+			std::memcpy(&base[0].x, pixels.data(), pixels.size() * sizeof(float));
+		}
+		for (int y = image_crop.y0; y < image_crop.y1; ++y) {
+			for (int x = image_crop.x0; x < image_crop.x1; ++x) {
+				base[size_t(y) * nx + x] = fb.color[size_t(y) * nx + x];
+			}
+		}
+		fb.color.swap(base);
+	}
+	{
+		trace::Scope trace_write("write image", "output");
+		if (opts.profile) {
+			prof::Scope<true> scope(prof::OUTPUT);
+			write_image(opts.output, nx, ny, fb.color);
+		} else {
+			write_image(opts.output, nx, ny, fb.color);
+		}
+	}
+	if (opts.profile) {
+		prof::Profiler::instance().report(std::cout);
+	}
+	if (!opts.trace.empty() && !trace::Tracer::instance().write(opts.trace)) {
+		std::cerr << "could not write trace " << opts.trace << std::endl;
+		return 1;
+	}
 	return 0;
 }
-
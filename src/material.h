@@ -2,58 +2,149 @@
 #define MATERIAL_H
 
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <algorithm>
 #include <glm/glm.hpp>
 #include "ray.h"
 #include "hitable.h"
 #include "random_generator.h"
+#include "sampling.h"
+#include "texture.h"
+#include "scatter_batch.h"
+
+class Light;
 
 class Material
 {
 public:
+	Material()
+	{
+		static std::atomic<uint32_t> next_id{ 1 };
+		m_id = next_id++;
+	}
+	virtual ~Material() {}
+
 	virtual bool scatter(const Ray &ray_in, const HitRecord &rec, RandomGenerator<float> &rand,
 		glm::vec3 &attenuation, Ray &scattered) const = 0;
+	// scatters a whole batch of hits of this material, materials with simd kernels override this.
+	// The kernels draw their random numbers differently, so results match scatter() in
+	// distribution only.
+	virtual void scatter_batch(const HitBatch &hits, ScatterBatch &out) const
+	{
+		for (size_t i = 0; i < hits.count; ++i) {
+			Ray scattered;
+			glm::vec3 attenuation(0.0f);
+			Ray ray_in(hits.recs[i].p, glm::vec3(hits.dx[i], hits.dy[i], hits.dz[i]));
+			out.valid[i] = scatter(ray_in, hits.recs[i], *hits.rands[i], attenuation, scattered);
+			out.dx[i] = scattered.direction().x;
+			out.dy[i] = scattered.direction().y;
+			out.dz[i] = scattered.direction().z;
+			out.ar[i] = attenuation.r;
+			out.ag[i] = attenuation.g;
+			out.ab[i] = attenuation.b;
+		}
+	}
+
+	virtual glm::vec3 emitted(const Ray &ray_in, const HitRecord &rec) const { return glm::vec3(0.0f); }
+	// the explicitly sampled light this surface belongs to, if any
+	virtual const Light *light() const { return nullptr; }
+
+	// specular materials can't be evaluated for an arbitrary direction and are skipped by light sampling
+	virtual bool is_specular() const { return true; }
+	// bsdf times cosine for the unit direction wi
+	virtual glm::vec3 eval(const Ray &ray_in, const HitRecord &rec, const glm::vec3 &wi) const { return glm::vec3(0.0f); }
+	// solid angle density with which scatter() picks the unit direction wi
+	virtual float pdf(const Ray &ray_in, const HitRecord &rec, const glm::vec3 &wi) const { return 0.0f; }
+
+	// surface color for the denoiser's guide buffers
+	virtual glm::vec3 albedo(const HitRecord &rec) const { return glm::vec3(1.0f); }
+
+	// identifies the material in material id aovs, numbered in creation order from 1
+	uint32_t id() const { return m_id; }
+
+private:
+	uint32_t m_id;
 };
 
-class Lambertian : public Material
+class Lambertian final : public Material
 {
 public:
 	Lambertian(const glm::vec3 &a)
 		: m_albedo(a) {}
+	Lambertian(std::shared_ptr<Texture> a)
+		: m_albedo(0.0f), m_texture(a) {}
 
 	virtual bool scatter(const Ray &ray_in, const HitRecord &rec, RandomGenerator<float> &rand,
 		glm::vec3 &attenuation, Ray &scattered) const override
 	{
-		glm::vec3 target = rec.p + rec.normal + rand.random_in_unit_sphere();
+		// cosine weighted, so that the attenuation is just the albedo
+		glm::vec3 target = rec.p + rec.normal + rand.random_unit_vector();
 		scattered = Ray(rec.p, target - rec.p);
-		attenuation = m_albedo;
+		attenuation = Lambertian::albedo(rec);
 		return true;
 	}
+	virtual void scatter_batch(const HitBatch &hits, ScatterBatch &out) const override;
+
+	virtual bool is_specular() const override { return false; }
+
+	virtual glm::vec3 eval(const Ray &ray_in, const HitRecord &rec, const glm::vec3 &wi) const override
+	{
+		return Lambertian::albedo(rec) * std::max(0.0f, glm::dot(rec.normal, wi)) / detail::pi();
+	}
+
+	virtual float pdf(const Ray &ray_in, const HitRecord &rec, const glm::vec3 &wi) const override
+	{
+		return std::max(0.0f, glm::dot(rec.normal, wi)) / detail::pi();
+	}
+
+	// constant albedos skip the virtual texture call
+	virtual glm::vec3 albedo(const HitRecord &rec) const override { return m_texture ? m_texture->value(rec) : m_albedo; }
+
+	bool textured() const { return m_texture != nullptr; }
+	// the albedo of untextured instances
+	glm::vec3 constant_albedo() const { return m_albedo; }
 
 private:
 	glm::vec3 m_albedo;
+	std::shared_ptr<Texture> m_texture;
 };
 
-class Metal : public Material
+class Metal final : public Material
 {
 public:
 	Metal(const glm::vec3 &a, float fuzz)
 		: m_albedo(a), m_fuzz(fuzz) {}
+	// the roughness texture's red channel scales fuzz
+	Metal(std::shared_ptr<Texture> a, float fuzz, std::shared_ptr<Texture> roughness = nullptr)
+		: m_albedo(0.0f), m_fuzz(fuzz), m_texture(a), m_roughness(roughness) {}
 
 	virtual bool scatter(const Ray &ray_in, const HitRecord &rec, RandomGenerator<float> &rand,
 		glm::vec3 &attenuation, Ray &scattered) const override
 	{
 		glm::vec3 reflected = glm::reflect(glm::normalize(ray_in.direction()), rec.normal);
-		scattered = Ray(rec.p, reflected + m_fuzz * rand.random_in_unit_sphere());
-		attenuation = m_albedo;
+		float fuzz = m_roughness ? m_fuzz * m_roughness->value(rec).r : m_fuzz;
+		scattered = Ray(rec.p, reflected + fuzz * rand.random_in_unit_sphere());
+		attenuation = m_texture ? m_texture->value(rec) : m_albedo;
 		return (glm::dot(scattered.direction(), rec.normal) > 0.0f);
 	}
+	virtual void scatter_batch(const HitBatch &hits, ScatterBatch &out) const override;
+
+	virtual glm::vec3 albedo(const HitRecord &rec) const override { return m_texture ? m_texture->value(rec) : m_albedo; }
+
+	bool textured() const { return m_texture || m_roughness; }
+	// the albedo and fuzz of untextured instances
+	glm::vec3 constant_albedo() const { return m_albedo; }
+	float fuzz() const { return m_fuzz; }
 
 private:
 	glm::vec3 m_albedo;
 	float m_fuzz;
+	std::shared_ptr<Texture> m_texture;
+	std::shared_ptr<Texture> m_roughness;
 };
 
-class Dielectric : public Material
+class Dielectric final : public Material
 {
 public:
 	Dielectric(float ri)
@@ -72,11 +163,11 @@ public:
 		if (glm::dot(ray_in.direction(), rec.normal) > 0) {
 			outward_normal = -rec.normal;
 			ni_over_nt = m_ref_index;
-			cosine = m_ref_index * glm::dot(ray_in.direction(), rec.normal) / ray_in.direction().length();
+			cosine = m_ref_index * glm::dot(ray_in.direction(), rec.normal) / glm::length(ray_in.direction());
 		} else {
 			outward_normal = rec.normal;
 			ni_over_nt = 1.0f / m_ref_index;
-			cosine = -glm::dot(ray_in.direction(), rec.normal) / ray_in.direction().length();
+			cosine = -glm::dot(ray_in.direction(), rec.normal) / glm::length(ray_in.direction());
 		}
 		if (refract(ray_in.direction(), outward_normal, ni_over_nt, refracted)) {
 			reflect_prob = schlick(cosine);
@@ -90,6 +181,9 @@ public:
 		}
 		return true;
 	}
+	virtual void scatter_batch(const HitBatch &hits, ScatterBatch &out) const override;
+
+	float ref_index() const { return m_ref_index; }
 
 private:
 	bool refract(const glm::vec3 &v, const glm::vec3 &n, float ni_over_nt, glm::vec3 &refracted) const
@@ -109,13 +203,259 @@ private:
 	{
 		float r0 = (1.0f - m_ref_index) / (1.0f + m_ref_index);
 		r0 = r0 * r0;
-		return r0 + (1.0f - r0) * std::pow((1.0f - cosine), 5.0f);
+		return r0 + (1.0f - r0) * detail::pow5(1.0f - cosine);
 	}
 
 
+#ifndef __AVX2__
+	// one lane of the batch kernel, for builds without avx2
+	void scatter_lane(const HitBatch &hits, size_t i, float u, ScatterBatch &out) const;
+#endif
+
 private:
 	float m_ref_index;
 };
 
+class DiffuseLight final : public Material
+{
+public:
+	DiffuseLight(const glm::vec3 &emit, const Light *light = nullptr)
+		: m_emit(emit), m_light(light) {}
+
+	virtual bool scatter(const Ray &ray_in, const HitRecord &rec, RandomGenerator<float> &rand,
+		glm::vec3 &attenuation, Ray &scattered) const override
+	{
+		return false;
+	}
+
+	virtual glm::vec3 emitted(const Ray &ray_in, const HitRecord &rec) const override { return m_emit; }
+	virtual const Light *light() const override { return m_light; }
+
+	glm::vec3 emission() const { return m_emit; }
+
+private:
+	glm::vec3 m_emit;
+	const Light *m_light;
+};
+
+void Lambertian::scatter_batch(const HitBatch &hits, ScatterBatch &out) const
+{
+	glm::vec3 albedo[detail::SCATTER_BATCH];
+	// padded to whole groups of 8 for the tail
+	float u0[detail::SCATTER_BATCH] = {}, u1[detail::SCATTER_BATCH] = {};
+	for (size_t begin = 0; begin < hits.count; begin += detail::SCATTER_BATCH) {
+		const size_t count = std::min(detail::SCATTER_BATCH, hits.count - begin);
+		if (m_texture) {
+			m_texture->value_batch(hits.recs + begin, count, albedo);
+		} else {
+			std::fill(albedo, albedo + count, m_albedo);
+		}
+		for (size_t j = 0; j < count; ++j) {
+			u0[j] = hits.rands[begin + j]->gen();
+			u1[j] = hits.rands[begin + j]->gen();
+			out.ar[begin + j] = albedo[j].r;
+			out.ag[begin + j] = albedo[j].g;
+			out.ab[begin + j] = albedo[j].b;
+			out.valid[begin + j] = 1;
+		}
+		// cosine weighted: normal plus a uniform unit vector
+#ifdef __AVX2__
+		auto lanes8 = [&](const HitBatch &h, ScatterBatch &o, size_t i, size_t j) {
+			__m256 x, y, z;
+			detail::unit_vector8(_mm256_loadu_ps(u0 + j), _mm256_loadu_ps(u1 + j), x, y, z);
+			_mm256_storeu_ps(o.dx + i, _mm256_add_ps(_mm256_loadu_ps(h.nx + i), x));
+			_mm256_storeu_ps(o.dy + i, _mm256_add_ps(_mm256_loadu_ps(h.ny + i), y));
+			_mm256_storeu_ps(o.dz + i, _mm256_add_ps(_mm256_loadu_ps(h.nz + i), z));
+		};
+		size_t j = 0;
+		for (; j + 8 <= count; j += 8) {
+			lanes8(hits, out, begin + j, j);
+		}
+		if (j < count) {
+			detail::PaddedLanes8 tail(hits, out, begin + j, count - j);
+			lanes8(tail.hits, tail.out, 0, j);
+			tail.store(out, begin + j, count - j);
+		}
+#else
+		for (size_t j = 0; j < count; ++j) {
+			const size_t i = begin + j;
+			glm::vec3 v = detail::unit_vector(u0[j], u1[j]);
+			out.dx[i] = hits.nx[i] + v.x;
+			out.dy[i] = hits.ny[i] + v.y;
+			out.dz[i] = hits.nz[i] + v.z;
+		}
+#endif
+	}
+}
+
+void Metal::scatter_batch(const HitBatch &hits, ScatterBatch &out) const
+{
+	glm::vec3 albedo[detail::SCATTER_BATCH], roughness[detail::SCATTER_BATCH];
+	// padded to whole groups of 8 for the tail
+	float fuzz[detail::SCATTER_BATCH] = {};
+	float u[5][detail::SCATTER_BATCH] = {};
+	for (size_t begin = 0; begin < hits.count; begin += detail::SCATTER_BATCH) {
+		const size_t count = std::min(detail::SCATTER_BATCH, hits.count - begin);
+		if (m_texture) {
+			m_texture->value_batch(hits.recs + begin, count, albedo);
+		} else {
+			std::fill(albedo, albedo + count, m_albedo);
+		}
+		if (m_roughness) {
+			m_roughness->value_batch(hits.recs + begin, count, roughness);
+		}
+		for (size_t j = 0; j < count; ++j) {
+			fuzz[j] = m_roughness ? m_fuzz * roughness[j].r : m_fuzz;
+			for (auto &stream : u) {
+				stream[j] = hits.rands[begin + j]->gen();
+			}
+			out.ar[begin + j] = albedo[j].r;
+			out.ag[begin + j] = albedo[j].g;
+			out.ab[begin + j] = albedo[j].b;
+		}
+		// mirror direction plus fuzz times a point in the unit ball. The largest of three uniform
+		// numbers has the cdf r^3 of the radius of a uniform ball point, so no rejection loop.
+#ifdef __AVX2__
+		const __m256 two = _mm256_set1_ps(2.0f);
+		auto lanes8 = [&](const HitBatch &h, ScatterBatch &o, size_t i, size_t j) {
+			__m256 nx = _mm256_loadu_ps(h.nx + i), ny = _mm256_loadu_ps(h.ny + i), nz = _mm256_loadu_ps(h.nz + i);
+			__m256 dx = _mm256_loadu_ps(h.dx + i), dy = _mm256_loadu_ps(h.dy + i), dz = _mm256_loadu_ps(h.dz + i);
+			__m256 inv_len = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(detail::dot8(dx, dy, dz, dx, dy, dz)));
+			dx = _mm256_mul_ps(dx, inv_len);
+			dy = _mm256_mul_ps(dy, inv_len);
+			dz = _mm256_mul_ps(dz, inv_len);
+			__m256 k = _mm256_mul_ps(two, detail::dot8(dx, dy, dz, nx, ny, nz));
+			__m256 bx, by, bz;
+			detail::unit_vector8(_mm256_loadu_ps(u[0] + j), _mm256_loadu_ps(u[1] + j), bx, by, bz);
+			__m256 radius = _mm256_max_ps(_mm256_loadu_ps(u[2] + j), _mm256_max_ps(_mm256_loadu_ps(u[3] + j), _mm256_loadu_ps(u[4] + j)));
+			radius = _mm256_mul_ps(radius, _mm256_loadu_ps(fuzz + j));
+			__m256 sx = detail::madd8(radius, bx, detail::nmadd8(k, nx, dx));
+			__m256 sy = detail::madd8(radius, by, detail::nmadd8(k, ny, dy));
+			__m256 sz = detail::madd8(radius, bz, detail::nmadd8(k, nz, dz));
+			_mm256_storeu_ps(o.dx + i, sx);
+			_mm256_storeu_ps(o.dy + i, sy);
+			_mm256_storeu_ps(o.dz + i, sz);
+			int above = _mm256_movemask_ps(_mm256_cmp_ps(detail::dot8(sx, sy, sz, nx, ny, nz), _mm256_setzero_ps(), _CMP_GT_OQ));
+			for (int l = 0; l < 8; ++l) {
+				o.valid[i + l] = uint8_t((above >> l) & 1);
+			}
+		};
+		size_t j = 0;
+		for (; j + 8 <= count; j += 8) {
+			lanes8(hits, out, begin + j, j);
+		}
+		if (j < count) {
+			detail::PaddedLanes8 tail(hits, out, begin + j, count - j);
+			lanes8(tail.hits, tail.out, 0, j);
+			tail.store(out, begin + j, count - j);
+		}
+#else
+		for (size_t j = 0; j < count; ++j) {
+			const size_t i = begin + j;
+			glm::vec3 n(hits.nx[i], hits.ny[i], hits.nz[i]);
+			glm::vec3 reflected = glm::reflect(glm::normalize(glm::vec3(hits.dx[i], hits.dy[i], hits.dz[i])), n);
+			float radius = fuzz[j] * std::max(u[2][j], std::max(u[3][j], u[4][j]));
+			glm::vec3 s = reflected + radius * detail::unit_vector(u[0][j], u[1][j]);
+			out.dx[i] = s.x;
+			out.dy[i] = s.y;
+			out.dz[i] = s.z;
+			out.valid[i] = glm::dot(s, n) > 0.0f;
+		}
+#endif
+	}
+}
+
+#ifdef __AVX2__
+void Dielectric::scatter_batch(const HitBatch &hits, ScatterBatch &out) const
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 ri = _mm256_set1_ps(m_ref_index);
+	const __m256 inv_ri = _mm256_set1_ps(1.0f / m_ref_index);
+	float r0 = (1.0f - m_ref_index) / (1.0f + m_ref_index);
+	const __m256 r0v = _mm256_set1_ps(r0 * r0);
+	// u is padded for the tail
+	auto lanes8 = [&](const HitBatch &h, ScatterBatch &o, size_t i, const float *u) {
+		__m256 nx = _mm256_loadu_ps(h.nx + i), ny = _mm256_loadu_ps(h.ny + i), nz = _mm256_loadu_ps(h.nz + i);
+		__m256 dx = _mm256_loadu_ps(h.dx + i), dy = _mm256_loadu_ps(h.dy + i), dz = _mm256_loadu_ps(h.dz + i);
+		__m256 dn = detail::dot8(dx, dy, dz, nx, ny, nz);
+		__m256 inv_len = _mm256_div_ps(one, _mm256_sqrt_ps(detail::dot8(dx, dy, dz, dx, dy, dz)));
+		// leaving the medium flips the normal and the index ratio
+		__m256 exiting = _mm256_cmp_ps(dn, zero, _CMP_GT_OQ);
+		__m256 flip = _mm256_and_ps(exiting, _mm256_set1_ps(-0.0f));
+		__m256 ox = _mm256_xor_ps(nx, flip), oy = _mm256_xor_ps(ny, flip), oz = _mm256_xor_ps(nz, flip);
+		__m256 eta = _mm256_blendv_ps(inv_ri, ri, exiting);
+		__m256 cosine = _mm256_mul_ps(_mm256_blendv_ps(_mm256_xor_ps(dn, _mm256_set1_ps(-0.0f)), _mm256_mul_ps(ri, dn), exiting), inv_len);
+
+		// refraction of the unit direction about the outward normal
+		__m256 vx = _mm256_mul_ps(dx, inv_len), vy = _mm256_mul_ps(dy, inv_len), vz = _mm256_mul_ps(dz, inv_len);
+		__m256 dt = detail::dot8(vx, vy, vz, ox, oy, oz);
+		__m256 discr = detail::nmadd8(_mm256_mul_ps(eta, eta), detail::nmadd8(dt, dt, one), one);
+		__m256 can_refract = _mm256_cmp_ps(discr, zero, _CMP_GT_OQ);
+		__m256 root = _mm256_sqrt_ps(_mm256_max_ps(discr, zero));
+		__m256 tx = detail::msub8(eta, detail::nmadd8(ox, dt, vx), _mm256_mul_ps(ox, root));
+		__m256 ty = detail::msub8(eta, detail::nmadd8(oy, dt, vy), _mm256_mul_ps(oy, root));
+		__m256 tz = detail::msub8(eta, detail::nmadd8(oz, dt, vz), _mm256_mul_ps(oz, root));
+
+		// schlick's fresnel, total internal reflection always reflects
+		__m256 fresnel = detail::madd8(_mm256_sub_ps(one, r0v), detail::pow5_8(_mm256_sub_ps(one, cosine)), r0v);
+		__m256 reflect_prob = _mm256_blendv_ps(one, fresnel, can_refract);
+		__m256 reflect = _mm256_cmp_ps(_mm256_loadu_ps(u), reflect_prob, _CMP_LT_OQ);
+
+		__m256 k = _mm256_add_ps(dn, dn);
+		_mm256_storeu_ps(o.dx + i, _mm256_blendv_ps(tx, detail::nmadd8(k, nx, dx), reflect));
+		_mm256_storeu_ps(o.dy + i, _mm256_blendv_ps(ty, detail::nmadd8(k, ny, dy), reflect));
+		_mm256_storeu_ps(o.dz + i, _mm256_blendv_ps(tz, detail::nmadd8(k, nz, dz), reflect));
+		_mm256_storeu_ps(o.ar + i, one);
+		_mm256_storeu_ps(o.ag + i, one);
+		_mm256_storeu_ps(o.ab + i, one);
+		std::fill(o.valid + i, o.valid + i + 8, uint8_t(1));
+	};
+	float u[8] = {};
+	size_t i = 0;
+	for (; i + 8 <= hits.count; i += 8) {
+		for (size_t l = 0; l < 8; ++l) {
+			u[l] = hits.rands[i + l]->gen();
+		}
+		lanes8(hits, out, i, u);
+	}
+	if (i < hits.count) {
+		const size_t count = hits.count - i;
+		for (size_t l = 0; l < count; ++l) {
+			u[l] = hits.rands[i + l]->gen();
+		}
+		detail::PaddedLanes8 tail(hits, out, i, count);
+		lanes8(tail.hits, tail.out, 0, u);
+		tail.store(out, i, count);
+	}
+}
+#else
+void Dielectric::scatter_lane(const HitBatch &hits, size_t i, float u, ScatterBatch &out) const
+{
+	glm::vec3 d(hits.dx[i], hits.dy[i], hits.dz[i]);
+	glm::vec3 n(hits.nx[i], hits.ny[i], hits.nz[i]);
+	float dn = glm::dot(d, n);
+	bool exiting = dn > 0.0f;
+	float cosine = (exiting ? m_ref_index * dn : -dn) / glm::length(d);
+	glm::vec3 refracted;
+	float reflect_prob = 1.0f;
+	if (refract(d, exiting ? -n : n, exiting ? m_ref_index : 1.0f / m_ref_index, refracted)) {
+		reflect_prob = schlick(cosine);
+	}
+	glm::vec3 s = u < reflect_prob ? glm::reflect(d, n) : refracted;
+	out.dx[i] = s.x;
+	out.dy[i] = s.y;
+	out.dz[i] = s.z;
+	out.ar[i] = out.ag[i] = out.ab[i] = 1.0f;
+	out.valid[i] = 1;
+}
+
+void Dielectric::scatter_batch(const HitBatch &hits, ScatterBatch &out) const
+{
+	for (size_t i = 0; i < hits.count; ++i) {
+		scatter_lane(hits, i, hits.rands[i]->gen(), out);
+	}
+}
+#endif
 
 #endif
\ No newline at end of file
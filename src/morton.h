@@ -0,0 +1,133 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <glm/glm.hpp>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// 3d morton codes: the bits of x, y and z interleaved, x highest. 30 bit codes keep 10 bits per
+// axis in a uint32_t, 63 bit codes 21 bits per axis in a uint64_t.
+namespace morton
+{
+
+// spreads the low 10 bits of v out to every third bit
+inline uint32_t spread10(uint32_t v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// spreads the low 21 bits of v out to every third bit
+inline uint64_t spread21(uint64_t v)
+{
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x001f00000000ffffull;
+	v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+	v = (v | (v << 8)) & 0x100f00f00f00f00full;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+template<class Key>
+struct Traits;
+
+template<>
+struct Traits<uint32_t>
+{
+	static const int BITS_PER_AXIS = 10;
+	static uint32_t encode(uint32_t x, uint32_t y, uint32_t z) { return (spread10(x) << 2) | (spread10(y) << 1) | spread10(z); }
+};
+
+template<>
+struct Traits<uint64_t>
+{
+	static const int BITS_PER_AXIS = 21;
+	static uint64_t encode(uint64_t x, uint64_t y, uint64_t z) { return (spread21(x) << 2) | (spread21(y) << 1) | spread21(z); }
+};
+
+// code of a point given in [0, 1]^3
+template<class Key>
+Key encode(const glm::vec3 &unit)
+{
+	const float cells = float(1u << Traits<Key>::BITS_PER_AXIS);
+	auto quantize = [&](float v) { return Key(std::min(std::max(v * cells, 0.0f), cells - 1.0f)); };
+	return Traits<Key>::encode(quantize(unit.x), quantize(unit.y), quantize(unit.z));
+}
+
+// axis a bit of a code belongs to
+inline int axis_of_bit(int bit)
+{
+	return 2 - bit % 3;
+}
+
+// stable lsd radix sort on key, 8 bits per pass, up to the highest bit any key has set. The
+// array is cut into a fixed number of contiguous chunks that are counted and scattered on their
+// own, so the result doesn't depend on how many threads the team actually gets.
+template<class Item, class GetKey>
+void radix_sort(std::vector<Item> &items, GetKey key)
+{
+	const size_t n = items.size();
+	using Key = decltype(key(items[0]));
+	Key all = 0;
+	for (const Item &it : items) {
+		all |= key(it);
+	}
+	int bits = 0;
+	while (bits < int(8 * sizeof(Key)) && (all >> bits) != 0) {
+		bits += 8;
+	}
+	std::vector<Item> tmp(n);
+#ifdef _OPENMP
+	const int chunks = std::max(1, std::min(omp_get_max_threads(), int(n / 4096)));
+#else
+	const int chunks = 1;
+#endif
+	std::vector<size_t> offsets(size_t(chunks) * 256);
+	for (int shift = 0; shift < bits; shift += 8) {
+		std::fill(offsets.begin(), offsets.end(), 0);
+        #pragma omp parallel num_threads(chunks)
+		{
+            #pragma omp for schedule(static)
+			for (int c = 0; c < chunks; ++c) {
+				const size_t begin = n * size_t(c) / size_t(chunks), end = n * size_t(c + 1) / size_t(chunks);
+				size_t *count = &offsets[size_t(c) * 256];
+				for (size_t i = begin; i < end; ++i) {
+					count[(key(items[i]) >> shift) & 0xff]++;
+				}
+			}
+            #pragma omp single
+			{
+				// digit major, chunk minor: chunk c's items of digit d follow those of chunks < c
+				size_t sum = 0;
+				for (int d = 0; d < 256; ++d) {
+					for (int k = 0; k < chunks; ++k) {
+						size_t c = offsets[size_t(k) * 256 + d];
+						offsets[size_t(k) * 256 + d] = sum;
+						sum += c;
+					}
+				}
+			}
+            #pragma omp for schedule(static)
+			for (int c = 0; c < chunks; ++c) {
+				const size_t begin = n * size_t(c) / size_t(chunks), end = n * size_t(c + 1) / size_t(chunks);
+				size_t *count = &offsets[size_t(c) * 256];
+				for (size_t i = begin; i < end; ++i) {
+					tmp[count[(key(items[i]) >> shift) & 0xff]++] = items[i];
+				}
+			}
+		}
+		items.swap(tmp);
+	}
+}
+}
+
+#endif //MORTON_H
@@ -0,0 +1,194 @@
+#ifndef NOISE_H
+#define NOISE_H
+
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <algorithm>
+#include <glm/glm.hpp>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// improved Perlin noise (2002) with a seeded permutation table. The gradients are the
+// 12 cube edge directions picked from the low hash bits, so no gradient table is fetched.
+// The batch functions take SoA coordinates and run 8 points per iteration with AVX2.
+class Perlin
+{
+public:
+	Perlin(uint32_t seed = 0);
+
+	float noise(const glm::vec3 &p) const;
+	float turbulence(const glm::vec3 &p, int octaves = 7) const;
+
+	void noise(const float *x, const float *y, const float *z, float *out, size_t n) const;
+	void turbulence(const float *x, const float *y, const float *z, float *out, size_t n, int octaves = 7) const;
+
+private:
+	static float fade(float t) { return t * t * t * (t * (t * 6.0f - 15.0f) + 10.0f); }
+	static float lerp(float t, float a, float b) { return a + t * (b - a); }
+	static float grad(int hash, float x, float y, float z)
+	{
+		int h = hash & 15;
+		float u = h < 8 ? x : y;
+		float v = h < 4 ? y : (h == 12 || h == 14 ? x : z);
+		return ((h & 1) ? -u : u) + ((h & 2) ? -v : v);
+	}
+
+#ifdef __AVX2__
+	__m256 noise8(__m256 x, __m256 y, __m256 z) const;
+#endif
+
+private:
+	int32_t m_perm[512];
+};
+
+Perlin::Perlin(uint32_t seed)
+{
+	for (int i = 0; i < 256; ++i) {
+		m_perm[i] = i;
+	}
+	std::mt19937 engine(seed);
+	std::shuffle(m_perm, m_perm + 256, engine);
+	for (int i = 0; i < 256; ++i) {
+		m_perm[256 + i] = m_perm[i];
+	}
+}
+
+float Perlin::noise(const glm::vec3 &p) const
+{
+	float fx = std::floor(p.x), fy = std::floor(p.y), fz = std::floor(p.z);
+	int X = int(fx) & 255, Y = int(fy) & 255, Z = int(fz) & 255;
+	float x = p.x - fx, y = p.y - fy, z = p.z - fz;
+	float u = fade(x), v = fade(y), w = fade(z);
+	const int32_t *P = m_perm;
+	int A = P[X] + Y, AA = P[A] + Z, AB = P[A + 1] + Z;
+	int B = P[X + 1] + Y, BA = P[B] + Z, BB = P[B + 1] + Z;
+	return lerp(w, lerp(v, lerp(u, grad(P[AA], x, y, z), grad(P[BA], x - 1, y, z)),
+			lerp(u, grad(P[AB], x, y - 1, z), grad(P[BB], x - 1, y - 1, z))),
+		lerp(v, lerp(u, grad(P[AA + 1], x, y, z - 1), grad(P[BA + 1], x - 1, y, z - 1)),
+			lerp(u, grad(P[AB + 1], x, y - 1, z - 1), grad(P[BB + 1], x - 1, y - 1, z - 1))));
+}
+
+float Perlin::turbulence(const glm::vec3 &p, int octaves) const
+{
+	float sum = 0.0f;
+	float weight = 1.0f;
+	glm::vec3 q = p;
+	for (int i = 0; i < octaves; ++i) {
+		sum += weight * noise(q);
+		weight *= 0.5f;
+		q *= 2.0f;
+	}
+	return std::abs(sum);
+}
+
+#ifdef __AVX2__
+namespace detail
+{
+
+inline __m256 perlin_fade8(__m256 t)
+{
+	__m256 r = _mm256_sub_ps(_mm256_mul_ps(t, _mm256_set1_ps(6.0f)), _mm256_set1_ps(15.0f));
+	r = _mm256_add_ps(_mm256_mul_ps(t, r), _mm256_set1_ps(10.0f));
+	return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(t, t), t), r);
+}
+
+inline __m256 perlin_lerp8(__m256 t, __m256 a, __m256 b)
+{
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+inline __m256 perlin_grad8(__m256i hash, __m256 x, __m256 y, __m256 z)
+{
+	const __m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(15));
+	const __m256 lt8 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(8), h));
+	const __m256 lt4 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+	const __m256 h12_14 = _mm256_castsi256_ps(_mm256_or_si256(
+		_mm256_cmpeq_epi32(h, _mm256_set1_epi32(12)), _mm256_cmpeq_epi32(h, _mm256_set1_epi32(14))));
+	__m256 u = _mm256_blendv_ps(y, x, lt8);
+	__m256 v = _mm256_blendv_ps(_mm256_blendv_ps(z, x, h12_14), y, lt4);
+	// flip the sign bits from hash bits 0 and 1
+	const __m256 sign_u = _mm256_castsi256_ps(_mm256_slli_epi32(h, 31));
+	const __m256 sign_v = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(h, 1), 31));
+	return _mm256_add_ps(_mm256_xor_ps(u, sign_u), _mm256_xor_ps(v, sign_v));
+}
+
+}
+
+__m256 Perlin::noise8(__m256 x, __m256 y, __m256 z) const
+{
+	const __m256i mask = _mm256_set1_epi32(255);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256 onef = _mm256_set1_ps(1.0f);
+	__m256 fx = _mm256_floor_ps(x), fy = _mm256_floor_ps(y), fz = _mm256_floor_ps(z);
+	__m256i X = _mm256_and_si256(_mm256_cvttps_epi32(fx), mask);
+	__m256i Y = _mm256_and_si256(_mm256_cvttps_epi32(fy), mask);
+	__m256i Z = _mm256_and_si256(_mm256_cvttps_epi32(fz), mask);
+	x = _mm256_sub_ps(x, fx);
+	y = _mm256_sub_ps(y, fy);
+	z = _mm256_sub_ps(z, fz);
+	__m256 u = detail::perlin_fade8(x), v = detail::perlin_fade8(y), w = detail::perlin_fade8(z);
+
+	const int *P = m_perm;
+	__m256i A = _mm256_add_epi32(_mm256_i32gather_epi32(P, X, 4), Y);
+	__m256i B = _mm256_add_epi32(_mm256_i32gather_epi32(P, _mm256_add_epi32(X, one), 4), Y);
+	__m256i AA = _mm256_add_epi32(_mm256_i32gather_epi32(P, A, 4), Z);
+	__m256i AB = _mm256_add_epi32(_mm256_i32gather_epi32(P, _mm256_add_epi32(A, one), 4), Z);
+	__m256i BA = _mm256_add_epi32(_mm256_i32gather_epi32(P, B, 4), Z);
+	__m256i BB = _mm256_add_epi32(_mm256_i32gather_epi32(P, _mm256_add_epi32(B, one), 4), Z);
+
+	__m256 x1 = _mm256_sub_ps(x, onef), y1 = _mm256_sub_ps(y, onef), z1 = _mm256_sub_ps(z, onef);
+	__m256 g000 = detail::perlin_grad8(_mm256_i32gather_epi32(P, AA, 4), x, y, z);
+	__m256 g100 = detail::perlin_grad8(_mm256_i32gather_epi32(P, BA, 4), x1, y, z);
+	__m256 g010 = detail::perlin_grad8(_mm256_i32gather_epi32(P, AB, 4), x, y1, z);
+	__m256 g110 = detail::perlin_grad8(_mm256_i32gather_epi32(P, BB, 4), x1, y1, z);
+	__m256 g001 = detail::perlin_grad8(_mm256_i32gather_epi32(P, _mm256_add_epi32(AA, one), 4), x, y, z1);
+	__m256 g101 = detail::perlin_grad8(_mm256_i32gather_epi32(P, _mm256_add_epi32(BA, one), 4), x1, y, z1);
+	__m256 g011 = detail::perlin_grad8(_mm256_i32gather_epi32(P, _mm256_add_epi32(AB, one), 4), x, y1, z1);
+	__m256 g111 = detail::perlin_grad8(_mm256_i32gather_epi32(P, _mm256_add_epi32(BB, one), 4), x1, y1, z1);
+
+	__m256 l0 = detail::perlin_lerp8(v, detail::perlin_lerp8(u, g000, g100), detail::perlin_lerp8(u, g010, g110));
+	__m256 l1 = detail::perlin_lerp8(v, detail::perlin_lerp8(u, g001, g101), detail::perlin_lerp8(u, g011, g111));
+	return detail::perlin_lerp8(w, l0, l1);
+}
+#endif
+
+void Perlin::noise(const float *x, const float *y, const float *z, float *out, size_t n) const
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	for (; i + 8 <= n; i += 8) {
+		_mm256_storeu_ps(out + i, noise8(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), _mm256_loadu_ps(z + i)));
+	}
+#endif
+	for (; i < n; ++i) {
+		out[i] = noise(glm::vec3(x[i], y[i], z[i]));
+	}
+}
+
+void Perlin::turbulence(const float *x, const float *y, const float *z, float *out, size_t n, int octaves) const
+{
+	size_t i = 0;
+#ifdef __AVX2__
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+	for (; i + 8 <= n; i += 8) {
+		__m256 px = _mm256_loadu_ps(x + i), py = _mm256_loadu_ps(y + i), pz = _mm256_loadu_ps(z + i);
+		__m256 sum = _mm256_setzero_ps();
+		float weight = 1.0f;
+		for (int o = 0; o < octaves; ++o) {
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weight), noise8(px, py, pz)));
+			weight *= 0.5f;
+			px = _mm256_add_ps(px, px);
+			py = _mm256_add_ps(py, py);
+			pz = _mm256_add_ps(pz, pz);
+		}
+		_mm256_storeu_ps(out + i, _mm256_and_ps(sum, abs_mask));
+	}
+#endif
+	for (; i < n; ++i) {
+		out[i] = turbulence(glm::vec3(x[i], y[i], z[i]), octaves);
+	}
+}
+
+#endif //NOISE_H
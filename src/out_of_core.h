@@ -0,0 +1,896 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+// Out of core geometry: the primitives of a scene written to a cluster file and paged in on
+// demand, for scenes whose primitives don't fit in memory next to everything else.
+//
+// A cluster is a run of up to cluster_size primitives in morton order of their centroids, so
+// primitives near each other, stored with its binary BVH: the tree's nodes, then the primitives
+// in leaf order. Only the cluster table stays resident, as the leaves of a small top level BVH.
+// A cluster is decoded into Hitables when a ray enters its box, and dropped again, least recently
+// used first, when the decoded clusters exceed the budget. The file is memory mapped, so reading
+// a cluster is page faults on pages the kernel can drop again under pressure.
+//
+// Two ways to trace:
+// - hit() and occluded(), the Hitable interface: a ray entering a cluster that isn't resident
+//   waits while it is paged in.
+// - hit_batch() and occluded_batch(), which the wavefront integrator traces through: rays first
+//   only run through the resident clusters; the ones entering others are deferred, then grouped
+//   by cluster and worked off one cluster at a time, longest queue first, so a page-in serves
+//   every ray still waiting for it.
+//
+// File layout (native endian):
+//   char[4] "OOC2", uint32 cluster count, uint64 offset of the material table
+//   per cluster: ClusterEntry (bounds, offset, node and primitive count)
+//   clusters: BVH nodes, then a PrimRecord per primitive, at 64 byte aligned offsets
+//   materials: uint32 count, a MaterialRecord per material the records index
+// Materials with constant parameters are stored, so the file renders without the scene it was
+// written from, given the scene's lights for the emitters' light links. Textured materials are
+// only marked; files with them need the material table of the process that wrote them.
+
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include "aabb.h"
+#include "ray.h"
+#include "hitable.h"
+#include "material.h"
+#include "light_sampler.h"
+#include "bvh.h"
+#include "morton.h"
+#include "trace.h"
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+struct OutOfCoreOptions
+{
+	int cluster_size = 4096;                      // primitives per cluster
+	size_t budget = size_t(256) << 20;            // bytes of decoded clusters kept resident
+	AccelOptions blas = accel_from_string("bvh"); // builder of the cluster trees, always binary
+};
+
+// a file read through a read only mapping, or where there is no mmap (windows) read on request
+class MappedFile
+{
+public:
+	MappedFile() {}
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	bool open(const std::string &path);
+	uint64_t size() const { return m_size; }
+
+	// the bytes [offset, offset + size): a pointer into the mapping, or into scratch after
+	// reading them; nullptr past the end of the file
+	const char *range(uint64_t offset, size_t size, std::vector<char> &scratch) const;
+
+private:
+	uint64_t m_size = 0;
+#ifdef _WIN32
+	FILE *m_file = nullptr;
+	mutable std::mutex m_mutex;
+#else
+	int m_fd = -1;
+	const char *m_data = nullptr;
+#endif
+};
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (m_file) {
+		std::fclose(m_file);
+	}
+#else
+	if (m_data) {
+		munmap(const_cast<char *>(m_data), size_t(m_size));
+	}
+	if (m_fd >= 0) {
+		close(m_fd);
+	}
+#endif
+}
+
+bool MappedFile::open(const std::string &path)
+{
+#ifdef _WIN32
+	m_file = std::fopen(path.c_str(), "rb");
+	if (!m_file || _fseeki64(m_file, 0, SEEK_END) != 0) {
+		return false;
+	}
+	m_size = uint64_t(_ftelli64(m_file));
+	return true;
+#else
+	m_fd = ::open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if (m_fd < 0 || fstat(m_fd, &st) != 0 || st.st_size <= 0) {
+		return false;
+	}
+	m_size = uint64_t(st.st_size);
+	void *data = mmap(nullptr, size_t(m_size), PROT_READ, MAP_PRIVATE, m_fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	m_data = static_cast<const char *>(data);
+	return true;
+#endif
+}
+
+const char *MappedFile::range(uint64_t offset, size_t size, std::vector<char> &scratch) const
+{
+	if (offset > m_size || size > m_size - offset) {
+		return nullptr;
+	}
+#ifdef _WIN32
+	scratch.resize(size);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (_fseeki64(m_file, int64_t(offset), SEEK_SET) != 0 || std::fread(scratch.data(), 1, size, m_file) != size) {
+		return nullptr;
+	}
+	return scratch.data();
+#else
+	(void)scratch;
+	return m_data + offset;
+#endif
+}
+
+namespace detail
+{
+
+inline long process_id()
+{
+#ifdef _WIN32
+	return long(_getpid());
+#else
+	return long(getpid());
+#endif
+}
+
+}
+
+class OutOfCoreWorld : public Hitable
+{
+public:
+	struct ClusterEntry
+	{
+		AABB bounds;
+		uint64_t offset;
+		uint32_t node_count;
+		uint32_t prim_count;
+	};
+
+	struct PrimRecord
+	{
+		uint32_t type; // SPHERE: center, radius; QUAD: corner, edge u, edge v
+		uint32_t id;
+		uint32_t material;
+		float data[9];
+	};
+
+	enum : uint32_t { SPHERE = 0, QUAD = 1 };
+
+	struct MaterialRecord
+	{
+		uint32_t type;  // LAMBERTIAN: albedo; METAL: albedo, fuzz; DIELECTRIC: index; DIFFUSE_LIGHT: emission
+		uint32_t light; // DIFFUSE_LIGHT: index of its light in the scene's LightList, or NO_LIGHT
+		float data[4];
+	};
+
+	enum : uint32_t { LAMBERTIAN = 0, METAL = 1, DIELECTRIC = 2, DIFFUSE_LIGHT = 3, IN_MEMORY = 4 };
+	static const uint32_t NO_LIGHT = 0xffffffffu;
+
+	// writes the primitives, spheres and quads, to a cluster file and appends the materials
+	// they use to materials. The primitives are freed cluster by cluster as they are written.
+	// False if the file can't be written or a primitive has another type.
+	static bool write(const std::string &path, std::vector<std::unique_ptr<Hitable>> hitables,
+		const OutOfCoreOptions &options, const LightList &lights, std::vector<std::shared_ptr<Material>> &materials);
+	// the materials are decoded from the file with their light links into lights, unless the
+	// table write() filled is passed. nullptr if the file can't be read, or if it has materials
+	// that weren't stored and no table is passed.
+	static std::unique_ptr<OutOfCoreWorld> open(const std::string &path, const LightList &lights, size_t budget,
+		std::vector<std::shared_ptr<Material>> materials = {});
+
+	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override { return m_top->hit(r, tmin, tmax, rec); }
+	virtual bool occluded(const Ray &r, float tmin, float tmax) const override { return m_top->occluded(r, tmin, tmax); }
+	virtual AABB bounds() const override { return m_top->bounds(); }
+
+	// the same results as hit() and occluded() for each ray, with fewer page-ins
+	virtual void hit_batch(const Ray *rays, size_t count, float tmin, float tmax, HitRecord *recs, uint8_t *hits) const override;
+	virtual void occluded_batch(const Ray *rays, const float *tmax, size_t count, float tmin, uint8_t *occluded) const override;
+
+	size_t cluster_count() const { return m_entries.size(); }
+	uint64_t file_bytes() const { return m_file.size(); }
+	// with every cluster resident, an upper bound
+	size_t decoded_bytes() const;
+	size_t resident_bytes() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_resident_bytes;
+	}
+	// evicts down to the new budget on the next page-in
+	void set_budget(size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_budget = bytes;
+	}
+	uint64_t page_ins() const { return m_page_ins; }
+	// whether open() can decode every material, so the file renders without the writer's table
+	bool self_contained() const { return m_self_contained; }
+	// ray and cluster pairs the batches traced after a page-in
+	uint64_t deferred() const { return m_deferred; }
+
+private:
+	struct Cluster
+	{
+		std::unique_ptr<BVH> bvh;
+		size_t bytes = 0;
+	};
+
+	struct Slot
+	{
+		std::mutex mutex; // held while the cluster is paged in, so rays wanting it wait for one read
+		std::shared_ptr<const Cluster> cluster;
+		// page-in count at the last use, a clock that only ticks when eviction may be needed
+		std::atomic<uint64_t> last_use{ 0 };
+		size_t bytes = 0;    // counted in m_resident_bytes, under m_mutex
+		uint64_t loaded = 0; // page-in count when it was paged in, under m_mutex
+	};
+
+	// a resident cluster in the eviction heap: its last use when pushed, and the page-in it came
+	// from, which tells entries of evicted clusters apart
+	struct LruEntry
+	{
+		uint64_t used;
+		uint64_t loaded;
+		uint32_t cluster;
+
+		bool operator>(const LruEntry &o) const { return used > o.used; }
+	};
+
+	// a leaf of the top level: the box of a cluster, whose primitives are paged in by hit()
+	class Proxy : public Hitable
+	{
+	public:
+		Proxy(const OutOfCoreWorld *world, uint32_t index) : m_world(world), m_index(index) {}
+
+		virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override
+		{
+			return m_world->acquire(m_index)->bvh->hit(r, tmin, tmax, rec);
+		}
+
+		virtual bool occluded(const Ray &r, float tmin, float tmax) const override
+		{
+			return m_world->acquire(m_index)->bvh->occluded(r, tmin, tmax);
+		}
+
+		virtual AABB bounds() const override { return m_world->m_entries[m_index].bounds; }
+
+		uint32_t index() const { return m_index; }
+
+	private:
+		const OutOfCoreWorld *m_world;
+		uint32_t m_index;
+	};
+
+	OutOfCoreWorld() {}
+
+	static MaterialRecord encode(const Material &m, const std::unordered_map<const Light *, uint32_t> &light_index);
+	// nullptr for records that aren't stored or link to a light outside of lights
+	static std::shared_ptr<Material> decode(const MaterialRecord &rec, const LightList &lights);
+
+	static const uint64_t HEADER_BYTES = 16;
+
+	static size_t cluster_bytes(size_t node_count, size_t prim_count, size_t prim_size)
+	{
+		return sizeof(Cluster) + sizeof(BVH) + node_count * sizeof(BVH::Node)
+			+ prim_count * (sizeof(std::unique_ptr<Hitable>) + prim_size);
+	}
+
+	// the cluster, paged in if it isn't resident
+	std::shared_ptr<const Cluster> acquire(uint32_t index) const;
+	// the cluster if it is resident
+	std::shared_ptr<const Cluster> resident(uint32_t index) const;
+	std::shared_ptr<const Cluster> load(uint32_t index) const;
+	void evict_over_budget(uint32_t keep) const;
+
+	// calls f(cluster, t_enter) for the clusters whose boxes the ray enters, in no order
+	template<class F>
+	void for_each_cluster(const Ray &r, float tmin, float tmax, F &&f) const;
+
+	// a ray waiting for the page-in of a cluster whose box it enters at t
+	struct Deferred
+	{
+		uint32_t cluster;
+		uint32_t ray;
+		float t;
+	};
+	template<class Keep, class F>
+	void for_each_deferred(std::vector<Deferred> &deferred, Keep &&keep, F &&f) const;
+
+private:
+	MappedFile m_file;
+	std::vector<ClusterEntry> m_entries;
+	std::vector<std::shared_ptr<Material>> m_materials;
+	std::unique_ptr<BVH> m_top;
+	std::unique_ptr<Slot[]> m_slots;
+	size_t m_budget = 0;
+	bool m_self_contained = true;
+	mutable std::mutex m_mutex;
+	mutable size_t m_resident_bytes = 0;
+	// resident clusters, least recently used on top, under m_mutex
+	mutable std::priority_queue<LruEntry, std::vector<LruEntry>, std::greater<LruEntry>> m_lru;
+	mutable std::atomic<uint64_t> m_page_ins{ 0 };
+	mutable std::atomic<uint64_t> m_deferred{ 0 };
+};
+
+OutOfCoreWorld::MaterialRecord OutOfCoreWorld::encode(const Material &m, const std::unordered_map<const Light *, uint32_t> &light_index)
+{
+	MaterialRecord rec = {};
+	rec.type = IN_MEMORY;
+	rec.light = NO_LIGHT;
+	auto store = [&rec](uint32_t type, const glm::vec3 &v, float w) {
+		rec.type = type;
+		std::memcpy(rec.data, &v.x, 3 * sizeof(float));
+		rec.data[3] = w;
+	};
+	if (const Lambertian *l = dynamic_cast<const Lambertian *>(&m)) {
+		if (!l->textured()) {
+			store(LAMBERTIAN, l->constant_albedo(), 0.0f);
+		}
+	} else if (const Metal *metal = dynamic_cast<const Metal *>(&m)) {
+		if (!metal->textured()) {
+			store(METAL, metal->constant_albedo(), metal->fuzz());
+		}
+	} else if (const Dielectric *d = dynamic_cast<const Dielectric *>(&m)) {
+		store(DIELECTRIC, glm::vec3(d->ref_index(), 0.0f, 0.0f), 0.0f);
+	} else if (const DiffuseLight *e = dynamic_cast<const DiffuseLight *>(&m)) {
+		auto it = light_index.find(e->light());
+		if (!e->light()) {
+			store(DIFFUSE_LIGHT, e->emission(), 0.0f);
+		} else if (it != light_index.end()) {
+			store(DIFFUSE_LIGHT, e->emission(), 0.0f);
+			rec.light = it->second;
+		}
+	}
+	return rec;
+}
+
+std::shared_ptr<Material> OutOfCoreWorld::decode(const MaterialRecord &rec, const LightList &lights)
+{
+	const glm::vec3 v(rec.data[0], rec.data[1], rec.data[2]);
+	switch (rec.type) {
+	case LAMBERTIAN: return std::make_shared<Lambertian>(v);
+	case METAL: return std::make_shared<Metal>(v, rec.data[3]);
+	case DIELECTRIC: return std::make_shared<Dielectric>(v.x);
+	case DIFFUSE_LIGHT:
+		if (rec.light == NO_LIGHT) {
+			return std::make_shared<DiffuseLight>(v);
+		}
+		return rec.light < lights.size() ? std::make_shared<DiffuseLight>(v, lights[rec.light]) : nullptr;
+	default: return nullptr;
+	}
+}
+
+bool OutOfCoreWorld::write(const std::string &path, std::vector<std::unique_ptr<Hitable>> hitables,
+	const OutOfCoreOptions &options, const LightList &lights, std::vector<std::shared_ptr<Material>> &materials)
+{
+	trace::Scope trace_write("write clusters", "build", "primitives", int64_t(hitables.size()));
+	const size_t n = hitables.size();
+	const size_t cluster_size = size_t(std::max(1, options.cluster_size));
+	const uint32_t clusters = uint32_t((n + cluster_size - 1) / cluster_size);
+
+	struct Item
+	{
+		uint32_t code;
+		uint32_t index;
+	};
+	std::vector<Item> items(n);
+	{
+		AABB centroids;
+		for (const auto &h : hitables) {
+			centroids.expand(h->bounds().centroid());
+		}
+		const glm::vec3 d = centroids.diagonal();
+		const glm::vec3 scale(d.x > 0.0f ? 1.0f / d.x : 0.0f, d.y > 0.0f ? 1.0f / d.y : 0.0f, d.z > 0.0f ? 1.0f / d.z : 0.0f);
+		for (size_t i = 0; i < n; ++i) {
+			items[i] = { morton::encode<uint32_t>((hitables[i]->bounds().centroid() - centroids.min) * scale), uint32_t(i) };
+		}
+		morton::radix_sort(items, [](const Item &it) { return it.code; });
+	}
+
+	// written next to path and renamed over it when complete, so processes that have the old
+	// file mapped keep reading it, and processes writing the same path at once don't mix
+	const std::string tmp_path = path + ".tmp" + std::to_string(detail::process_id());
+	FILE *f = std::fopen(tmp_path.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	// the header and the table are written again at the end, once the offsets are known
+	std::vector<ClusterEntry> entries(clusters);
+	uint64_t material_offset = 0;
+	auto write_header = [&]() {
+		return std::fwrite("OOC2", 1, 4, f) == 4 && std::fwrite(&clusters, sizeof(clusters), 1, f) == 1
+			&& std::fwrite(&material_offset, sizeof(material_offset), 1, f) == 1
+			&& std::fwrite(entries.data(), sizeof(ClusterEntry), entries.size(), f) == entries.size();
+	};
+	bool ok = write_header();
+	uint64_t offset = HEADER_BYTES + uint64_t(clusters) * sizeof(ClusterEntry);
+
+	std::unordered_map<const Material *, uint32_t> material_index;
+	for (size_t i = 0; i < materials.size(); ++i) {
+		material_index.emplace(materials[i].get(), uint32_t(i));
+	}
+	auto index_of = [&](const std::shared_ptr<Material> &m) {
+		auto it = material_index.find(m.get());
+		if (it == material_index.end()) {
+			it = material_index.emplace(m.get(), uint32_t(materials.size())).first;
+			materials.push_back(m);
+		}
+		return it->second;
+	};
+
+	const char zeros[64] = {};
+	std::vector<PrimRecord> records;
+	for (uint32_t c = 0; c < clusters && ok; ++c) {
+		const size_t begin = c * cluster_size, end = std::min(n, begin + cluster_size);
+		std::vector<std::unique_ptr<Hitable>> prims;
+		std::vector<uint32_t> ids;
+		for (size_t k = begin; k < end; ++k) {
+			prims.push_back(std::move(hitables[items[k].index]));
+			ids.push_back(prims.back()->id());
+		}
+		// the tree numbers its primitives 1..k in the order given, which maps back to the ids
+		BVH blas(std::move(prims), options.blas);
+		records.clear();
+		for (const auto &h : blas.hitables()) {
+			PrimRecord rec = {};
+			rec.id = ids[h->id() - 1];
+			if (const Sphere *s = dynamic_cast<const Sphere *>(h.get())) {
+				const glm::vec3 center = s->center();
+				rec.type = SPHERE;
+				rec.material = index_of(s->shared_material());
+				std::memcpy(rec.data, &center.x, 3 * sizeof(float));
+				rec.data[3] = s->radius();
+			} else if (const Quad *q = dynamic_cast<const Quad *>(h.get())) {
+				const glm::vec3 v[3] = { q->corner(), q->edge_u(), q->edge_v() };
+				rec.type = QUAD;
+				rec.material = index_of(q->shared_material());
+				for (int k = 0; k < 3; ++k) {
+					std::memcpy(rec.data + 3 * k, &v[k].x, 3 * sizeof(float));
+				}
+			} else {
+				ok = false;
+				break;
+			}
+			records.push_back(rec);
+		}
+
+		const size_t pad = size_t((64 - offset % 64) % 64);
+		offset += pad;
+		entries[c] = { blas.bounds(), offset, uint32_t(blas.m_nodes.size()), uint32_t(records.size()) };
+		ok = ok && std::fwrite(zeros, 1, pad, f) == pad
+			&& std::fwrite(blas.m_nodes.data(), sizeof(BVH::Node), blas.m_nodes.size(), f) == blas.m_nodes.size()
+			&& std::fwrite(records.data(), sizeof(PrimRecord), records.size(), f) == records.size();
+		offset += blas.m_nodes.size() * sizeof(BVH::Node) + records.size() * sizeof(PrimRecord);
+	}
+
+	std::unordered_map<const Light *, uint32_t> light_index;
+	for (size_t i = 0; i < lights.size(); ++i) {
+		light_index.emplace(lights[i], uint32_t(i));
+	}
+	std::vector<MaterialRecord> material_records;
+	for (const auto &m : materials) {
+		material_records.push_back(encode(*m, light_index));
+	}
+	const uint32_t material_count = uint32_t(material_records.size());
+	material_offset = offset;
+	ok = ok && std::fwrite(&material_count, sizeof(material_count), 1, f) == 1
+		&& std::fwrite(material_records.data(), sizeof(MaterialRecord), material_records.size(), f) == material_records.size();
+	ok = ok && std::fseek(f, 0, SEEK_SET) == 0 && write_header();
+	ok = std::fclose(f) == 0 && ok;
+#ifdef _WIN32
+	if (ok) {
+		std::remove(path.c_str()); // rename doesn't replace files here
+	}
+#endif
+	ok = ok && std::rename(tmp_path.c_str(), path.c_str()) == 0;
+	if (!ok) {
+		std::remove(tmp_path.c_str());
+	}
+	return ok;
+}
+
+std::unique_ptr<OutOfCoreWorld> OutOfCoreWorld::open(const std::string &path, const LightList &lights, size_t budget,
+	std::vector<std::shared_ptr<Material>> materials)
+{
+	std::unique_ptr<OutOfCoreWorld> world(new OutOfCoreWorld());
+	if (!world->m_file.open(path)) {
+		return nullptr;
+	}
+	std::vector<char> scratch;
+	const char *header = world->m_file.range(0, HEADER_BYTES, scratch);
+	uint32_t clusters = 0;
+	uint64_t material_offset = 0;
+	if (!header || std::memcmp(header, "OOC2", 4) != 0) {
+		return nullptr;
+	}
+	std::memcpy(&clusters, header + 4, sizeof(clusters));
+	std::memcpy(&material_offset, header + 8, sizeof(material_offset));
+
+	uint32_t material_count = 0;
+	const char *count = world->m_file.range(material_offset, sizeof(material_count), scratch);
+	if (!count) {
+		return nullptr;
+	}
+	std::memcpy(&material_count, count, sizeof(material_count));
+	const char *records = world->m_file.range(material_offset + sizeof(material_count),
+		size_t(material_count) * sizeof(MaterialRecord), scratch);
+	if (!records || (!materials.empty() && materials.size() != material_count)) {
+		return nullptr;
+	}
+	const bool decode_all = materials.empty();
+	for (uint32_t i = 0; i < material_count; ++i) {
+		MaterialRecord rec;
+		std::memcpy(&rec, records + i * sizeof(MaterialRecord), sizeof(rec));
+		world->m_self_contained = world->m_self_contained && rec.type != IN_MEMORY;
+		if (decode_all) {
+			materials.push_back(decode(rec, lights));
+			if (!materials.back()) {
+				return nullptr;
+			}
+		}
+	}
+
+	const char *table = world->m_file.range(HEADER_BYTES, size_t(clusters) * sizeof(ClusterEntry), scratch);
+	if (!table) {
+		return nullptr;
+	}
+	world->m_entries.resize(clusters);
+	std::memcpy(world->m_entries.data(), table, world->m_entries.size() * sizeof(ClusterEntry));
+	for (const ClusterEntry &e : world->m_entries) {
+		const uint64_t bytes = uint64_t(e.node_count) * sizeof(BVH::Node) + uint64_t(e.prim_count) * sizeof(PrimRecord);
+		if (e.offset > world->m_file.size() || bytes > world->m_file.size() - e.offset) {
+			return nullptr;
+		}
+	}
+
+	world->m_materials = std::move(materials);
+	world->m_budget = budget;
+	world->m_slots.reset(new Slot[clusters]);
+	std::vector<std::unique_ptr<Hitable>> proxies;
+	for (uint32_t c = 0; c < clusters; ++c) {
+		proxies.emplace_back(new Proxy(world.get(), c));
+	}
+	world->m_top.reset(new BVH(std::move(proxies)));
+	return world;
+}
+
+size_t OutOfCoreWorld::decoded_bytes() const
+{
+	size_t total = 0;
+	for (const ClusterEntry &e : m_entries) {
+		total += cluster_bytes(e.node_count, e.prim_count, std::max(sizeof(Sphere), sizeof(Quad)));
+	}
+	return total;
+}
+
+std::shared_ptr<const OutOfCoreWorld::Cluster> OutOfCoreWorld::load(uint32_t index) const
+{
+	trace::Scope trace_load("page in cluster", "geometry", "cluster", index);
+	const ClusterEntry &e = m_entries[index];
+	auto cluster = std::make_shared<Cluster>();
+	cluster->bvh.reset(new BVH());
+	std::vector<char> scratch;
+	const size_t node_bytes = size_t(e.node_count) * sizeof(BVH::Node);
+	const char *data = m_file.range(e.offset, node_bytes + size_t(e.prim_count) * sizeof(PrimRecord), scratch);
+	if (!data) {
+		return cluster; // unreadable, nothing to hit
+	}
+
+	BVH &bvh = *cluster->bvh;
+	bvh.m_nodes.resize(e.node_count);
+	std::memcpy(bvh.m_nodes.data(), data, node_bytes);
+	bvh.m_hitables.reserve(e.prim_count);
+	size_t prim_bytes = 0;
+	for (uint32_t i = 0; i < e.prim_count; ++i) {
+		PrimRecord rec;
+		std::memcpy(&rec, data + node_bytes + i * sizeof(PrimRecord), sizeof(rec));
+		const std::shared_ptr<Material> material = rec.material < m_materials.size() ? m_materials[rec.material] : nullptr;
+		const float *d = rec.data;
+		if (rec.type == SPHERE) {
+			bvh.m_hitables.emplace_back(new Sphere(glm::vec3(d[0], d[1], d[2]), d[3], material));
+			prim_bytes += sizeof(Sphere);
+		} else {
+			bvh.m_hitables.emplace_back(new Quad(glm::vec3(d[0], d[1], d[2]), glm::vec3(d[3], d[4], d[5]), glm::vec3(d[6], d[7], d[8]), material));
+			prim_bytes += sizeof(Quad);
+		}
+		bvh.m_hitables.back()->set_id(rec.id);
+	}
+	cluster->bytes = cluster_bytes(e.node_count, 0, 0) + prim_bytes + e.prim_count * sizeof(std::unique_ptr<Hitable>);
+	return cluster;
+}
+
+std::shared_ptr<const OutOfCoreWorld::Cluster> OutOfCoreWorld::resident(uint32_t index) const
+{
+	Slot &slot = m_slots[index];
+	const uint64_t now = m_page_ins.load(std::memory_order_relaxed);
+	if (slot.last_use.load(std::memory_order_relaxed) != now) {
+		slot.last_use.store(now, std::memory_order_relaxed);
+	}
+	std::lock_guard<std::mutex> lock(slot.mutex);
+	return slot.cluster;
+}
+
+std::shared_ptr<const OutOfCoreWorld::Cluster> OutOfCoreWorld::acquire(uint32_t index) const
+{
+	Slot &slot = m_slots[index];
+	std::shared_ptr<const Cluster> cluster = resident(index);
+	if (cluster) {
+		return cluster;
+	}
+	{
+		std::lock_guard<std::mutex> lock(slot.mutex);
+		if (slot.cluster) {
+			return slot.cluster; // paged in while this thread waited
+		}
+		cluster = load(index);
+		slot.cluster = cluster;
+	}
+	const uint64_t now = ++m_page_ins;
+	slot.last_use.store(now, std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	slot.bytes = cluster->bytes;
+	slot.loaded = now;
+	m_resident_bytes += cluster->bytes;
+	m_lru.push({ now, now, index });
+	evict_over_budget(index);
+	return cluster;
+}
+
+// called with m_mutex held. Clusters still in use by a ray live on through its shared_ptr.
+// Uses only move last_use forward, so heap entries are refreshed when they surface: a cluster
+// whose entry is older than its last use goes back in, the oldest one that isn't is the victim.
+void OutOfCoreWorld::evict_over_budget(uint32_t keep) const
+{
+	bool kept = false;
+	LruEntry keep_entry = {};
+	while (m_resident_bytes > m_budget && !m_lru.empty()) {
+		LruEntry e = m_lru.top();
+		m_lru.pop();
+		Slot &slot = m_slots[e.cluster];
+		if (slot.bytes == 0 || slot.loaded != e.loaded) {
+			continue; // evicted since
+		}
+		if (e.cluster == keep) {
+			kept = true;
+			keep_entry = e;
+			continue;
+		}
+		const uint64_t used = slot.last_use.load(std::memory_order_relaxed);
+		if (used != e.used) {
+			m_lru.push({ used, e.loaded, e.cluster });
+			continue;
+		}
+		{
+			std::lock_guard<std::mutex> lock(slot.mutex);
+			slot.cluster.reset();
+		}
+		m_resident_bytes -= slot.bytes;
+		slot.bytes = 0;
+	}
+	// if it came up, the budget is smaller than this cluster alone
+	if (kept) {
+		m_lru.push(keep_entry);
+	}
+}
+
+template<class F>
+void OutOfCoreWorld::for_each_cluster(const Ray &r, float tmin, float tmax, F &&f) const
+{
+	const BVH &top = *m_top;
+	if (top.m_nodes.empty()) {
+		return;
+	}
+	const SlabRay ray(r.origin(), r.direction());
+	uint32_t stack[BVH::MAX_DEPTH];
+	int size = 0;
+	uint32_t index = 0;
+	for (;;) {
+		const BVH::Node &node = top.m_nodes[index];
+		if (node.bounds.hit(ray, tmin, tmax)) {
+			if (node.count == 0) {
+				stack[size++] = node.offset + 1;
+				index = node.offset;
+				continue;
+			}
+			for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+				const uint32_t cluster = static_cast<const Proxy &>(*top.m_hitables[i]).index();
+				float t_enter;
+				if (m_entries[cluster].bounds.hit(ray, tmin, tmax, t_enter)) {
+					f(cluster, t_enter);
+				}
+			}
+		}
+		if (size == 0) {
+			break;
+		}
+		index = stack[--size];
+	}
+}
+
+// groups the deferred rays by cluster and pages the clusters in one at a time, longest queue
+// first, calling f(cluster, rays, count) for the rays keep() still wants traced, if any. Every
+// ray is deferred at most once per cluster, so f may write a ray's results without
+// synchronization.
+template<class Keep, class F>
+void OutOfCoreWorld::for_each_deferred(std::vector<Deferred> &deferred, Keep &&keep, F &&f) const
+{
+	std::sort(deferred.begin(), deferred.end(), [](const Deferred &a, const Deferred &b) {
+		return a.cluster != b.cluster ? a.cluster < b.cluster : a.ray < b.ray;
+	});
+	std::vector<std::pair<size_t, size_t>> runs; // begin, end
+	for (size_t begin = 0; begin < deferred.size(); ) {
+		size_t end = begin;
+		while (end < deferred.size() && deferred[end].cluster == deferred[begin].cluster) {
+			end++;
+		}
+		runs.emplace_back(begin, end);
+		begin = end;
+	}
+	std::stable_sort(runs.begin(), runs.end(), [](const std::pair<size_t, size_t> &a, const std::pair<size_t, size_t> &b) {
+		return a.second - a.first > b.second - b.first;
+	});
+	for (const auto &run : runs) {
+		const uint32_t c = deferred[run.first].cluster;
+		// rays that found a closer hit or a blocker in the clusters before don't need this one
+		Deferred *first = deferred.data() + run.first;
+		const size_t n = size_t(std::partition(first, deferred.data() + run.second, keep) - first);
+		if (n == 0) {
+			continue;
+		}
+		trace::Scope trace_queue("batch queue", "geometry", "cluster", c, "rays", int64_t(n));
+		m_deferred += n;
+		const std::shared_ptr<const Cluster> cluster = acquire(c);
+		f(*cluster, first, n);
+	}
+}
+
+void OutOfCoreWorld::hit_batch(const Ray *rays, size_t count, float tmin, float tmax, HitRecord *recs, uint8_t *hits) const
+{
+	// a cluster box a ray enters, at t
+	struct Candidate
+	{
+		uint32_t cluster;
+		float t;
+	};
+	std::vector<float> closest(count, tmax);
+	std::vector<Deferred> deferred;
+
+	// resident clusters first, nearest first, the others are deferred
+	{
+		trace::Scope trace_resident("batch resident", "geometry", "rays", int64_t(count));
+        #pragma omp parallel
+		{
+			std::vector<Candidate> candidates;
+			std::vector<Deferred> mine;
+            #pragma omp for schedule(dynamic, 256) nowait
+			for (int64_t i = 0; i < int64_t(count); ++i) {
+				hits[i] = 0;
+				candidates.clear();
+				for_each_cluster(rays[i], tmin, tmax, [&](uint32_t cluster, float t) { candidates.push_back({ cluster, t }); });
+				std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) { return a.t < b.t; });
+				for (const Candidate &c : candidates) {
+					if (c.t > closest[size_t(i)]) {
+						break;
+					}
+					if (auto cluster = resident(c.cluster)) {
+						HitRecord rec;
+						if (cluster->bvh->hit(rays[i], tmin, closest[size_t(i)], rec)) {
+							closest[size_t(i)] = rec.t;
+							recs[i] = rec;
+							hits[i] = 1;
+						}
+					} else {
+						mine.push_back({ c.cluster, uint32_t(i), c.t });
+					}
+				}
+			}
+            #pragma omp critical
+			deferred.insert(deferred.end(), mine.begin(), mine.end());
+		}
+	}
+
+	// then one page-in per cluster for all rays waiting for it
+	auto keep = [&](const Deferred &d) { return d.t <= closest[d.ray]; };
+	for_each_deferred(deferred, keep, [&](const Cluster &cluster, const Deferred *waiting, size_t n) {
+        #pragma omp parallel for schedule(dynamic, 256)
+		for (int64_t k = 0; k < int64_t(n); ++k) {
+			const Deferred &d = waiting[k];
+			HitRecord rec;
+			if (d.t <= closest[d.ray] && cluster.bvh->hit(rays[d.ray], tmin, closest[d.ray], rec)) {
+				closest[d.ray] = rec.t;
+				recs[d.ray] = rec;
+				hits[d.ray] = 1;
+			}
+		}
+	});
+}
+
+void OutOfCoreWorld::occluded_batch(const Ray *rays, const float *tmax, size_t count, float tmin, uint8_t *occluded) const
+{
+	std::vector<Deferred> deferred;
+
+	// any resident blocker settles a ray, the clusters that would need a page-in are deferred
+	{
+		trace::Scope trace_resident("batch resident occluded", "geometry", "rays", int64_t(count));
+        #pragma omp parallel
+		{
+			std::vector<Deferred> mine;
+            #pragma omp for schedule(dynamic, 256) nowait
+			for (int64_t i = 0; i < int64_t(count); ++i) {
+				const size_t first = mine.size();
+				occluded[i] = 0;
+				for_each_cluster(rays[i], tmin, tmax[i], [&](uint32_t c, float t) {
+					if (occluded[i]) {
+						return;
+					}
+					if (auto cluster = resident(c)) {
+						occluded[i] = cluster->bvh->occluded(rays[i], tmin, tmax[i]);
+					} else {
+						mine.push_back({ c, uint32_t(i), t });
+					}
+				});
+				if (occluded[i]) {
+					mine.resize(first);
+				}
+			}
+            #pragma omp critical
+			deferred.insert(deferred.end(), mine.begin(), mine.end());
+		}
+	}
+
+	auto keep = [&](const Deferred &d) { return !occluded[d.ray]; };
+	for_each_deferred(deferred, keep, [&](const Cluster &cluster, const Deferred *waiting, size_t n) {
+        #pragma omp parallel for schedule(dynamic, 256)
+		for (int64_t k = 0; k < int64_t(n); ++k) {
+			const Deferred &d = waiting[k];
+			if (!occluded[d.ray] && cluster.bvh->occluded(rays[d.ray], tmin, tmax[d.ray])) {
+				occluded[d.ray] = 1;
+			}
+		}
+	});
+}
+
+// writes the primitives to path and opens it, nullptr if either fails
+inline std::unique_ptr<OutOfCoreWorld> make_out_of_core(std::vector<std::unique_ptr<Hitable>> hitables, const std::string &path,
+	const LightList &lights, const OutOfCoreOptions &options)
+{
+	std::vector<std::shared_ptr<Material>> materials;
+	if (!OutOfCoreWorld::write(path, std::move(hitables), options, lights, materials)) {
+		return nullptr;
+	}
+	// the scene's own materials, which keeps their ids and textures
+	return OutOfCoreWorld::open(path, lights, options.budget, std::move(materials));
+}
+
+#endif //OUT_OF_CORE_H
@@ -0,0 +1,321 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+// Long running preview: the scene stays loaded while a client moves the camera over a line based
+// text protocol on stdin or a socket. Every change restarts a progressive render at one sample
+// per pixel per pass; a pass in flight notices the change at its next tile and is thrown away.
+//
+// commands, one per line, each answered with "ok ..." or "error ...":
+//   look px py pz tx ty tz   camera at p looking at t
+//   move dx dy dz            moves the camera and its target
+//   orbit degrees            turns the camera around its target about the up axis
+//   fov degrees
+//   spp n                    stop refining at n samples per pixel
+//   save path                writes the current image (.pfm or .png)
+//   status
+//   quit
+// finished passes are announced as "pass <n> <ms> ms".
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <glm/glm.hpp>
+#include "scene.h"
+#include "film.h"
+#include "renderer.h"
+#include "image_io.h"
+#include "distributed.h"
+
+class PreviewServer
+{
+public:
+	PreviewServer(Scene &scene, int width, int height, const Filter &filter, int max_spp)
+		: m_scene(scene), m_width(width), m_height(height), m_film(width, height, filter),
+		m_grid({ 0, 0, width, height }), m_camera(scene.camera), m_max_spp(max_spp),
+		m_image(size_t(width) * height, glm::vec3(0.0f))
+	{
+		m_thread = std::thread(&PreviewServer::render_loop, this);
+	}
+
+	~PreviewServer()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+			m_generation++;
+		}
+		m_cv.notify_all();
+		m_thread.join();
+	}
+
+	// where "pass ..." notifications go; called from the render thread. Waits for a call that is
+	// running, so whatever the old listener refers to can go away once this returns.
+	void set_listener(std::function<void(const std::string &)> listener)
+	{
+		std::lock_guard<std::mutex> lock(m_notify_mutex);
+		m_listener = std::move(listener);
+	}
+
+	// runs one protocol line, returns false once the client asked to quit
+	bool command(const std::string &line, std::string &reply);
+
+private:
+	// caller holds m_mutex; bumps the generation so the render thread drops what it is doing
+	void restart()
+	{
+		m_generation++;
+		m_cv.notify_all();
+	}
+
+	void render_loop();
+
+	// camera at p looking at t, unless that leaves the view direction undefined; caller holds m_mutex
+	bool set_view(const glm::vec3 &p, const glm::vec3 &t, std::string &reply)
+	{
+		const glm::vec3 w = p - t;
+		const float len = glm::length(w);
+		if (!(len > 0.0f) || !(glm::length(glm::cross(glm::normalize(m_camera.up()), w / len)) > 1e-6f)) {
+			reply = "error the camera can't look at its own position or along the up axis";
+			return false;
+		}
+		m_camera.set_view(p, t);
+		restart();
+		return true;
+	}
+
+private:
+	Scene &m_scene; // its camera belongs to the render thread
+	int m_width, m_height;
+	Film m_film;
+	TileGrid m_grid;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	Camera m_camera; // the camera the next pass should use
+	int m_max_spp;
+	bool m_quit = false;
+	std::atomic<uint32_t> m_generation{ 0 };
+	// held for the listener calls, apart from m_mutex so a slow client doesn't block command()
+	std::mutex m_notify_mutex;
+	std::function<void(const std::string &)> m_listener;
+	std::vector<glm::vec3> m_image; // last finished pass
+	int m_passes = 0;
+	double m_last_ms = 0.0;
+
+	std::thread m_thread;
+};
+
+void PreviewServer::render_loop()
+{
+	const int tiles = m_grid.count();
+	uint32_t rendered = ~0u;
+	int pass = 0;
+	std::vector<glm::vec3> image;
+	for (;;) {
+		uint32_t generation;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [&] { return m_quit || m_generation != rendered || pass < m_max_spp; });
+			if (m_quit) {
+				return;
+			}
+			generation = m_generation;
+			if (generation != rendered) {
+				m_scene.camera = m_camera;
+				m_film.clear();
+				rendered = generation;
+				pass = 0;
+			}
+		}
+
+		auto t0 = std::chrono::steady_clock::now();
+        #pragma omp parallel for schedule(dynamic, 1)
+		for (int tile = 0; tile < tiles; tile++) {
+			// a relaxed load per tile is all the cancellation costs
+			if (m_generation.load(std::memory_order_relaxed) != generation) {
+				continue;
+			}
+			m_film.merge_tile(pass * tiles + tile,
+				render_tile<false>(m_scene, VirtualWorld(m_scene), 1, m_grid, tile, m_film, nullptr, uint32_t(pass)));
+		}
+		if (m_generation.load() != generation) {
+			continue;
+		}
+		pass++;
+		m_film.resolve(image);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_image.swap(image);
+			m_passes = pass;
+			m_last_ms = ms;
+		}
+		// outside of m_mutex: a client that is slow to read only holds up this thread's next pass,
+		// not command() and everything waiting on it
+		std::lock_guard<std::mutex> lock(m_notify_mutex);
+		if (m_listener) {
+			std::ostringstream msg;
+			msg << "pass " << pass << " " << ms << " ms";
+			m_listener(msg.str());
+		}
+	}
+}
+
+bool PreviewServer::command(const std::string &line, std::string &reply)
+{
+	std::istringstream in(line);
+	std::string cmd;
+	in >> cmd;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (cmd == "look") {
+		glm::vec3 p, t;
+		if (!(in >> p.x >> p.y >> p.z >> t.x >> t.y >> t.z)) {
+			reply = "error look expects px py pz tx ty tz";
+			return true;
+		}
+		if (!set_view(p, t, reply)) {
+			return true;
+		}
+	} else if (cmd == "move") {
+		glm::vec3 d;
+		if (!(in >> d.x >> d.y >> d.z)) {
+			reply = "error move expects dx dy dz";
+			return true;
+		}
+		if (!set_view(m_camera.position() + d, m_camera.lookat() + d, reply)) {
+			return true;
+		}
+	} else if (cmd == "orbit") {
+		float degrees;
+		if (!(in >> degrees)) {
+			reply = "error orbit expects degrees";
+			return true;
+		}
+		// rodrigues rotation of the target -> camera vector about up
+		float a = degrees * detail::pi() / 180.0f;
+		glm::vec3 k = glm::normalize(m_camera.up());
+		glm::vec3 v = m_camera.position() - m_camera.lookat();
+		v = v * std::cos(a) + glm::cross(k, v) * std::sin(a) + k * glm::dot(k, v) * (1.0f - std::cos(a));
+		if (!set_view(m_camera.lookat() + v, m_camera.lookat(), reply)) {
+			return true;
+		}
+	} else if (cmd == "fov") {
+		float degrees;
+		if (!(in >> degrees) || degrees <= 0.0f || degrees >= 180.0f) {
+			reply = "error fov expects degrees in (0, 180)";
+			return true;
+		}
+		m_camera.set_fov(degrees);
+		restart();
+	} else if (cmd == "spp") {
+		int spp;
+		if (!(in >> spp) || spp < 1) {
+			reply = "error spp expects a positive count";
+			return true;
+		}
+		m_max_spp = spp;
+		m_cv.notify_all();
+	} else if (cmd == "save") {
+		std::string path;
+		if (!(in >> path)) {
+			reply = "error save expects a path";
+			return true;
+		}
+		write_image(path, m_width, m_height, m_image);
+	} else if (cmd == "status") {
+		std::ostringstream msg;
+		msg << "ok " << m_passes << " spp, last pass " << m_last_ms << " ms";
+		reply = msg.str();
+		return true;
+	} else if (cmd == "quit") {
+		reply = "ok";
+		return false;
+	} else if (!cmd.empty()) {
+		reply = "error unknown command " + cmd;
+		return true;
+	}
+	reply = cmd.empty() ? "" : "ok";
+	return true;
+}
+
+// serves the protocol on stdin/stdout when address is "-", otherwise on a "host:port" or
+// "unix:/path" socket, one client at a time
+int run_preview(PreviewServer &server, const std::string &address)
+{
+	std::mutex out_mutex;
+	if (address == "-") {
+		server.set_listener([&](const std::string &msg) {
+			std::lock_guard<std::mutex> lock(out_mutex);
+			std::cout << msg << std::endl;
+		});
+		std::string line, reply;
+		bool running = true;
+		while (running && std::getline(std::cin, line)) {
+			running = server.command(line, reply);
+			std::lock_guard<std::mutex> lock(out_mutex);
+			if (!reply.empty()) {
+				std::cout << reply << std::endl;
+			}
+		}
+		server.set_listener(nullptr);
+		return 0;
+	}
+
+#ifndef _WIN32
+	int listen_fd = net::open_socket(address, true);
+	if (listen_fd < 0) {
+		std::cerr << "could not listen on " << address << std::endl;
+		return 1;
+	}
+	bool running = true;
+	while (running) {
+		int fd = accept(listen_fd, nullptr, nullptr);
+		if (fd < 0) {
+			continue;
+		}
+		net::set_nodelay(fd);
+		auto send_line = [&](const std::string &msg) {
+			std::lock_guard<std::mutex> lock(out_mutex);
+			std::string text = msg + "\n";
+			net::send_all(fd, text.data(), text.size());
+		};
+		server.set_listener(send_line);
+
+		std::string pending, reply;
+		char buffer[4096];
+		ssize_t n;
+		while (running && (n = ::recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+			pending.append(buffer, size_t(n));
+			size_t end;
+			while (running && (end = pending.find('\n')) != std::string::npos) {
+				running = server.command(pending.substr(0, end), reply);
+				pending.erase(0, end + 1);
+				if (!reply.empty()) {
+					send_line(reply);
+				}
+			}
+		}
+		server.set_listener(nullptr);
+		::close(fd);
+	}
+	::close(listen_fd);
+	if (address.compare(0, 5, "unix:") == 0) {
+		::unlink(address.c_str() + 5);
+	}
+	return 0;
+#else
+	std::cerr << "the preview server only listens on stdin on this platform" << std::endl;
+	return 1;
+#endif
+}
+
+#endif //PREVIEW_H
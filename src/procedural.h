@@ -0,0 +1,132 @@
+#ifndef PROCEDURAL_H
+#define PROCEDURAL_H
+
+#include <cmath>
+#include <glm/glm.hpp>
+#include "hitable.h"
+#include "texture.h"
+#include "noise.h"
+
+namespace detail
+{
+
+// one shared table set, fixed seed so that renders are repeatable
+inline const Perlin &perlin()
+{
+	static const Perlin p(0);
+	return p;
+}
+
+// batch kernels work on SoA positions in chunks of this many points
+static const size_t TEXTURE_BATCH = 64;
+
+}
+
+// 3d checkerboard in world space
+class CheckerTexture : public Texture
+{
+public:
+	CheckerTexture(const glm::vec3 &even, const glm::vec3 &odd, float scale)
+		: m_even(even), m_odd(odd), m_scale(scale) {}
+
+	virtual glm::vec3 value(const HitRecord &rec) const override
+	{
+		glm::vec3 q = glm::floor(rec.p * m_scale);
+		int parity = (int(q.x) + int(q.y) + int(q.z)) & 1;
+		return parity ? m_odd : m_even;
+	}
+
+	virtual void value_batch(const HitRecord *recs, size_t n, glm::vec3 *out) const override
+	{
+		for (size_t i = 0; i < n; ++i) {
+			glm::vec3 q = glm::floor(recs[i].p * m_scale);
+			float t = float((int(q.x) + int(q.y) + int(q.z)) & 1);
+			out[i] = m_even + t * (m_odd - m_even);
+		}
+	}
+
+private:
+	glm::vec3 m_even, m_odd;
+	float m_scale;
+};
+
+// shared batching for the noise based textures: positions go to SoA, the kernel fills a scalar per point
+template<typename Derived>
+class NoiseTextureBase : public Texture
+{
+public:
+	virtual void value_batch(const HitRecord *recs, size_t n, glm::vec3 *out) const override
+	{
+		float x[detail::TEXTURE_BATCH], y[detail::TEXTURE_BATCH], z[detail::TEXTURE_BATCH], f[detail::TEXTURE_BATCH];
+		const Derived &self = static_cast<const Derived &>(*this);
+		for (size_t begin = 0; begin < n; begin += detail::TEXTURE_BATCH) {
+			size_t count = std::min(detail::TEXTURE_BATCH, n - begin);
+			for (size_t i = 0; i < count; ++i) {
+				glm::vec3 p = recs[begin + i].p * self.m_scale;
+				x[i] = p.x;
+				y[i] = p.y;
+				z[i] = p.z;
+			}
+			self.kernel(x, y, z, f, count);
+			for (size_t i = 0; i < count; ++i) {
+				out[begin + i] = self.m_color * f[i];
+			}
+		}
+	}
+};
+
+class NoiseTexture : public NoiseTextureBase<NoiseTexture>
+{
+public:
+	NoiseTexture(const glm::vec3 &color, float scale)
+		: m_color(color), m_scale(scale) {}
+
+	virtual glm::vec3 value(const HitRecord &rec) const override
+	{
+		return m_color * (0.5f * (1.0f + detail::perlin().noise(rec.p * m_scale)));
+	}
+
+private:
+	friend class NoiseTextureBase<NoiseTexture>;
+
+	void kernel(const float *x, const float *y, const float *z, float *f, size_t n) const
+	{
+		detail::perlin().noise(x, y, z, f, n);
+		for (size_t i = 0; i < n; ++i) {
+			f[i] = 0.5f * (1.0f + f[i]);
+		}
+	}
+
+	glm::vec3 m_color;
+	float m_scale;
+};
+
+// veins along z, perturbed by turbulence
+class MarbleTexture : public NoiseTextureBase<MarbleTexture>
+{
+public:
+	MarbleTexture(const glm::vec3 &color, float scale)
+		: m_color(color), m_scale(scale) {}
+
+	virtual glm::vec3 value(const HitRecord &rec) const override
+	{
+		glm::vec3 p = rec.p * m_scale;
+		return m_color * (0.5f * (1.0f + std::sin(p.z + 10.0f * detail::perlin().turbulence(p))));
+	}
+
+private:
+	friend class NoiseTextureBase<MarbleTexture>;
+
+	void kernel(const float *x, const float *y, const float *z, float *f, size_t n) const
+	{
+		detail::perlin().turbulence(x, y, z, f, n);
+		for (size_t i = 0; i < n; ++i) {
+			f[i] = 0.5f * (1.0f + std::sin(z[i] + 10.0f * f[i]));
+		}
+	}
+
+	glm::vec3 m_color;
+	float m_scale;
+};
+
+#endif //PROCEDURAL_H
@@ -0,0 +1,386 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// Hardware counter profile of a render. Every render thread opens its own perf_event group
+// (cycles, instructions, L1d misses, LLC misses, branch misses, user space only) and charges the
+// counts between phase changes to the phase that was running, so nested phases count only their
+// own work. Phases change at the World calls (hit, occluded, Material::scatter and their batched
+// versions) through ProfiledWorld and around camera rays and film writes in render_tile; trace is
+// the integrator around them, idle is everything outside of render_tile (scheduling, waiting at
+// barriers).
+//
+// Counters are read with rdpmc where the kernel allows it, otherwise with read(), which costs
+// a system call per phase change and shows up in the phase that is left. Where perf_event_open
+// isn't available (not linux, no pmu, perf_event_paranoid > 2) only the time per phase is kept.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ray.h"
+#include "hitable.h"
+#include "material.h"
+#include "random_generator.h"
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace prof
+{
+
+enum Phase { IDLE, TRACE, CAMERA, HIT, SCATTER, OUTPUT, PHASE_COUNT };
+enum Event { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, EVENT_COUNT };
+
+inline const char *phase_name(int p)
+{
+	static const char *names[PHASE_COUNT] = { "idle", "trace", "camera", "hit", "scatter", "output" };
+	return names[p];
+}
+
+// the counters of one thread. Only its own thread touches it until report(), which runs after
+// the parallel regions are done.
+class ThreadCounters
+{
+public:
+	ThreadCounters()
+	{
+		std::fill(m_fds, m_fds + EVENT_COUNT, -1);
+		std::fill(m_pages, m_pages + EVENT_COUNT, nullptr);
+		std::memset(m_counts, 0, sizeof(m_counts));
+		std::memset(m_ns, 0, sizeof(m_ns));
+		open();
+		m_last_time = std::chrono::steady_clock::now();
+		read(m_last);
+	}
+
+	~ThreadCounters()
+	{
+#ifdef __linux__
+		for (int e = 0; e < EVENT_COUNT; ++e) {
+			if (m_pages[e]) {
+				munmap(m_pages[e], page_size());
+			}
+			if (m_fds[e] >= 0) {
+				close(m_fds[e]);
+			}
+		}
+#endif
+	}
+
+	bool has_counters() const { return m_fds[0] >= 0; }
+	int open_error() const { return m_error; }
+
+	// charges what ran since the last switch to the current phase, returns the phase that ends
+	Phase switch_to(Phase next)
+	{
+		uint64_t now[EVENT_COUNT];
+		read(now);
+		auto t = std::chrono::steady_clock::now();
+		for (int e = 0; e < EVENT_COUNT; ++e) {
+			m_counts[m_phase][e] += now[e] - m_last[e];
+			m_last[e] = now[e];
+		}
+		m_ns[m_phase] += uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(t - m_last_time).count());
+		m_last_time = t;
+		Phase previous = m_phase;
+		m_phase = next;
+		return previous;
+	}
+
+	uint64_t count(int phase, int event) const { return m_counts[phase][event]; }
+	uint64_t ns(int phase) const { return m_ns[phase]; }
+
+private:
+#ifdef __linux__
+	static size_t page_size() { return size_t(sysconf(_SC_PAGESIZE)); }
+#endif
+
+	void open()
+	{
+#ifdef __linux__
+		static const uint32_t types[EVENT_COUNT] = {
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE
+		};
+		static const uint64_t configs[EVENT_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES,
+		};
+		for (int e = 0; e < EVENT_COUNT; ++e) {
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[e];
+			attr.config = configs[e];
+			attr.disabled = e == 0; // the group starts with its leader
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			int fd = int(syscall(SYS_perf_event_open, &attr, 0, -1, e == 0 ? -1 : m_fds[0], 0));
+			if (fd < 0) {
+				// the group counts all or nothing
+				m_error = errno;
+				for (int k = 0; k < e; ++k) {
+					close(m_fds[k]);
+					m_fds[k] = -1;
+				}
+				return;
+			}
+			m_fds[e] = fd;
+			void *page = mmap(nullptr, page_size(), PROT_READ, MAP_SHARED, fd, 0);
+			m_pages[e] = page == MAP_FAILED ? nullptr : static_cast<perf_event_mmap_page *>(page);
+		}
+		ioctl(m_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(m_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	}
+
+	void read(uint64_t *out)
+	{
+		for (int e = 0; e < EVENT_COUNT; ++e) {
+			out[e] = has_counters() ? read_event(e) : 0;
+		}
+	}
+
+	uint64_t read_event(int e)
+	{
+#ifdef __linux__
+#if defined(__x86_64__) || defined(__i386__)
+		// the self monitoring protocol of perf_event_mmap_page: retry while the kernel updates it
+		if (perf_event_mmap_page *pc = m_pages[e]) {
+			for (;;) {
+				uint32_t seq = pc->lock;
+				__atomic_signal_fence(__ATOMIC_SEQ_CST);
+				uint32_t index = pc->index;
+				int64_t count = pc->offset;
+				if (!pc->cap_user_rdpmc || index == 0) {
+					break;
+				}
+				uint32_t lo, hi;
+				__asm__ volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(index - 1));
+				int64_t pmc = int64_t((uint64_t(hi) << 32) | lo);
+				const int shift = 64 - pc->pmc_width;
+				count += (pmc << shift) >> shift;
+				__atomic_signal_fence(__ATOMIC_SEQ_CST);
+				if (pc->lock == seq) {
+					return uint64_t(count);
+				}
+			}
+		}
+#endif
+		uint64_t value = 0;
+		if (::read(m_fds[e], &value, sizeof(value)) != sizeof(value)) {
+			return 0;
+		}
+		return value;
+#else
+		return 0;
+#endif
+	}
+
+private:
+	int m_fds[EVENT_COUNT];
+#ifdef __linux__
+	perf_event_mmap_page *m_pages[EVENT_COUNT];
+#else
+	void *m_pages[EVENT_COUNT];
+#endif
+	int m_error = 0;
+	Phase m_phase = IDLE;
+	uint64_t m_last[EVENT_COUNT];
+	std::chrono::steady_clock::time_point m_last_time;
+	uint64_t m_counts[PHASE_COUNT][EVENT_COUNT];
+	uint64_t m_ns[PHASE_COUNT];
+};
+
+// all threads that ever entered a phase
+class Profiler
+{
+public:
+	static Profiler &instance()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	ThreadCounters &counters()
+	{
+		thread_local ThreadCounters *mine = nullptr;
+		if (!mine) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_threads.emplace_back(new ThreadCounters());
+			mine = m_threads.back().get();
+		}
+		return *mine;
+	}
+
+	// per phase totals over all threads; call once the render threads are done
+	void report(std::ostream &out) const;
+
+private:
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<ThreadCounters>> m_threads;
+};
+
+void Profiler::report(std::ostream &out) const
+{
+	if (m_threads.empty()) {
+		return;
+	}
+	const bool counted = m_threads[0]->has_counters();
+	if (!counted) {
+		const int error = m_threads[0]->open_error();
+		out << "hardware counters unavailable (" << std::strerror(error) << ")";
+		if (error == EACCES || error == EPERM) {
+			out << ", see /proc/sys/kernel/perf_event_paranoid";
+		} else if (error == ENOENT || error == EOPNOTSUPP) {
+			out << ", the cpu (or virtual machine) exposes no pmu";
+		}
+		out << "; showing time only" << std::endl;
+	}
+	uint64_t counts[PHASE_COUNT][EVENT_COUNT] = {};
+	uint64_t ns[PHASE_COUNT] = {};
+	uint64_t total_ns = 0;
+	for (const auto &t : m_threads) {
+		for (int p = 0; p < PHASE_COUNT; ++p) {
+			for (int e = 0; e < EVENT_COUNT; ++e) {
+				counts[p][e] += t->count(p, e);
+			}
+			ns[p] += t->ns(p);
+			total_ns += t->ns(p);
+		}
+	}
+
+	// per kilo instruction rates separate memory bound (l1, llc) from branch bound phases
+	auto per_ki = [](uint64_t n, uint64_t instructions) {
+		return instructions ? 1000.0 * double(n) / double(instructions) : 0.0;
+	};
+	out << std::fixed << std::setprecision(2);
+	out << m_threads.size() << " threads" << std::endl;
+	out << std::left << std::setw(9) << "phase" << std::right << std::setw(8) << "time %" << std::setw(10) << "ms";
+	if (counted) {
+		out << std::setw(12) << "Mcycles" << std::setw(12) << "Minstr" << std::setw(7) << "ipc"
+			<< std::setw(11) << "l1d mpki" << std::setw(11) << "llc mpki" << std::setw(12) << "branch mpki";
+	}
+	out << std::endl;
+	for (int p = 0; p < PHASE_COUNT; ++p) {
+		const uint64_t *c = counts[p];
+		out << std::left << std::setw(9) << phase_name(p) << std::right
+			<< std::setw(8) << (total_ns ? 100.0 * double(ns[p]) / double(total_ns) : 0.0)
+			<< std::setw(10) << double(ns[p]) * 1e-6;
+		if (counted) {
+			out << std::setw(12) << double(c[CYCLES]) * 1e-6 << std::setw(12) << double(c[INSTRUCTIONS]) * 1e-6
+				<< std::setw(7) << (c[CYCLES] ? double(c[INSTRUCTIONS]) / double(c[CYCLES]) : 0.0)
+				<< std::setw(11) << per_ki(c[L1D_MISSES], c[INSTRUCTIONS])
+				<< std::setw(11) << per_ki(c[LLC_MISSES], c[INSTRUCTIONS])
+				<< std::setw(12) << per_ki(c[BRANCH_MISSES], c[INSTRUCTIONS]);
+		}
+		out << std::endl;
+	}
+	out << std::defaultfloat;
+}
+
+// switches the calling thread to a phase for the lifetime of the scope. Scope<false> is empty so
+// the unprofiled render paths carry nothing.
+template<bool Enabled>
+struct Scope
+{
+	explicit Scope(Phase) {}
+};
+
+template<>
+struct Scope<true>
+{
+	ThreadCounters &counters;
+	Phase previous;
+
+	explicit Scope(Phase phase) : counters(Profiler::instance().counters()), previous(counters.switch_to(phase)) {}
+	~Scope() { counters.switch_to(previous); }
+	Scope(const Scope &) = delete;
+	Scope &operator=(const Scope &) = delete;
+};
+
+// a material seen through the profiler: scatter runs in the scatter phase, the rest passes through
+template<class Mat>
+struct ProfiledMaterial
+{
+	const Mat &mat;
+
+	bool scatter(const Ray &ray_in, const HitRecord &rec, RandomGenerator<float> &rand,
+		glm::vec3 &attenuation, Ray &scattered) const
+	{
+		Scope<true> scope(SCATTER);
+		return mat.scatter(ray_in, rec, rand, attenuation, scattered);
+	}
+
+	glm::vec3 emitted(const Ray &ray_in, const HitRecord &rec) const { return mat.emitted(ray_in, rec); }
+	const Light *light() const { return mat.light(); }
+	bool is_specular() const { return mat.is_specular(); }
+	glm::vec3 eval(const Ray &ray_in, const HitRecord &rec, const glm::vec3 &wi) const { return mat.eval(ray_in, rec, wi); }
+	float pdf(const Ray &ray_in, const HitRecord &rec, const glm::vec3 &wi) const { return mat.pdf(ray_in, rec, wi); }
+	glm::vec3 albedo(const HitRecord &rec) const { return mat.albedo(rec); }
+	uint32_t id() const { return mat.id(); }
+};
+
+// wraps VirtualWorld or a StaticWorld so that hits and scatters are charged to their phases
+template<class World>
+struct ProfiledWorld
+{
+	const World &world;
+
+	bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
+	{
+		Scope<true> scope(HIT);
+		return world.hit(r, tmin, tmax, rec);
+	}
+
+	bool occluded(const Ray &r, float tmin, float tmax) const
+	{
+		Scope<true> scope(HIT);
+		return world.occluded(r, tmin, tmax);
+	}
+
+	void hit_batch(const Ray *rays, size_t count, float tmin, float tmax, HitRecord *recs, uint8_t *hits) const
+	{
+		Scope<true> scope(HIT);
+		world.hit_batch(rays, count, tmin, tmax, recs, hits);
+	}
+
+	void occluded_batch(const Ray *rays, const float *tmax, size_t count, float tmin, uint8_t *occluded) const
+	{
+		Scope<true> scope(HIT);
+		world.occluded_batch(rays, tmax, count, tmin, occluded);
+	}
+
+	template<class F>
+	auto visit_material(const HitRecord &rec, F &&f) const
+	{
+		return world.visit_material(rec, [&](const auto &mat) {
+			return f(ProfiledMaterial<std::decay_t<decltype(mat)>>{ mat });
+		});
+	}
+};
+
+template<class World>
+struct is_profiled : std::false_type {};
+
+template<class World>
+struct is_profiled<ProfiledWorld<World>> : std::true_type {};
+
+}
+
+#endif //PROFILER_H
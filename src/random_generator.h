@@ -1,24 +1,72 @@
 #ifndef RANDOM_GENERATOR_H
 #define RANDOM_GENERATOR_H
 
-#include <random>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
 #include <glm/glm.hpp>
 
+// mixes a few integers into a well distributed seed (splitmix64 finalizer)
+inline uint64_t hash_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	return x;
+}
+
+inline uint32_t hash_seed(uint32_t a, uint32_t b = 0, uint32_t c = 0)
+{
+	return uint32_t(hash_mix((uint64_t(a) << 32 | b) ^ (uint64_t(c) * 0x9E3779B97F4A7C15ull)));
+}
+
+// pcg32 (xsh-rr). Renders restart it for every (pixel, sample) with start(), which hashes the
+// coordinates into the generator state: every sample draws the same numbers no matter which
+// thread, tile, process or crop renders it, and a restart is a few multiplies.
 template<typename T>
 class RandomGenerator
 {
 private:
-	std::random_device m_rd;
-	std::mt19937 m_engine;
-	std::uniform_real_distribution<T> m_distribution;
+	uint64_t m_state;
+	T m_min, m_scale;
+
+	static const uint64_t MULTIPLIER = 6364136223846793005ull;
+	static const uint64_t INCREMENT = 1442695040888963407ull;
+
+	inline uint32_t next()
+	{
+		uint64_t old = m_state;
+		m_state = old * MULTIPLIER + INCREMENT;
+		uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+		uint32_t rot = uint32_t(old >> 59u);
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31u));
+	}
 
 public:
 	RandomGenerator(T min = T(0), T max = T(1)) :
-		m_engine(m_rd()),
-		m_distribution(min, max)
-	{}
+		m_state(0), m_min(min), m_scale(max - min)
+	{
+		seed(0);
+	}
 
-	inline T gen() { return m_distribution(m_engine); }
+	// restarts the sequence, for repeatable renders
+	inline void seed(uint32_t s)
+	{
+		m_state = hash_mix(uint64_t(s) + INCREMENT);
+		next();
+	}
+
+	// the stream of one sample of one pixel
+	inline void start(uint32_t x, uint32_t y, uint32_t sample, uint32_t seed)
+	{
+		m_state = hash_mix((uint64_t(x) << 32 | y) ^ hash_mix(uint64_t(sample) << 32 | seed));
+		next();
+	}
+
+	// 24 random bits, so the result is always below max
+	inline T gen() { return m_min + m_scale * (T(next() >> 8) * T(1.0 / 16777216.0)); }
 
 	inline glm::tvec3<T> random_in_unit_sphere()
 	{
@@ -29,6 +77,15 @@ public:
 		return p;
 	}
 
+	// uniformly distributed on the unit sphere surface
+	inline glm::tvec3<T> random_unit_vector()
+	{
+		T z = T(2) * gen() - T(1);
+		T r = std::sqrt(std::max(T(0), T(1) - z * z));
+		T phi = T(6.28318530717958647692) * gen();
+		return glm::tvec3<T>(r * std::cos(phi), r * std::sin(phi), z);
+	}
+
 	inline glm::tvec3<T> random_in_unit_disk()
 	{
 		glm::tvec3<T> p;
@@ -14,6 +14,10 @@ public:
 
 	glm::vec3 a;
 	glm::vec3 b;
+	// ray cone used as a cheap ray differential for texture filtering:
+	// footprint width at the origin and its growth per unit of distance
+	float cone_width = 0.0f;
+	float cone_spread = 0.0f;
 };
 
 
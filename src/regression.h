@@ -0,0 +1,198 @@
+#ifndef REGRESSION_H
+#define REGRESSION_H
+
+// Image and performance regression harness (--regress <dir>). Renders a fixed set of scenes,
+// which are bit reproducible, and compares them with the references <dir>/<case>.pfm by rmse
+// and mean FLIP. A missing reference fails the case; --regress-update writes new ones. The
+// references of the default (portable) build are committed in regression/, so "--regress
+// regression" from the repository root gates a fresh checkout. Every run appends one json
+// object per case to <dir>/history.jsonl with the wall time, Mrays/s and peak memory; a case
+// fails when its throughput drops more than the tolerance below the median of its last passing
+// runs. Throughput only compares within one machine, so the history isn't committed.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "scene.h"
+#include "film.h"
+#include "framebuffer.h"
+#include "renderer.h"
+#include "image_io.h"
+#include "flip.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+struct RegressionCase
+{
+	const char *scene;
+	int width, height, spp;
+	double max_rmse, max_flip;
+};
+
+// a change that only reorders floating point math stays far below these, anything that
+// changes the sampling does not
+static const RegressionCase REGRESSION_CASES[] = {
+	{ "cornell", 160, 160, 16, 0.005, 0.01 },
+	{ "random", 192, 108, 8, 0.005, 0.01 },
+	{ "random_lights", 192, 108, 8, 0.005, 0.01 },
+	{ "procedural", 192, 108, 64, 0.005, 0.01 },
+};
+
+struct RegressionOptions
+{
+	std::string dir;
+	bool update = false;     // replace the references instead of comparing
+	double tolerance = 0.1;  // allowed throughput loss against the history
+	int history = 5;         // passing runs the throughput baseline is the median of
+};
+
+namespace detail
+{
+
+// Linux can reset the resident set high-water mark, so every case reports its own peak.
+// Elsewhere the mark only grows and the peak is that of the process so far.
+inline bool reset_peak_memory()
+{
+#if defined(__linux__)
+	std::ofstream clear_refs("/proc/self/clear_refs");
+	return bool(clear_refs << "5") && bool(clear_refs.flush());
+#else
+	return false;
+#endif
+}
+
+inline double peak_memory_mb()
+{
+#if defined(__linux__)
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) {
+			return std::strtod(line.c_str() + 6, nullptr) / 1024.0;
+		}
+	}
+	return 0.0;
+#elif defined(__APPLE__)
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return double(usage.ru_maxrss) / (1024.0 * 1024.0);
+#elif defined(__unix__)
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return double(usage.ru_maxrss) / 1024.0;
+#else
+	return 0.0;
+#endif
+}
+
+// median Mrays/s of the last passing runs of a case, 0 without history
+inline double throughput_baseline(const std::string &path, const std::string &name, int runs)
+{
+	std::ifstream in(path);
+	std::vector<double> values;
+	std::string line;
+	const std::string key = "\"case\":\"" + name + "\"";
+	while (std::getline(in, line)) {
+		size_t pos = line.find("\"mrays_per_s\":");
+		if (line.find(key) == std::string::npos || line.find("\"status\":\"pass\"") == std::string::npos ||
+			pos == std::string::npos) {
+			continue;
+		}
+		values.push_back(std::strtod(line.c_str() + pos + 14, nullptr));
+	}
+	if (values.empty()) {
+		return 0.0;
+	}
+	values.erase(values.begin(), values.end() - std::min<size_t>(values.size(), size_t(runs)));
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+}
+
+// returns the number of failed cases
+int run_regression(const RegressionOptions &opts)
+{
+	const std::string history_path = opts.dir + "/history.jsonl";
+	std::ofstream history(history_path, std::ios::app);
+	if (!history) {
+		std::cerr << "could not open " << history_path << std::endl;
+		return 1;
+	}
+	char timestamp[32];
+	std::time_t now = std::time(nullptr);
+	std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", std::gmtime(&now));
+
+	int failures = 0;
+	Filter filter;
+	for (const RegressionCase &c : REGRESSION_CASES) {
+		Scene scene = make_scene(c.scene, float(c.width) / float(c.height));
+		scene.camera.set_resolution(c.width, c.height);
+		scene.lights.build(LightSampling::BVH);
+		Framebuffer fb(c.width, c.height);
+
+		const bool case_peak = detail::reset_peak_memory();
+		uint64_t rays_before = ray_counter();
+		auto t0 = std::chrono::steady_clock::now();
+		render(scene, c.spp, filter, { 0, 0, c.width, c.height }, fb);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		double mrays = double(ray_counter() - rays_before) / seconds * 1e-6;
+
+		const std::string reference = opts.dir + "/" + c.scene + ".pfm";
+		std::string status = "pass";
+		double error_rmse = 0.0, error_flip = 0.0;
+		int rw, rh;
+		std::vector<float> pixels;
+		if (opts.update) {
+			write_image(reference, c.width, c.height, fb.color);
+			status = "new";
+		} else if (!load_pfm(reference, rw, rh, pixels)) {
+			status = "missing";
+		} else if (rw != c.width || rh != c.height) {
+			status = "image";
+		} else {
+			std::vector<glm::vec3> ref(size_t(rw) * rh);
+			std::memcpy(&ref[0].x, pixels.data(), pixels.size() * sizeof(float));
+			error_rmse = rmse(fb.color, ref);
+			error_flip = flip::mean_error(ref, fb.color, c.width, c.height);
+			if (error_rmse > c.max_rmse || error_flip > c.max_flip) {
+				status = "image";
+			}
+		}
+		double baseline = detail::throughput_baseline(history_path, c.scene, opts.history);
+		if (status == "pass" && baseline > 0.0 && mrays < (1.0 - opts.tolerance) * baseline) {
+			status = "throughput";
+		}
+		failures += status == "missing" || status == "image" || status == "throughput";
+
+		std::ostringstream record;
+		record << "{\"time\":\"" << timestamp << "\",\"case\":\"" << c.scene << "\",\"width\":" << c.width
+			<< ",\"height\":" << c.height << ",\"spp\":" << c.spp << ",\"seconds\":" << seconds
+			<< ",\"mrays_per_s\":" << mrays << ",\"peak_rss_mb\":" << detail::peak_memory_mb()
+			<< ",\"peak_rss_scope\":\"" << (case_peak ? "case" : "process") << "\""
+			<< ",\"rmse\":" << error_rmse << ",\"flip\":" << error_flip << ",\"status\":\"" << status << "\"}";
+		history << record.str() << std::endl;
+
+		std::cout << c.scene << ": " << status << ", " << seconds << " s, " << mrays << " Mrays/s";
+		if (baseline > 0.0) {
+			std::cout << " (baseline " << baseline << ")";
+		}
+		std::cout << ", rmse " << error_rmse << ", flip " << error_flip << std::endl;
+		if (status == "missing") {
+			std::cerr << "no reference " << reference << ", --regress-update records one" << std::endl;
+		}
+	}
+	return failures;
+}
+
+#endif //REGRESSION_H
@@ -0,0 +1,286 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <glm/glm.hpp>
+#include "scene.h"
+#include "film.h"
+#include "framebuffer.h"
+#include "integrator.h"
+#include "wavefront.h"
+#include "random_generator.h"
+#include "profiler.h"
+#include "trace.h"
+
+static const int TILE_SIZE_PX = 16;
+
+// lets a render be stopped from another thread (or a signal handler) or by a wall clock deadline.
+// Render threads poll stopped() once per tile: a relaxed load, plus a steady clock read when a
+// deadline is set.
+class RenderControl
+{
+public:
+	void cancel() { m_cancelled.store(true, std::memory_order_relaxed); }
+
+	void set_budget(double seconds)
+	{
+		m_deadline = std::chrono::steady_clock::now() +
+			std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+		m_has_deadline = true;
+	}
+
+	bool stopped() const
+	{
+		return m_cancelled.load(std::memory_order_relaxed) ||
+			(m_has_deadline && std::chrono::steady_clock::now() >= m_deadline);
+	}
+
+private:
+	std::atomic<bool> m_cancelled{ false };
+	bool m_has_deadline = false;
+	std::chrono::steady_clock::time_point m_deadline;
+};
+
+// rays traced by all render_tile calls so far
+inline std::atomic<uint64_t> &ray_counter()
+{
+	static std::atomic<uint64_t> count{ 0 };
+	return count;
+}
+
+// the tiles of the global 16x16 tile grid overlapping a region, numbered row by row.
+// Tiles are clipped to the region so a crop costs in proportion to its area.
+struct TileGrid
+{
+	PixelBounds region;
+	int tx0, ty0;
+	int tiles_x, tiles_y;
+
+	TileGrid(const PixelBounds &r)
+		: region(r), tx0(r.x0 / TILE_SIZE_PX), ty0(r.y0 / TILE_SIZE_PX)
+	{
+		tiles_x = r.empty() ? 0 : (r.x1 + TILE_SIZE_PX - 1) / TILE_SIZE_PX - tx0;
+		tiles_y = r.empty() ? 0 : (r.y1 + TILE_SIZE_PX - 1) / TILE_SIZE_PX - ty0;
+	}
+
+	int count() const { return tiles_x * tiles_y; }
+
+	int global_x(int index) const { return tx0 + index % tiles_x; }
+	int global_y(int index) const { return ty0 + index / tiles_x; }
+
+	PixelBounds tile(int index) const
+	{
+		int x = global_x(index) * TILE_SIZE_PX;
+		int y = global_y(index) * TILE_SIZE_PX;
+		return region.intersect({ x, y, x + TILE_SIZE_PX, y + TILE_SIZE_PX });
+	}
+};
+
+// render_tile() through the wavefront integrator. The tile's samples are traced in waves of up to
+// WAVE_SIZE paths and handed to the film and the aovs in the same pixel and sample order.
+template<bool WithAOV, class World>
+FilmTile render_tile_wavefront(const Scene &scene, const World &world, int num_samples, const TileGrid &grid, int index,
+	const Film &film, Framebuffer *fb, uint32_t first_sample)
+{
+	const int nx = film.width();
+	const int ny = film.height();
+	const Camera &cam = scene.camera;
+	const PixelBounds b = grid.tile(index);
+	const int width = b.x1 - b.x0;
+	const size_t total = size_t(b.area()) * size_t(num_samples);
+	const uint64_t rays_before = detail::rays_traced;
+	trace::Scope trace_tile("tile", "render", "tile", index, "first_sample", first_sample);
+	constexpr bool profiled = prof::is_profiled<World>::value;
+	prof::Scope<profiled> trace_scope(prof::TRACE);
+
+	std::vector<PathState> paths(std::min(total, WAVE_SIZE));
+	std::vector<AOVSample> aovs(WithAOV ? paths.size() : 0);
+	std::vector<glm::vec2> positions(paths.size());
+	WaveBuffers buffers;
+	AOVAccumulator acc;
+	glm::vec3 color(0.0f);
+	FilmTile film_tile = film.make_tile(b.x0, b.y0, b.x1, b.y1);
+	for (size_t begin = 0; begin < total; begin += WAVE_SIZE) {
+		const size_t count = std::min(WAVE_SIZE, total - begin);
+		{
+			prof::Scope<profiled> scope(prof::CAMERA);
+			for (size_t k = 0; k < count; ++k) {
+				const size_t pixel = (begin + k) / size_t(num_samples);
+				const uint32_t s = uint32_t((begin + k) % size_t(num_samples));
+				const int i = b.x0 + int(pixel % size_t(width));
+				const int j = b.y0 + int(pixel / size_t(width));
+				PathState &p = paths[k];
+				p.rand.start(uint32_t(i), uint32_t(j), first_sample + s, SCENE_SEED);
+				positions[k] = glm::vec2(float(i) + p.rand.gen(), float(j) + p.rand.gen());
+				p.start(cam.generate_ray(positions[k].x / float(nx), positions[k].y / float(ny), p.rand), WithAOV);
+			}
+		}
+		trace_wave<WithAOV>(paths.data(), aovs.data(), count, scene, world, buffers);
+
+		prof::Scope<profiled> scope(prof::OUTPUT);
+		for (size_t k = 0; k < count; ++k) {
+			const glm::vec3 &c = paths[k].radiance;
+			film_tile.add_sample(positions[k], c);
+			if (WithAOV) {
+				color += c;
+				acc.add(aovs[k], detail::luminance(c));
+				const size_t pixel = (begin + k) / size_t(num_samples);
+				if ((begin + k) % size_t(num_samples) == size_t(num_samples) - 1) {
+					const int i = b.x0 + int(pixel % size_t(width));
+					const int j = b.y0 + int(pixel / size_t(width));
+					acc.store(fb->aovs, (ny - 1 - j) * nx + i, int(first_sample), num_samples,
+						detail::luminance(color / float(num_samples)));
+					acc = AOVAccumulator();
+					color = glm::vec3(0.0f);
+				}
+			}
+		}
+	}
+	ray_counter() += detail::rays_traced - rays_before;
+	return film_tile;
+}
+
+// renders samples [first_sample, first_sample + num_samples) of every pixel in the tile. Each
+// sample has its own random stream, so the result doesn't depend on which thread, process or
+// crop renders it, and progressive passes just continue the sample numbering.
+template<bool WithAOV, class World>
+FilmTile render_tile(const Scene &scene, const World &world, int num_samples, const TileGrid &grid, int index,
+	const Film &film, Framebuffer *fb, uint32_t first_sample = 0)
+{
+	if (scene.wavefront) {
+		return render_tile_wavefront<WithAOV>(scene, world, num_samples, grid, index, film, fb, first_sample);
+	}
+	const int nx = film.width();
+	const int ny = film.height();
+	const Camera &cam = scene.camera;
+	const PixelBounds b = grid.tile(index);
+	RandomGenerator<float> rand;
+	const uint64_t rays_before = detail::rays_traced;
+	trace::Scope trace_tile("tile", "render", "tile", index, "first_sample", first_sample);
+	constexpr bool profiled = prof::is_profiled<World>::value;
+	prof::Scope<profiled> trace_scope(prof::TRACE);
+
+	FilmTile film_tile = film.make_tile(b.x0, b.y0, b.x1, b.y1);
+	for (int j = b.y0; j < b.y1; j++) {
+		for (int i = b.x0; i < b.x1; i++) {
+			AOVSample sample;
+			AOVAccumulator acc;
+			glm::vec3 color(0.0f);
+			for (int s = 0; s < num_samples; s++) {
+				glm::vec2 pos;
+				Ray ray;
+				{
+					prof::Scope<profiled> scope(prof::CAMERA);
+					rand.start(uint32_t(i), uint32_t(j), first_sample + uint32_t(s), SCENE_SEED);
+					pos = glm::vec2(float(i) + rand.gen(), float(j) + rand.gen());
+					ray = cam.generate_ray(pos.x / float(nx), pos.y / float(ny), rand);
+				}
+				glm::vec3 c = trace_path<WithAOV>(ray, scene, world, rand, &sample);
+				{
+					prof::Scope<profiled> scope(prof::OUTPUT);
+					film_tile.add_sample(pos, c);
+				}
+				if (WithAOV) {
+					color += c;
+					acc.add(sample, detail::luminance(c));
+				}
+			}
+			if (WithAOV) {
+				// aovs stay a per-pixel box average
+				const int idx = (ny - 1 - j) * nx + i;
+				acc.store(fb->aovs, idx, int(first_sample), num_samples, detail::luminance(color / float(num_samples)));
+			}
+		}
+	}
+	ray_counter() += detail::rays_traced - rays_before;
+	return film_tile;
+}
+
+template<bool WithAOV, class World>
+void render_tiles(const Scene &scene, const World &world, int num_samples, const TileGrid &grid, Film &film, Framebuffer &fb)
+{
+    #pragma omp parallel for schedule(dynamic, 1)
+	for (int tile = 0; tile < grid.count(); tile++) {
+		FilmTile rendered = render_tile<WithAOV>(scene, world, num_samples, grid, tile, film, &fb);
+		prof::Scope<prof::is_profiled<World>::value> scope(prof::OUTPUT);
+		trace::Scope trace_merge("merge", "film", "tile", tile);
+		film.merge_tile(tile, std::move(rendered));
+	}
+}
+
+// spends the samples in passes over the whole region, so that stopping at any tile leaves all
+// pixels about equally converged. Passes start at 1 spp so a short budget still covers the image
+// and double up to 1/16 of the samples. Every pass adds to the aovs, so they (and the variance
+// the denoiser weighs by) cover the same samples as the image. Returns the samples per pixel of
+// the passes that finished.
+template<class World>
+int render_passes(const Scene &scene, const World &world, int num_samples, const TileGrid &grid, Film &film, Framebuffer &fb,
+	const RenderControl &control)
+{
+	const int tiles = grid.count();
+	const int max_pass_samples = std::max(1, num_samples / 16);
+	int pass_samples = 1;
+	int done = 0;
+	for (int pass = 0; done < num_samples && !control.stopped(); pass++) {
+		const int spp = std::min(pass_samples, num_samples - done);
+		pass_samples = std::min(2 * pass_samples, max_pass_samples);
+		const bool with_aov = fb.aovs.enabled != 0;
+		trace::Scope trace_pass("pass", "render", "pass", pass, "spp", spp);
+		std::atomic<int> finished{ 0 };
+        #pragma omp parallel for schedule(dynamic, 1)
+		for (int tile = 0; tile < tiles; tile++) {
+			if (control.stopped()) {
+				continue;
+			}
+			FilmTile rendered = with_aov ?
+				render_tile<true>(scene, world, spp, grid, tile, film, &fb, uint32_t(done)) :
+				render_tile<false>(scene, world, spp, grid, tile, film, &fb, uint32_t(done));
+			prof::Scope<prof::is_profiled<World>::value> scope(prof::OUTPUT);
+			trace::Scope trace_merge("merge", "film", "tile", tile);
+			film.merge_tile(pass * tiles + tile, std::move(rendered));
+			finished++;
+		}
+		if (finished == tiles) {
+			done += spp;
+		}
+	}
+	return done;
+}
+
+// region is in film pixels (y up), pixels outside of it are left black. With a control the
+// render goes in passes and returns early with whatever converged once it is stopped; the
+// samples differ from an uncontrolled render of the same spp.
+// Returns the samples per pixel that were completed everywhere.
+template<class World>
+int render(const Scene &scene, const World &world, int num_samples, const Filter &filter, const PixelBounds &region,
+	Framebuffer &fb, const RenderControl *control = nullptr)
+{
+	Film film(fb.width, fb.height, filter);
+	TileGrid grid(region.intersect({ 0, 0, fb.width, fb.height }));
+	int done = num_samples;
+	{
+		trace::Scope trace_render("render", "render", "spp", num_samples, "tiles", grid.count());
+		if (control) {
+			done = render_passes(scene, world, num_samples, grid, film, fb, *control);
+		} else if (fb.aovs.enabled) {
+			render_tiles<true>(scene, world, num_samples, grid, film, fb);
+		} else {
+			render_tiles<false>(scene, world, num_samples, grid, film, fb);
+		}
+	}
+	prof::Scope<prof::is_profiled<World>::value> scope(prof::OUTPUT);
+	trace::Scope trace_resolve("resolve", "film");
+	film.flush();
+	film.resolve(fb.color);
+	return done;
+}
+
+int render(const Scene &scene, int num_samples, const Filter &filter, const PixelBounds &region, Framebuffer &fb,
+	const RenderControl *control = nullptr)
+{
+	return render(scene, VirtualWorld(scene), num_samples, filter, region, fb, control);
+}
+
+#endif //RENDERER_H
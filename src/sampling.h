@@ -0,0 +1,199 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <glm/glm.hpp>
+
+namespace detail 
+{
+
+inline float pi() { return std::atan(1.0f)*4.0f; }
+
+// builds an orthonormal basis (s, t) around the unit vector n
+inline void build_onb(const glm::vec3 &n, glm::vec3 &s, glm::vec3 &t)
+{
+	glm::vec3 a = std::abs(n.x) > 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+	s = glm::normalize(glm::cross(n, a));
+	t = glm::cross(n, s);
+}
+
+// multiple importance sampling weight for strategy a against strategy b (beta = 2)
+inline float power_heuristic(float pdf_a, float pdf_b)
+{
+	float a2 = pdf_a * pdf_a;
+	float b2 = pdf_b * pdf_b;
+	return a2 > 0.0f ? a2 / (a2 + b2) : 0.0f;
+}
+
+inline float luminance(const glm::vec3 &c)
+{
+	return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
+}
+
+// Walker/Vose alias table: O(1) sampling of a discrete distribution given by non-negative weights
+class AliasTable
+{
+public:
+	AliasTable() {}
+	AliasTable(const std::vector<float> &weights);
+
+	bool empty() const { return m_pdf.empty(); }
+	size_t size() const { return m_pdf.size(); }
+	float pdf(size_t i) const { return m_pdf[i]; }
+
+	size_t sample(float u) const
+	{
+		float scaled = u * float(m_pdf.size());
+		size_t i = std::min(size_t(scaled), m_pdf.size() - 1);
+		return (scaled - float(i)) < m_prob[i] ? i : m_alias[i];
+	}
+
+private:
+	std::vector<float> m_pdf;
+	std::vector<float> m_prob;
+	std::vector<uint32_t> m_alias;
+};
+
+AliasTable::AliasTable(const std::vector<float> &weights)
+{
+	const size_t n = weights.size();
+	double sum = 0.0;
+	for (float w : weights) {
+		sum += double(w);
+	}
+	if (n == 0 || sum <= 0.0) {
+		// degenerate input: fall back to uniform
+		m_pdf.assign(n, n ? 1.0f / float(n) : 0.0f);
+		m_prob.assign(n, 1.0f);
+		m_alias.resize(n);
+		for (size_t i = 0; i < n; ++i) {
+			m_alias[i] = uint32_t(i);
+		}
+		return;
+	}
+
+	m_pdf.resize(n);
+	m_prob.resize(n);
+	m_alias.resize(n);
+	std::vector<double> scaled(n);
+	std::vector<uint32_t> small, large;
+	for (size_t i = 0; i < n; ++i) {
+		m_pdf[i] = float(double(weights[i]) / sum);
+		scaled[i] = double(weights[i]) / sum * double(n);
+		m_alias[i] = uint32_t(i);
+		(scaled[i] < 1.0 ? small : large).push_back(uint32_t(i));
+	}
+	while (!small.empty() && !large.empty()) {
+		uint32_t s = small.back(); small.pop_back();
+		uint32_t l = large.back(); large.pop_back();
+		m_prob[s] = float(scaled[s]);
+		m_alias[s] = l;
+		scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+		(scaled[l] < 1.0 ? small : large).push_back(l);
+	}
+	// leftovers are 1 up to rounding
+	for (uint32_t i : large) m_prob[i] = 1.0f;
+	for (uint32_t i : small) m_prob[i] = 1.0f;
+}
+
+// piecewise constant density over [0,1) defined by n non-negative function values
+class Distribution1D
+{
+public:
+	Distribution1D() {}
+	Distribution1D(const float *f, size_t n)
+		: m_func(f, f + n), m_cdf(n + 1)
+	{
+		m_cdf[0] = 0.0f;
+		for (size_t i = 1; i <= n; ++i) {
+			m_cdf[i] = m_cdf[i - 1] + m_func[i - 1] / float(n);
+		}
+		m_integral = m_cdf[n];
+		if (m_integral <= 0.0f) {
+			for (size_t i = 1; i <= n; ++i) {
+				m_cdf[i] = float(i) / float(n);
+			}
+		} else {
+			for (size_t i = 1; i <= n; ++i) {
+				m_cdf[i] /= m_integral;
+			}
+		}
+	}
+
+	size_t size() const { return m_func.size(); }
+	float integral() const { return m_integral; }
+
+	// returns x in [0,1) with density pdf, offset is the segment x fell into
+	float sample(float u, float &pdf, size_t &offset) const
+	{
+		auto it = std::upper_bound(m_cdf.begin(), m_cdf.end(), u);
+		offset = size_t(std::max<ptrdiff_t>(0, (it - m_cdf.begin()) - 1));
+		offset = std::min(offset, m_func.size() - 1);
+		float du = u - m_cdf[offset];
+		float width = m_cdf[offset + 1] - m_cdf[offset];
+		if (width > 0.0f) {
+			du /= width;
+		}
+		pdf = m_integral > 0.0f ? m_func[offset] / m_integral : 1.0f;
+		return std::min((float(offset) + du) / float(size()), 0.99999994f);
+	}
+
+	float pdf(float x) const
+	{
+		size_t i = std::min(size_t(std::max(0.0f, x) * float(size())), size() - 1);
+		return m_integral > 0.0f ? m_func[i] / m_integral : 1.0f;
+	}
+
+private:
+	std::vector<float> m_func;
+	std::vector<float> m_cdf;
+	float m_integral = 0.0f;
+};
+
+// piecewise constant density over [0,1)^2: a marginal over rows and one conditional per row
+class Distribution2D
+{
+public:
+	Distribution2D() {}
+	Distribution2D(const float *f, size_t nu, size_t nv)
+	{
+		m_conditional.reserve(nv);
+		std::vector<float> marginal(nv);
+		for (size_t v = 0; v < nv; ++v) {
+			m_conditional.emplace_back(f + v * nu, nu);
+			marginal[v] = m_conditional.back().integral();
+		}
+		m_marginal = Distribution1D(marginal.data(), nv);
+	}
+
+	glm::vec2 sample(float u0, float u1, float &pdf) const
+	{
+		float pdf_u, pdf_v;
+		size_t v;
+		float y = m_marginal.sample(u1, pdf_v, v);
+		size_t u;
+		float x = m_conditional[v].sample(u0, pdf_u, u);
+		pdf = pdf_u * pdf_v;
+		return glm::vec2(x, y);
+	}
+
+	float pdf(const glm::vec2 &p) const
+	{
+		size_t v = std::min(size_t(std::max(0.0f, p.y) * float(m_conditional.size())), m_conditional.size() - 1);
+		if (m_marginal.integral() <= 0.0f) {
+			return 1.0f;
+		}
+		return m_conditional[v].pdf(p.x) * m_conditional[v].integral() / m_marginal.integral();
+	}
+
+private:
+	std::vector<Distribution1D> m_conditional;
+	Distribution1D m_marginal;
+};
+
+#endif //SAMPLING_H
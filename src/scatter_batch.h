@@ -0,0 +1,249 @@
+#ifndef SCATTER_BATCH_H
+#define SCATTER_BATCH_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <glm/glm.hpp>
+#include "ray.h"
+#include "hitable.h"
+#include "random_generator.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// hits of one material in structure of arrays layout, for Material::scatter_batch. The arrays
+// hold the shading normals and the incoming ray directions; recs are there for what the kernels
+// don't vectorize (texture lookups, the scalar fallback). Lane i draws its random numbers from
+// rands[i], the stream of the path it belongs to.
+struct HitBatch
+{
+	size_t count = 0;
+	const HitRecord *recs = nullptr;
+	const float *nx = nullptr, *ny = nullptr, *nz = nullptr;
+	const float *dx = nullptr, *dy = nullptr, *dz = nullptr;
+	RandomGenerator<float> *const *rands = nullptr;
+};
+
+// scattered rays start at recs[i].p; valid is 0 where the path was absorbed
+struct ScatterBatch
+{
+	float *dx = nullptr, *dy = nullptr, *dz = nullptr;
+	float *ar = nullptr, *ag = nullptr, *ab = nullptr;
+	uint8_t *valid = nullptr;
+};
+
+// owning storage for a batched or wavefront integrator: collect the hits of one material with
+// add(), scatter them all with material.scatter_batch(batch.hits(), batch.out()), then read the
+// results back per index
+class ShadingBatch
+{
+public:
+	void clear()
+	{
+		m_recs.clear();
+		m_rands.clear();
+		for (auto *v : { &m_nx, &m_ny, &m_nz, &m_dx, &m_dy, &m_dz }) {
+			v->clear();
+		}
+	}
+
+	void add(const HitRecord &rec, const glm::vec3 &direction, RandomGenerator<float> *rand)
+	{
+		m_recs.push_back(rec);
+		m_rands.push_back(rand);
+		m_nx.push_back(rec.normal.x);
+		m_ny.push_back(rec.normal.y);
+		m_nz.push_back(rec.normal.z);
+		m_dx.push_back(direction.x);
+		m_dy.push_back(direction.y);
+		m_dz.push_back(direction.z);
+	}
+
+	size_t size() const { return m_recs.size(); }
+
+	HitBatch hits() const
+	{
+		HitBatch h;
+		h.count = m_recs.size();
+		h.recs = m_recs.data();
+		h.nx = m_nx.data(); h.ny = m_ny.data(); h.nz = m_nz.data();
+		h.dx = m_dx.data(); h.dy = m_dy.data(); h.dz = m_dz.data();
+		h.rands = m_rands.data();
+		return h;
+	}
+
+	// sized for the hits added so far
+	ScatterBatch out()
+	{
+		size_t n = m_recs.size();
+		for (auto *v : { &m_ox, &m_oy, &m_oz, &m_ar, &m_ag, &m_ab }) {
+			v->resize(n);
+		}
+		m_valid.resize(n);
+		ScatterBatch s;
+		s.dx = m_ox.data(); s.dy = m_oy.data(); s.dz = m_oz.data();
+		s.ar = m_ar.data(); s.ag = m_ag.data(); s.ab = m_ab.data();
+		s.valid = m_valid.data();
+		return s;
+	}
+
+	bool valid(size_t i) const { return m_valid[i] != 0; }
+	Ray scattered(size_t i) const { return Ray(m_recs[i].p, glm::vec3(m_ox[i], m_oy[i], m_oz[i])); }
+	glm::vec3 attenuation(size_t i) const { return glm::vec3(m_ar[i], m_ag[i], m_ab[i]); }
+
+private:
+	std::vector<HitRecord> m_recs;
+	std::vector<RandomGenerator<float> *> m_rands;
+	std::vector<float> m_nx, m_ny, m_nz, m_dx, m_dy, m_dz;
+	std::vector<float> m_ox, m_oy, m_oz, m_ar, m_ag, m_ab;
+	std::vector<uint8_t> m_valid;
+};
+
+namespace detail
+{
+
+// how many hits the kernels shade per texture lookup
+static const size_t SCATTER_BATCH = 64;
+
+// (1 - c)^5 of schlick's approximation without std::pow
+inline float pow5(float x)
+{
+	float x2 = x * x;
+	return x2 * x2 * x;
+}
+
+// scalar twin of unit_vector8 for builds without avx2
+inline glm::vec3 unit_vector(float u0, float u1)
+{
+	float z = 1.0f - 2.0f * u0;
+	float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+	float phi = 6.28318530718f * u1;
+	return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+#ifdef __AVX2__
+// a * b + c, c - a * b and a * b - c, fused where the target has fma
+inline __m256 madd8(__m256 a, __m256 b, __m256 c)
+{
+#ifdef __FMA__
+	return _mm256_fmadd_ps(a, b, c);
+#else
+	return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+inline __m256 nmadd8(__m256 a, __m256 b, __m256 c)
+{
+#ifdef __FMA__
+	return _mm256_fnmadd_ps(a, b, c);
+#else
+	return _mm256_sub_ps(c, _mm256_mul_ps(a, b));
+#endif
+}
+
+inline __m256 msub8(__m256 a, __m256 b, __m256 c)
+{
+#ifdef __FMA__
+	return _mm256_fmsub_ps(a, b, c);
+#else
+	return _mm256_sub_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+inline __m256 dot8(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz)
+{
+	return madd8(ax, bx, madd8(ay, by, _mm256_mul_ps(az, bz)));
+}
+
+inline __m256 pow5_8(__m256 x)
+{
+	__m256 x2 = _mm256_mul_ps(x, x);
+	return _mm256_mul_ps(_mm256_mul_ps(x2, x2), x);
+}
+
+// sine and cosine for x in [0, 2 pi): reduction to [-pi/4, pi/4] by quadrant, then taylor
+// polynomials good to a few ulp, which is plenty for sampling directions
+inline void sincos8(__m256 x, __m256 &s, __m256 &c)
+{
+	__m256 q = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(0.63661977236f)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	// pi/2 in two parts so the reduction keeps its precision
+	__m256 r = nmadd8(q, _mm256_set1_ps(1.57079625129f), x);
+	r = nmadd8(q, _mm256_set1_ps(7.54978995489e-8f), r);
+	__m256 r2 = _mm256_mul_ps(r, r);
+
+	__m256 ps = madd8(r2, _mm256_set1_ps(-1.0f / 5040.0f), _mm256_set1_ps(1.0f / 120.0f));
+	ps = madd8(r2, ps, _mm256_set1_ps(-1.0f / 6.0f));
+	ps = madd8(_mm256_mul_ps(r2, r), ps, r);
+	__m256 pc = madd8(r2, _mm256_set1_ps(1.0f / 40320.0f), _mm256_set1_ps(-1.0f / 720.0f));
+	pc = madd8(r2, pc, _mm256_set1_ps(1.0f / 24.0f));
+	pc = madd8(r2, pc, _mm256_set1_ps(-0.5f));
+	pc = madd8(r2, pc, _mm256_set1_ps(1.0f));
+
+	// quadrant k: sin = (s, c, -s, -c)[k], cos = (c, -s, -c, s)[k]
+	__m256i k = _mm256_cvtps_epi32(q);
+	__m256 swap = _mm256_castsi256_ps(_mm256_slli_epi32(k, 31));
+	__m256 sin_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(k, 1), 31));
+	__m256 cos_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_srli_epi32(_mm256_add_epi32(k, _mm256_set1_epi32(1)), 1), 31));
+	s = _mm256_xor_ps(_mm256_blendv_ps(ps, pc, swap), sin_sign);
+	c = _mm256_xor_ps(_mm256_blendv_ps(pc, ps, swap), cos_sign);
+}
+
+// the last count < 8 lanes of a batch, from lane first on, padded to 8 by repeating the last of
+// them. The kernels run their 8 wide code on it, so a lane comes out the same whether it ends up
+// in the tail or in a full group, and a path's result doesn't depend on the rest of its wave.
+struct PaddedLanes8
+{
+	float nx[8], ny[8], nz[8], dx[8], dy[8], dz[8];
+	float ox[8], oy[8], oz[8], ar[8], ag[8], ab[8];
+	uint8_t valid[8];
+	HitBatch hits;
+	ScatterBatch out;
+
+	// out's lanes start as the destination's, so what a kernel doesn't write goes back unchanged
+	PaddedLanes8(const HitBatch &src, const ScatterBatch &dst, size_t first, size_t count)
+	{
+		for (size_t l = 0; l < 8; ++l) {
+			const size_t i = first + std::min(l, count - 1);
+			nx[l] = src.nx[i]; ny[l] = src.ny[i]; nz[l] = src.nz[i];
+			dx[l] = src.dx[i]; dy[l] = src.dy[i]; dz[l] = src.dz[i];
+			ox[l] = dst.dx[i]; oy[l] = dst.dy[i]; oz[l] = dst.dz[i];
+			ar[l] = dst.ar[i]; ag[l] = dst.ag[i]; ab[l] = dst.ab[i];
+			valid[l] = dst.valid[i];
+		}
+		hits.count = 8;
+		hits.nx = nx; hits.ny = ny; hits.nz = nz;
+		hits.dx = dx; hits.dy = dy; hits.dz = dz;
+		out.dx = ox; out.dy = oy; out.dz = oz;
+		out.ar = ar; out.ag = ag; out.ab = ab;
+		out.valid = valid;
+	}
+
+	void store(ScatterBatch &dst, size_t first, size_t count) const
+	{
+		for (size_t l = 0; l < count; ++l) {
+			const size_t i = first + l;
+			dst.dx[i] = ox[l]; dst.dy[i] = oy[l]; dst.dz[i] = oz[l];
+			dst.ar[i] = ar[l]; dst.ag[i] = ag[l]; dst.ab[i] = ab[l];
+			dst.valid[i] = valid[l];
+		}
+	}
+};
+
+// uniform directions from two uniform numbers, same mapping as RandomGenerator::random_unit_vector
+inline void unit_vector8(__m256 u0, __m256 u1, __m256 &x, __m256 &y, __m256 &z)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	z = nmadd8(_mm256_set1_ps(2.0f), u0, one);
+	__m256 r = _mm256_sqrt_ps(_mm256_max_ps(_mm256_setzero_ps(), nmadd8(z, z, one)));
+	__m256 s, c;
+	sincos8(_mm256_mul_ps(_mm256_set1_ps(6.28318530718f), u1), s, c);
+	x = _mm256_mul_ps(r, c);
+	y = _mm256_mul_ps(r, s);
+}
+#endif
+
+}
+
+#endif //SCATTER_BATCH_H
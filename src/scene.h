@@ -0,0 +1,215 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+#include <memory>
+#include <string>
+#include <iostream>
+#include <glm/glm.hpp>
+#include "ray.h"
+#include "hitable.h"
+#include "wide_bvh.h"
+#include "material.h"
+#include "light.h"
+#include "light_sampler.h"
+#include "environment.h"
+#include "texture.h"
+#include "procedural.h"
+#include "camera.h"
+#include "random_generator.h"
+
+static const uint32_t SCENE_SEED = 2018;
+
+struct Scene
+{
+	std::unique_ptr<Hitable> world;
+	LightList lights;
+	Camera camera;
+	bool sky; // sky gradient background, otherwise black
+	bool wavefront = false; // render tiles with the wavefront integrator (wavefront.h)
+	// replaces the background when set, owned by lights
+	const EnvironmentLight *environment = nullptr;
+
+	void set_environment(std::shared_ptr<const EnvironmentMap> map, float scale)
+	{
+		auto light = std::make_unique<EnvironmentLight>(map, scale);
+		environment = light.get();
+		lights.add(std::move(light));
+	}
+
+	glm::vec3 background(const Ray &r) const
+	{
+		if (environment) {
+			return environment->radiance(r.direction());
+		}
+		if (!sky) {
+			return glm::vec3(0.0f);
+		}
+		glm::vec3 unit_dir = glm::normalize(r.direction());
+		float t = 0.5f * (unit_dir.y + 1.0f);
+		return (1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
+	}
+};
+
+// light_fraction > 0 turns that share of the small spheres into emitters and switches the sky off.
+// The small spheres fill a (2 grid)^2 field around the big ones; larger grids are for acceleration
+// structure benchmarks.
+Scene random_spheres_scene(float aspect, float light_fraction = 0.0f, int grid = 11)
+{
+	glm::vec3 cam_pos(13.0f, 2.0f, 3.0f);
+	glm::vec3 lookat(0.0f, 0.0f, 0.0f);
+	float dist_to_focus = 10.0f; 
+	float aperture = 0.1f;
+
+	Camera cam(cam_pos, lookat, glm::vec3(0.0f, 1.0f, 0.0f),
+		20, aspect, aperture, dist_to_focus);
+
+	std::vector<std::shared_ptr<Material>> materials = {
+		std::make_shared<Dielectric>(1.5f),
+		std::make_shared<Lambertian>(glm::vec3(0.4f, 0.2f, 0.1f)),
+		std::make_shared<Metal>(glm::vec3(0.7, 0.6, 0.5), 0.0f),
+		std::make_shared<Lambertian>(glm::vec3(0.5, 0.5, 0.5))
+	};
+
+	std::vector<std::unique_ptr<Light>> lights;
+	std::vector<std::unique_ptr<Hitable>> objects;
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(0.0f, -1000.0f, 0.0f), 1000.0f, materials[3]));
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(0.0f, 1.0f, 0.0f), 1.0f, materials[0]));
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(-4.0f, 1.0f, 0.0f), 1.0f, materials[1]));
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(4.0f, 1.0f, 0.0f), 1.0f, materials[2]));
+
+	// fixed seed: every process (and every run) has to build the same layout
+	RandomGenerator<float> rand;
+	rand.seed(SCENE_SEED);
+	for (int a = -grid; a < grid; a++) {
+		for (int b = -grid; b < grid; b++) {
+			float choose_mat = rand.gen();
+			glm::vec3 center(a + 0.9f*rand.gen(), 0.2f, b + 0.9f*rand.gen());
+			if ((center - glm::vec3(4.0f, 0.2f, 0.0f)).length() > 0.9) {
+				// no draw without emitters, so the layout stays that of the plain random scene
+				if (light_fraction > 0.0f && rand.gen() < light_fraction) { // emitter
+					glm::vec3 emit = 4.0f * glm::vec3(rand.gen(), rand.gen(), rand.gen());
+					auto light = std::make_unique<SphereLight>(center, 0.2f, emit);
+					objects.emplace_back(std::make_unique<Sphere>(
+						center, 0.2f, std::make_shared<DiffuseLight>(emit, light.get())));
+					lights.emplace_back(std::move(light));
+				} else if (choose_mat < 0.8) { // diffuse
+					objects.emplace_back(std::make_unique<Sphere>(
+						center, 0.2f, std::make_shared<Lambertian>(
+							glm::vec3(rand.gen()*rand.gen(), rand.gen()*rand.gen(), rand.gen()*rand.gen()))));
+				} else if (choose_mat < 0.95) { // metal
+					objects.emplace_back(std::make_unique<Sphere>(
+						center, 0.2f, std::make_shared<Metal>(
+							glm::vec3(0.5*(1 + rand.gen()), 0.5*(1 + rand.gen()), 0.5*(1 + rand.gen())), 0.5 *rand.gen())));
+				} else { // glass
+					objects.emplace_back(std::make_unique<Sphere>(
+						center, 0.2f, std::make_shared<Dielectric>(1.5f)));
+				}
+			}
+		}
+	}
+	bool sky = lights.empty();
+	return Scene{ std::make_unique<HitableList>(std::move(objects)), LightList(std::move(lights)), cam, sky };
+}
+
+// closed box lit only by a ceiling area light and a small sphere light
+Scene cornell_box_scene(float aspect)
+{
+	Camera cam(glm::vec3(278.0f, 278.0f, -800.0f), glm::vec3(278.0f, 278.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+		40, aspect, 0.0f, 10.0f);
+
+	auto red = std::make_shared<Lambertian>(glm::vec3(0.65f, 0.05f, 0.05f));
+	auto white = std::make_shared<Lambertian>(glm::vec3(0.73f, 0.73f, 0.73f));
+	auto green = std::make_shared<Lambertian>(glm::vec3(0.12f, 0.45f, 0.15f));
+
+	std::vector<std::unique_ptr<Light>> lights;
+	std::vector<std::unique_ptr<Hitable>> objects;
+
+	auto quad_light = std::make_unique<QuadLight>(glm::vec3(343.0f, 554.0f, 332.0f),
+		glm::vec3(-130.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -105.0f), glm::vec3(15.0f));
+	objects.emplace_back(std::make_unique<Quad>(quad_light->corner(), quad_light->edge_u(), quad_light->edge_v(),
+		std::make_shared<DiffuseLight>(quad_light->emission(), quad_light.get())));
+	lights.emplace_back(std::move(quad_light));
+
+	auto sphere_light = std::make_unique<SphereLight>(glm::vec3(400.0f, 60.0f, 150.0f), 20.0f, glm::vec3(8.0f, 6.0f, 3.0f));
+	objects.emplace_back(std::make_unique<Sphere>(sphere_light->center(), sphere_light->radius(),
+		std::make_shared<DiffuseLight>(sphere_light->emission(), sphere_light.get())));
+	lights.emplace_back(std::move(sphere_light));
+
+	objects.emplace_back(std::make_unique<Quad>(glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), green));
+	objects.emplace_back(std::make_unique<Quad>(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), red));
+	objects.emplace_back(std::make_unique<Quad>(glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 555.0f), white));
+	objects.emplace_back(std::make_unique<Quad>(glm::vec3(555.0f, 555.0f, 555.0f), glm::vec3(-555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -555.0f), white));
+	objects.emplace_back(std::make_unique<Quad>(glm::vec3(0.0f, 0.0f, 555.0f), glm::vec3(555.0f, 0.0f, 0.0f), glm::vec3(0.0f, 555.0f, 0.0f), white));
+
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(190.0f, 90.0f, 190.0f), 90.0f, std::make_shared<Dielectric>(1.5f)));
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(370.0f, 120.0f, 370.0f), 120.0f, white));
+
+	return Scene{ std::make_unique<HitableList>(std::move(objects)), LightList(std::move(lights)), cam, false };
+}
+
+// the three big spheres of the stock layout on a ground quad, with textured materials
+Scene showcase_scene(float aspect, std::shared_ptr<Texture> ground_tex, std::shared_ptr<Texture> sphere_tex,
+	std::shared_ptr<Texture> roughness_tex)
+{
+	Camera cam(glm::vec3(13.0f, 2.0f, 3.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+		20, aspect, 0.1f, 10.0f);
+
+	std::vector<std::unique_ptr<Hitable>> objects;
+	// a quad rather than the big ground sphere: the camera would look straight at the sphere's uv pole
+	objects.emplace_back(std::make_unique<Quad>(glm::vec3(-100.0f, 0.0f, -100.0f), glm::vec3(200.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 200.0f),
+		std::make_shared<Lambertian>(ground_tex)));
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(0.0f, 1.0f, 0.0f), 1.0f, std::make_shared<Lambertian>(sphere_tex)));
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(-4.0f, 1.0f, 0.0f), 1.0f, std::make_shared<Metal>(sphere_tex, 0.3f, roughness_tex)));
+	objects.emplace_back(std::make_unique<Sphere>(glm::vec3(4.0f, 1.0f, 0.0f), 1.0f, std::make_shared<Dielectric>(1.5f)));
+	return Scene{ std::make_unique<HitableList>(std::move(objects)), LightList(), cam, true };
+}
+
+Scene textured_scene(float aspect, const std::string &texture_path)
+{
+	if (auto image = TiledImage::open(texture_path)) {
+		auto sphere_tex = std::make_shared<ImageTexture>(image);
+		return showcase_scene(aspect, std::make_shared<ImageTexture>(image, 25.0f), sphere_tex, sphere_tex);
+	}
+	std::cerr << "could not load texture " << texture_path << std::endl;
+	auto gray = std::make_shared<ConstantTexture>(glm::vec3(0.5f));
+	return showcase_scene(aspect, gray, gray, nullptr);
+}
+
+Scene procedural_scene(float aspect)
+{
+	return showcase_scene(aspect,
+		std::make_shared<CheckerTexture>(glm::vec3(0.2f, 0.3f, 0.1f), glm::vec3(0.9f), 1.0f),
+		std::make_shared<MarbleTexture>(glm::vec3(0.9f, 0.85f, 0.8f), 1.5f),
+		std::make_shared<NoiseTexture>(glm::vec3(1.0f), 8.0f));
+}
+
+Scene make_named_scene(const std::string &name, float aspect, const std::string &texture_path, int grid)
+{
+	if (name == "textured") {
+		return textured_scene(aspect, texture_path);
+	}
+	if (name == "procedural") {
+		return procedural_scene(aspect);
+	}
+	if (name == "cornell") {
+		return cornell_box_scene(aspect);
+	}
+	if (name == "random_lights") {
+		return random_spheres_scene(aspect, 0.3f, grid);
+	}
+	return random_spheres_scene(aspect, 0.0f, grid);
+}
+
+// the scenes build HitableLists; any other accel takes over their primitives
+Scene make_scene(const std::string &name, float aspect, const std::string &texture_path = "",
+	const AccelOptions &accel = AccelOptions(), int grid = 11)
+{
+	Scene scene = make_named_scene(name, aspect, texture_path, grid);
+	if (accel.type != Accel::List) {
+		scene.world = make_accel(static_cast<HitableList &>(*scene.world).release(), accel);
+	}
+	return scene;
+}
+
+#endif //SCENE_H
@@ -0,0 +1,180 @@
+#ifndef STATIC_INTEGRATOR_H
+#define STATIC_INTEGRATOR_H
+
+// World for scenes whose primitive and material types are known at compile time. Primitives are
+// stored by value in one array per type and materials in a std::variant, so the hit loops and the
+// bounce loop of trace_path() get instantiated for concrete (final) types: besides textures and
+// lights there are no vtable calls left and the compiler is free to inline all of it.
+//
+//   StockWorld world;
+//   if (world.build(*scene.world)) {
+//       render(scene, world, spp, filter, region, fb);
+//   }
+
+#include <map>
+#include <tuple>
+#include <vector>
+#include <variant>
+#include <cstdint>
+#include "hitable.h"
+#include "material.h"
+
+template<class... Ts>
+struct TypeList {};
+
+template<class Primitives, class Materials>
+class StaticWorld;
+
+template<class... Prims, class... Mats>
+class StaticWorld<TypeList<Prims...>, TypeList<Mats...>>
+{
+public:
+	using MaterialVariant = std::variant<Mats...>;
+
+	// copies the primitives and materials of a HitableList. Returns false if any of them has a
+	// type outside of the lists; such scenes have to be rendered through VirtualWorld.
+	bool build(const Hitable &root);
+
+	bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
+	{
+		bool hit_any = false;
+		float closest = tmax;
+		std::apply([&](const auto &... lists) { (hit_list(lists, r, tmin, closest, rec, hit_any), ...); }, m_primitives);
+		return hit_any;
+	}
+
+	bool occluded(const Ray &r, float tmin, float tmax) const
+	{
+		return std::apply([&](const auto &... lists) { return (occluded_list(lists, r, tmin, tmax) || ...); }, m_primitives);
+	}
+
+	void hit_batch(const Ray *rays, size_t count, float tmin, float tmax, HitRecord *recs, uint8_t *hits) const
+	{
+		for (size_t i = 0; i < count; ++i) {
+			hits[i] = hit(rays[i], tmin, tmax, recs[i]);
+		}
+	}
+
+	void occluded_batch(const Ray *rays, const float *tmax, size_t count, float tmin, uint8_t *occluded) const
+	{
+		for (size_t i = 0; i < count; ++i) {
+			occluded[i] = this->occluded(rays[i], tmin, tmax[i]);
+		}
+	}
+
+	// calls f with the concrete material of the hit
+	template<class F>
+	auto visit_material(const HitRecord &rec, F &&f) const
+	{
+		return std::visit(f, m_materials[m_material_of[rec.object_id]]);
+	}
+
+private:
+	// the primitives of one type with their boxes next to them, which rays test before calling
+	// hit() the way HitableList does
+	template<class P>
+	struct PrimitiveList
+	{
+		std::vector<AABB> bounds;
+		std::vector<P> prims;
+	};
+
+	template<class P>
+	static void hit_list(const PrimitiveList<P> &list, const Ray &r, float tmin, float &closest, HitRecord &rec, bool &hit_any)
+	{
+		const SlabRay ray(r.origin(), r.direction());
+		HitRecord temp_rec;
+		for (size_t i = 0; i < list.prims.size(); ++i) {
+			if (list.bounds[i].hit(ray, tmin, closest) && list.prims[i].hit(r, tmin, closest, temp_rec)) {
+				hit_any = true;
+				closest = temp_rec.t;
+				rec = temp_rec;
+			}
+		}
+	}
+
+	template<class P>
+	static bool occluded_list(const PrimitiveList<P> &list, const Ray &r, float tmin, float tmax)
+	{
+		const SlabRay ray(r.origin(), r.direction());
+		for (size_t i = 0; i < list.prims.size(); ++i) {
+			if (list.bounds[i].hit(ray, tmin, tmax) && list.prims[i].occluded(r, tmin, tmax)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template<class P>
+	bool add_primitive(const Hitable &h, std::map<const Material *, uint32_t> &slots);
+
+	template<class M>
+	bool add_material(const Material &m)
+	{
+		const M *concrete = dynamic_cast<const M *>(&m);
+		if (!concrete) {
+			return false;
+		}
+		m_materials.emplace_back(std::in_place_type<M>, *concrete);
+		return true;
+	}
+
+private:
+	std::tuple<PrimitiveList<Prims>...> m_primitives;
+	std::vector<MaterialVariant> m_materials;
+	std::vector<uint32_t> m_material_of; // material slot by object id
+};
+
+template<class... Prims, class... Mats>
+template<class P>
+bool StaticWorld<TypeList<Prims...>, TypeList<Mats...>>::add_primitive(const Hitable &h,
+	std::map<const Material *, uint32_t> &slots)
+{
+	const P *prim = dynamic_cast<const P *>(&h);
+	if (!prim || !prim->material()) {
+		return false;
+	}
+	// materials shared between primitives keep sharing one slot
+	auto it = slots.find(prim->material());
+	if (it == slots.end()) {
+		if (!(add_material<Mats>(*prim->material()) || ...)) {
+			return false;
+		}
+		it = slots.emplace(prim->material(), uint32_t(m_materials.size() - 1)).first;
+	}
+	PrimitiveList<P> &list = std::get<PrimitiveList<P>>(m_primitives);
+	list.prims.push_back(*prim);
+	list.bounds.push_back(prim->bounds());
+	if (m_material_of.size() <= prim->id()) {
+		m_material_of.resize(prim->id() + 1, 0);
+	}
+	m_material_of[prim->id()] = it->second;
+	return true;
+}
+
+template<class... Prims, class... Mats>
+bool StaticWorld<TypeList<Prims...>, TypeList<Mats...>>::build(const Hitable &root)
+{
+	m_primitives = {};
+	m_materials.clear();
+	m_material_of.clear();
+	const HitableList *list = dynamic_cast<const HitableList *>(&root);
+	if (!list) {
+		return false;
+	}
+	std::map<const Material *, uint32_t> slots;
+	for (const auto &h : list->hitables()) {
+		if (!(add_primitive<Prims>(*h, slots) || ...)) {
+			m_primitives = {};
+			m_materials.clear();
+			m_material_of.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+// every primitive and material the built in scenes use
+using StockWorld = StaticWorld<TypeList<Sphere, Quad>, TypeList<Lambertian, Metal, Dielectric, DiffuseLight>>;
+
+#endif //STATIC_INTEGRATOR_H
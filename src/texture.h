@@ -0,0 +1,128 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <cmath>
+#include <memory>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "hitable.h"
+#include "texture_cache.h"
+
+class Texture
+{
+public:
+	virtual ~Texture() {}
+	virtual glm::vec3 value(const HitRecord &rec) const = 0;
+	// shades n hit points at once, textures with vectorized kernels override this
+	virtual void value_batch(const HitRecord *recs, size_t n, glm::vec3 *out) const
+	{
+		for (size_t i = 0; i < n; ++i) {
+			out[i] = value(recs[i]);
+		}
+	}
+};
+
+class ConstantTexture : public Texture
+{
+public:
+	ConstantTexture(const glm::vec3 &c) : m_color(c) {}
+	virtual glm::vec3 value(const HitRecord &rec) const override { return m_color; }
+
+private:
+	glm::vec3 m_color;
+};
+
+// trilinear filtered lookups into a tiled mip pyramid, the level is picked from the ray cone footprint
+class ImageTexture : public Texture
+{
+public:
+	ImageTexture(std::shared_ptr<const TiledImage> image, float uv_repeat = 1.0f)
+		: m_image(image), m_repeat(uv_repeat) {}
+
+	virtual glm::vec3 value(const HitRecord &rec) const override;
+
+private:
+	glm::vec3 texel(int level, int x, int y) const;
+	glm::vec3 bilinear(int level, const glm::vec2 &uv) const;
+
+private:
+	std::shared_ptr<const TiledImage> m_image;
+	float m_repeat;
+};
+
+namespace detail
+{
+
+// the tiles this thread looked up last, direct mapped by cache key, so that most texel reads
+// skip the cache's shard lock and shared_ptr copy. Each thread keeps up to SIZE tiles alive
+// after the cache evicts them.
+struct TileRefs
+{
+	static const int SIZE_BITS = 5;
+	static const int SIZE = 1 << SIZE_BITS;
+	uint64_t keys[SIZE];
+	std::shared_ptr<const TextureTile> tiles[SIZE];
+
+	TileRefs() { std::fill(keys, keys + SIZE, ~uint64_t(0)); }
+};
+
+inline thread_local TileRefs tile_refs;
+
+}
+
+glm::vec3 ImageTexture::texel(int level, int x, int y) const
+{
+	const TiledImage::Level &l = m_image->level(level);
+	// repeat addressing
+	x %= l.width;
+	y %= l.height;
+	if (x < 0) x += l.width;
+	if (y < 0) y += l.height;
+	int tx = x / TILE_SIZE;
+	int ty = y / TILE_SIZE;
+	const uint64_t key = TextureCache::key(m_image->id(), level, tx, ty);
+	detail::TileRefs &refs = detail::tile_refs;
+	const size_t slot = size_t((key * 0x9E3779B97F4A7C15ull) >> (64 - detail::TileRefs::SIZE_BITS));
+	if (refs.keys[slot] != key) {
+		refs.tiles[slot] = TextureCache::instance().tile(*m_image, level, tx, ty);
+		refs.keys[slot] = key;
+	}
+	const float *p = &refs.tiles[slot]->texels[3 * ((y % TILE_SIZE) * TILE_SIZE + (x % TILE_SIZE))];
+	return glm::vec3(p[0], p[1], p[2]);
+}
+
+glm::vec3 ImageTexture::bilinear(int level, const glm::vec2 &uv) const
+{
+	const TiledImage::Level &l = m_image->level(level);
+	float x = uv.x * float(l.width) - 0.5f;
+	float y = (1.0f - uv.y) * float(l.height) - 0.5f;
+	float fx = std::floor(x);
+	float fy = std::floor(y);
+	int x0 = int(fx);
+	int y0 = int(fy);
+	float dx = x - fx;
+	float dy = y - fy;
+	return (1.0f - dy) * ((1.0f - dx) * texel(level, x0, y0) + dx * texel(level, x0 + 1, y0))
+		+ dy * ((1.0f - dx) * texel(level, x0, y0 + 1) + dx * texel(level, x0 + 1, y0 + 1));
+}
+
+glm::vec3 ImageTexture::value(const HitRecord &rec) const
+{
+	glm::vec2 uv = rec.uv * m_repeat;
+	uv -= glm::floor(uv);
+
+	const TiledImage::Level &base = m_image->level(0);
+	float texels = rec.footprint / std::max(rec.uv_scale, 1e-8f) * m_repeat * float(std::max(base.width, base.height));
+	float lod = texels > 1.0f ? std::log2(texels) : 0.0f;
+	lod = std::min(lod, float(m_image->levels() - 1));
+
+	int l0 = int(lod);
+	float t = lod - float(l0);
+	glm::vec3 c = bilinear(l0, uv);
+	if (t > 0.0f && l0 + 1 < m_image->levels()) {
+		c = (1.0f - t) * c + t * bilinear(l0 + 1, uv);
+	}
+	return c;
+}
+
+#endif //TEXTURE_H
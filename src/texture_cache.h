@@ -0,0 +1,302 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <glm/glm.hpp>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "image_io.h"
+
+// Mipmapped images stored on disk as 8x8 texel tiles, paged in on demand through a
+// process wide cache with a fixed memory budget.
+//
+// Tiled file layout (native endian):
+//   char[4] "TXT1", int32 width, height, levels
+//   per level: int32 width, height, tiles_x, tiles_y, uint64 offset of its first tile
+//   tiles: row major per level, TILE_SIZE * TILE_SIZE rgb floats each, edge tiles padded
+
+static const int TILE_SIZE = 8;
+
+struct TextureTile
+{
+	float texels[TILE_SIZE * TILE_SIZE * 3];
+};
+
+class TiledImage
+{
+public:
+	struct Level
+	{
+		int32_t width, height;
+		int32_t tiles_x, tiles_y;
+		uint64_t offset;
+	};
+
+	~TiledImage()
+	{
+		if (m_file) {
+			std::fclose(m_file);
+		}
+	}
+
+	// opens a .tiled file, or converts a .pfm into "<path>.tiled" when that is missing or not
+	// newer than the .pfm
+	static std::shared_ptr<TiledImage> open(const std::string &path);
+	static bool convert(const std::string &pfm_path, const std::string &tiled_path);
+
+	uint32_t id() const { return m_id; }
+	int levels() const { return int(m_levels.size()); }
+	const Level &level(int l) const { return m_levels[l]; }
+
+	bool read_tile(int level, int tx, int ty, TextureTile &tile) const;
+
+private:
+	TiledImage() {}
+
+private:
+	uint32_t m_id = 0;
+	FILE *m_file = nullptr;
+	mutable std::mutex m_file_mutex;
+	std::vector<Level> m_levels;
+};
+
+class TextureCache
+{
+public:
+	static TextureCache &instance()
+	{
+		static TextureCache cache;
+		return cache;
+	}
+
+	void set_budget(size_t bytes) { m_shard_budget = std::max<size_t>(bytes / NUM_SHARDS, sizeof(TextureTile)); }
+	size_t budget() const { return m_shard_budget * NUM_SHARDS; }
+	size_t resident_bytes();
+	uint64_t misses() const { return m_misses; }
+
+	std::shared_ptr<const TextureTile> tile(const TiledImage &image, int level, int tx, int ty);
+
+	static uint64_t key(uint32_t image, int level, int tx, int ty)
+	{
+		return (uint64_t(image) << 40) | (uint64_t(level & 0xff) << 32) | (uint64_t(ty & 0xffff) << 16) | uint64_t(tx & 0xffff);
+	}
+
+private:
+	TextureCache() { set_budget(size_t(256) << 20); }
+
+private:
+	static const int NUM_SHARDS = 64;
+
+	typedef std::list<std::pair<uint64_t, std::shared_ptr<const TextureTile>>> LruList;
+
+	struct Shard
+	{
+		std::mutex mutex;
+		LruList lru; // most recently used first
+		std::unordered_map<uint64_t, LruList::iterator> map;
+		size_t bytes = 0;
+	};
+
+	Shard m_shards[NUM_SHARDS];
+	std::atomic<size_t> m_shard_budget;
+	std::atomic<uint64_t> m_misses{ 0 };
+};
+
+namespace detail
+{
+
+// modification time in seconds, -1 if the file doesn't exist
+inline int64_t file_mtime(const std::string &path)
+{
+#ifdef _WIN32
+	struct _stat64 st;
+	return _stat64(path.c_str(), &st) == 0 ? int64_t(st.st_mtime) : -1;
+#else
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 ? int64_t(st.st_mtime) : -1;
+#endif
+}
+
+}
+
+std::shared_ptr<TiledImage> TiledImage::open(const std::string &path)
+{
+	static std::atomic<uint32_t> next_id{ 1 };
+
+	std::string tiled_path = path;
+	const std::string ext = ".tiled";
+	if (path.size() < ext.size() || path.compare(path.size() - ext.size(), ext.size(), ext) != 0) {
+		tiled_path = path + ext;
+		// a conversion in the same second as the source was written counts as stale too
+		const int64_t tiled_time = detail::file_mtime(tiled_path);
+		if ((tiled_time < 0 || tiled_time <= detail::file_mtime(path)) && !convert(path, tiled_path)) {
+			return nullptr;
+		}
+	}
+
+	std::shared_ptr<TiledImage> image(new TiledImage());
+	image->m_file = std::fopen(tiled_path.c_str(), "rb");
+	if (!image->m_file) {
+		return nullptr;
+	}
+	char magic[4];
+	int32_t header[3];
+	if (std::fread(magic, 1, 4, image->m_file) != 4 || std::memcmp(magic, "TXT1", 4) != 0
+		|| std::fread(header, sizeof(int32_t), 3, image->m_file) != 3 || header[2] <= 0) {
+		return nullptr;
+	}
+	image->m_levels.resize(header[2]);
+	if (std::fread(image->m_levels.data(), sizeof(Level), image->m_levels.size(), image->m_file) != image->m_levels.size()) {
+		return nullptr;
+	}
+	image->m_id = next_id++;
+	return image;
+}
+
+bool TiledImage::convert(const std::string &pfm_path, const std::string &tiled_path)
+{
+	int w, h;
+	std::vector<float> rgb;
+	if (!load_pfm(pfm_path, w, h, rgb)) {
+		return false;
+	}
+
+	// box filtered mip chain, the whole source is only in memory during conversion
+	std::vector<std::vector<float>> pyramid;
+	std::vector<Level> levels;
+	pyramid.push_back(std::move(rgb));
+	levels.push_back({ w, h, 0, 0, 0 });
+	while (w > 1 || h > 1) {
+		int nw = std::max(1, w / 2);
+		int nh = std::max(1, h / 2);
+		const std::vector<float> &src = pyramid.back();
+		std::vector<float> dst(size_t(nw) * nh * 3);
+		for (int y = 0; y < nh; ++y) {
+			for (int x = 0; x < nw; ++x) {
+				for (int c = 0; c < 3; ++c) {
+					float sum = 0.0f;
+					for (int dy = 0; dy < 2; ++dy) {
+						for (int dx = 0; dx < 2; ++dx) {
+							int sx = std::min(2 * x + dx, w - 1);
+							int sy = std::min(2 * y + dy, h - 1);
+							sum += src[3 * (size_t(sy) * w + sx) + c];
+						}
+					}
+					dst[3 * (size_t(y) * nw + x) + c] = 0.25f * sum;
+				}
+			}
+		}
+		pyramid.push_back(std::move(dst));
+		levels.push_back({ nw, nh, 0, 0, 0 });
+		w = nw;
+		h = nh;
+	}
+
+	uint64_t offset = 4 + 3 * sizeof(int32_t) + levels.size() * sizeof(Level);
+	for (Level &l : levels) {
+		l.tiles_x = (l.width + TILE_SIZE - 1) / TILE_SIZE;
+		l.tiles_y = (l.height + TILE_SIZE - 1) / TILE_SIZE;
+		l.offset = offset;
+		offset += uint64_t(l.tiles_x) * l.tiles_y * sizeof(TextureTile);
+	}
+
+	FILE *f = std::fopen(tiled_path.c_str(), "wb");
+	if (!f) {
+		return false;
+	}
+	int32_t header[3] = { levels[0].width, levels[0].height, int32_t(levels.size()) };
+	bool ok = std::fwrite("TXT1", 1, 4, f) == 4
+		&& std::fwrite(header, sizeof(int32_t), 3, f) == 3
+		&& std::fwrite(levels.data(), sizeof(Level), levels.size(), f) == levels.size();
+	TextureTile tile;
+	for (size_t li = 0; li < levels.size() && ok; ++li) {
+		const Level &l = levels[li];
+		const std::vector<float> &src = pyramid[li];
+		for (int ty = 0; ty < l.tiles_y && ok; ++ty) {
+			for (int tx = 0; tx < l.tiles_x && ok; ++tx) {
+				for (int y = 0; y < TILE_SIZE; ++y) {
+					for (int x = 0; x < TILE_SIZE; ++x) {
+						int sx = std::min(tx * TILE_SIZE + x, l.width - 1);
+						int sy = std::min(ty * TILE_SIZE + y, l.height - 1);
+						std::memcpy(&tile.texels[3 * (y * TILE_SIZE + x)], &src[3 * (size_t(sy) * l.width + sx)], 3 * sizeof(float));
+					}
+				}
+				ok = std::fwrite(&tile, sizeof(TextureTile), 1, f) == 1;
+			}
+		}
+	}
+	std::fclose(f);
+	return ok;
+}
+
+bool TiledImage::read_tile(int level, int tx, int ty, TextureTile &tile) const
+{
+	const Level &l = m_levels[level];
+	uint64_t offset = l.offset + (uint64_t(ty) * l.tiles_x + tx) * sizeof(TextureTile);
+	std::lock_guard<std::mutex> lock(m_file_mutex);
+#ifdef _WIN32
+	bool seeked = _fseeki64(m_file, int64_t(offset), SEEK_SET) == 0;
+#else
+	bool seeked = fseeko(m_file, off_t(offset), SEEK_SET) == 0;
+#endif
+	return seeked && std::fread(&tile, sizeof(TextureTile), 1, m_file) == 1;
+}
+
+std::shared_ptr<const TextureTile> TextureCache::tile(const TiledImage &image, int level, int tx, int ty)
+{
+	const uint64_t k = key(image.id(), level, tx, ty);
+	Shard &shard = m_shards[(k * 0x9E3779B97F4A7C15ull) >> 58];
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.map.find(k);
+		if (it != shard.map.end()) {
+			shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+			return it->second->second;
+		}
+	}
+
+	// page the tile in without holding the shard lock
+	auto tile = std::make_shared<TextureTile>();
+	if (!image.read_tile(level, tx, ty, *tile)) {
+		std::fill(tile->texels, tile->texels + TILE_SIZE * TILE_SIZE * 3, 0.0f);
+	}
+	m_misses++;
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.map.find(k);
+	if (it != shard.map.end()) {
+		return it->second->second; // another thread won the race
+	}
+	shard.lru.emplace_front(k, tile);
+	shard.map[k] = shard.lru.begin();
+	shard.bytes += sizeof(TextureTile);
+	// tiles still referenced by a lookup stay alive through their shared_ptr
+	while (shard.bytes > m_shard_budget && shard.lru.size() > 1) {
+		shard.map.erase(shard.lru.back().first);
+		shard.lru.pop_back();
+		shard.bytes -= sizeof(TextureTile);
+	}
+	return tile;
+}
+
+size_t TextureCache::resident_bytes()
+{
+	size_t total = 0;
+	for (Shard &shard : m_shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		total += shard.bytes;
+	}
+	return total;
+}
+
+#endif //TEXTURE_CACHE_H
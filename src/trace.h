@@ -0,0 +1,183 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Timeline of what every thread did during a render, written as Chrome trace json (load it in
+// chrome://tracing or ui.perfetto.dev). Each thread records into its own ring buffer without
+// locks; a full buffer overwrites its oldest events. Recording is off until Tracer::enable(),
+// after which a Scope costs two clock reads and a store; disabled it is one relaxed load.
+// Buffers are read by write() only, once the threads that fill them have finished.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace trace
+{
+
+// name, category and argument names must be string literals, they are kept as pointers
+struct Event
+{
+	const char *name;
+	const char *category;
+	int64_t begin_ns, end_ns;
+	const char *arg_names[2];
+	int64_t args[2];
+};
+
+class ThreadBuffer
+{
+public:
+	ThreadBuffer(size_t capacity, int tid) : m_events(capacity), m_tid(tid) {}
+
+	void push(const Event &e)
+	{
+		uint64_t head = m_head.load(std::memory_order_relaxed);
+		m_events[head % m_events.size()] = e;
+		m_head.store(head + 1, std::memory_order_release);
+	}
+
+	int tid() const { return m_tid; }
+
+	// oldest first
+	template<class F>
+	void for_each(F &&f) const
+	{
+		uint64_t head = m_head.load(std::memory_order_acquire);
+		uint64_t first = head > m_events.size() ? head - m_events.size() : 0;
+		for (uint64_t i = first; i < head; ++i) {
+			f(m_events[i % m_events.size()]);
+		}
+	}
+
+	uint64_t dropped() const
+	{
+		uint64_t head = m_head.load(std::memory_order_acquire);
+		return head > m_events.size() ? head - m_events.size() : 0;
+	}
+
+private:
+	std::vector<Event> m_events;
+	std::atomic<uint64_t> m_head{ 0 };
+	int m_tid;
+};
+
+class Tracer
+{
+public:
+	static Tracer &instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+
+	// starts recording; capacity is in events per thread (48 bytes each)
+	void enable(size_t capacity = size_t(1) << 16)
+	{
+		m_capacity = capacity;
+		m_epoch = std::chrono::steady_clock::now();
+		m_enabled.store(true, std::memory_order_release);
+	}
+
+	bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+	int64_t now_ns() const
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_epoch).count();
+	}
+
+	// the calling thread's buffer; the lock is only taken the first time a thread records
+	ThreadBuffer &buffer()
+	{
+		thread_local ThreadBuffer *mine = nullptr;
+		if (!mine) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_buffers.emplace_back(new ThreadBuffer(m_capacity, int(m_buffers.size())));
+			mine = m_buffers.back().get();
+		}
+		return *mine;
+	}
+
+	bool write(const std::string &path) const;
+
+private:
+	std::atomic<bool> m_enabled{ false };
+	size_t m_capacity = 0;
+	std::chrono::steady_clock::time_point m_epoch;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+};
+
+bool Tracer::write(const std::string &path) const
+{
+	std::ofstream out(path);
+	if (!out) {
+		return false;
+	}
+	out << std::fixed << std::setprecision(3);
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"render\"}}";
+	for (const auto &b : m_buffers) {
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid()
+			<< ",\"args\":{\"name\":\"thread " << b->tid() << "\"}}";
+		if (b->dropped()) {
+			out << ",\n{\"name\":\"dropped " << b->dropped() << " events\",\"ph\":\"i\",\"s\":\"t\",\"ts\":0,\"pid\":1,\"tid\":"
+				<< b->tid() << "}";
+		}
+		b->for_each([&](const Event &e) {
+			// complete events, microseconds
+			out << ",\n{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+				<< b->tid() << ",\"ts\":" << double(e.begin_ns) * 1e-3 << ",\"dur\":" << double(e.end_ns - e.begin_ns) * 1e-3;
+			if (e.arg_names[0]) {
+				out << ",\"args\":{\"" << e.arg_names[0] << "\":" << e.args[0];
+				if (e.arg_names[1]) {
+					out << ",\"" << e.arg_names[1] << "\":" << e.args[1];
+				}
+				out << "}";
+			}
+			out << "}";
+		});
+	}
+	out << "\n]}\n";
+	return bool(out);
+}
+
+// records the lifetime of the scope as one event on the calling thread
+class Scope
+{
+public:
+	Scope(const char *name, const char *category, const char *arg0 = nullptr, int64_t value0 = 0,
+		const char *arg1 = nullptr, int64_t value1 = 0)
+	{
+		Tracer &tracer = Tracer::instance();
+		if (!tracer.enabled()) {
+			m_event.name = nullptr;
+			return;
+		}
+		m_event = { name, category, tracer.now_ns(), 0, { arg0, arg1 }, { value0, value1 } };
+	}
+
+	~Scope()
+	{
+		if (m_event.name) {
+			Tracer &tracer = Tracer::instance();
+			m_event.end_ns = tracer.now_ns();
+			tracer.buffer().push(m_event);
+		}
+	}
+
+	Scope(const Scope &) = delete;
+	Scope &operator=(const Scope &) = delete;
+
+private:
+	Event m_event;
+};
+
+}
+
+#endif //TRACE_H
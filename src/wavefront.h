@@ -0,0 +1,243 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+// Wavefront path tracing (--wavefront). Instead of following one path to its end, a wave of paths
+// advances a bounce at a time: all rays of the wave are intersected with World::hit_batch, the
+// hits are grouped by material and scattered with one Material::scatter_batch call per group,
+// and the shadow rays of next event estimation go through World::occluded_batch. Worlds that
+// trace faster together, like OutOfCoreWorld, and the simd material kernels get the batches they
+// need; everything else is the bounce of trace_path() (integrator.h), per path.
+//
+// Every path keeps its own random stream and the kernels compute a lane the same wherever it is in
+// a batch, so a path doesn't depend on the rest of its wave and crops, passes and workers render
+// the same samples. The kernels draw differently from Material::scatter though, so images match
+// the scalar integrator in distribution only.
+
+#include <limits>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "ray.h"
+#include "hitable.h"
+#include "material.h"
+#include "scene.h"
+#include "aov.h"
+#include "integrator.h"
+#include "scatter_batch.h"
+#include "random_generator.h"
+#include "profiler.h"
+
+// paths per wave: enough hits per material for the kernels and per cluster for out of core
+// worlds, few enough that a wave's state stays in L2
+static const size_t WAVE_SIZE = 4096;
+
+// one camera path of a wave, the locals of trace_path()
+struct PathState
+{
+	Ray ray;
+	RandomGenerator<float> rand;
+	glm::vec3 throughput;
+	glm::vec3 radiance;
+	glm::vec3 prev_p;
+	float bsdf_pdf;
+	int depth;
+	bool specular_bounce;
+	bool need_albedo;
+
+	// the rest of the path state for a camera ray, rand has to be started already
+	void start(const Ray &r, bool with_aov)
+	{
+		ray = r;
+		throughput = glm::vec3(1.0f);
+		radiance = glm::vec3(0.0f);
+		bsdf_pdf = 0.0f;
+		depth = 0;
+		specular_bounce = true;
+		need_albedo = with_aov;
+	}
+};
+
+// scratch space of trace_wave(), kept between waves so they don't allocate
+struct WaveBuffers
+{
+	std::vector<uint32_t> active, next;
+	std::vector<Ray> rays;
+	std::vector<HitRecord> recs;
+	std::vector<uint8_t> hits;
+	// lanes to scatter, sorted by material
+	std::vector<std::pair<const Material *, uint32_t>> shade;
+	ShadingBatch batch;
+	// shadow rays and what their path gains if they are unoccluded
+	std::vector<Ray> shadow_rays;
+	std::vector<float> shadow_tmax;
+	std::vector<uint8_t> occluded;
+	std::vector<uint32_t> shadow_path;
+	std::vector<glm::vec3> shadow_contribution;
+};
+
+// traces the paths to their ends, each one leaves its result in radiance. aovs has an entry
+// per path when WithAOV.
+template<bool WithAOV, class World>
+void trace_wave(PathState *paths, AOVSample *aovs, size_t count, const Scene &scene, const World &world, WaveBuffers &buf)
+{
+	constexpr bool profiled = prof::is_profiled<World>::value;
+	if (WithAOV) {
+		for (size_t i = 0; i < count; ++i) {
+			AOVSample &aov = aovs[i];
+			aov.albedo = glm::vec3(1.0f);
+			aov.normal = glm::vec3(0.0f);
+			aov.depth = 0.0f;
+			aov.material_id = aov.object_id = 0;
+			for (auto &b : aov.bounce) {
+				b = glm::vec3(0.0f);
+			}
+		}
+	}
+	buf.active.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		buf.active[i] = uint32_t(i);
+	}
+
+	while (!buf.active.empty()) {
+		const size_t n = buf.active.size();
+		buf.rays.resize(n);
+		buf.recs.resize(n);
+		buf.hits.resize(n);
+		for (size_t k = 0; k < n; ++k) {
+			buf.rays[k] = paths[buf.active[k]].ray;
+		}
+		detail::rays_traced += n;
+		world.hit_batch(buf.rays.data(), n, 0.001f, std::numeric_limits<float>::max(), buf.recs.data(), buf.hits.data());
+
+		// misses and emission, what is left gets scattered
+		buf.shade.clear();
+		for (size_t k = 0; k < n; ++k) {
+			const uint32_t path = buf.active[k];
+			PathState &p = paths[path];
+			AOVSample *aov = WithAOV ? &aovs[path] : nullptr;
+			const int bounce = std::min(p.depth, AOV_MAX_BOUNCES - 1);
+			if (!buf.hits[k]) {
+				glm::vec3 background = scene.background(p.ray);
+				if (scene.environment && !p.specular_bounce) {
+					float light_pdf = scene.lights.pdf(p.prev_p, scene.environment) * scene.environment->pdf(p.ray.direction());
+					background *= detail::power_heuristic(p.bsdf_pdf, light_pdf);
+				}
+				p.radiance += p.throughput * background;
+				if (WithAOV) {
+					aov->bounce[bounce] += p.throughput * background;
+					if (p.need_albedo) {
+						aov->albedo = p.throughput * background;
+					}
+				}
+				continue;
+			}
+			HitRecord &rec = buf.recs[k];
+			float ray_length = glm::length(p.ray.direction());
+			rec.footprint = p.ray.cone_width + p.ray.cone_spread * rec.t * ray_length;
+			world.visit_material(rec, [&](const auto &mat) {
+				if (WithAOV) {
+					if (p.depth == 0) {
+						aov->normal = rec.normal;
+						aov->depth = rec.t * ray_length;
+						aov->material_id = mat.id();
+						aov->object_id = rec.object_id;
+					}
+					if (p.need_albedo && (!mat.is_specular() || mat.light())) {
+						aov->albedo = p.throughput * mat.albedo(rec);
+						p.need_albedo = false;
+					}
+				}
+				glm::vec3 emitted = mat.emitted(p.ray, rec);
+				const Light *light = mat.light();
+				if (light && !p.specular_bounce) {
+					float light_pdf = scene.lights.pdf(p.prev_p, light) * light->pdf(p.prev_p, glm::normalize(p.ray.direction()), rec);
+					emitted *= detail::power_heuristic(p.bsdf_pdf, light_pdf);
+				}
+				p.radiance += p.throughput * emitted;
+				if (WithAOV) {
+					aov->bounce[bounce] += p.throughput * emitted;
+				}
+			});
+			if (p.depth < DEPTH) {
+				buf.shade.emplace_back(rec.mat_ptr, uint32_t(k));
+			}
+		}
+
+		// one scatter_batch per material, then the light samples in the same order as trace_path
+		std::sort(buf.shade.begin(), buf.shade.end());
+		buf.next.clear();
+		buf.shadow_rays.clear();
+		buf.shadow_tmax.clear();
+		buf.shadow_path.clear();
+		buf.shadow_contribution.clear();
+		for (size_t begin = 0; begin < buf.shade.size(); ) {
+			const Material *material = buf.shade[begin].first;
+			size_t end = begin;
+			buf.batch.clear();
+			for (; end < buf.shade.size() && buf.shade[end].first == material; ++end) {
+				const uint32_t k = buf.shade[end].second;
+				PathState &p = paths[buf.active[k]];
+				buf.batch.add(buf.recs[k], p.ray.direction(), &p.rand);
+			}
+			{
+				prof::Scope<profiled> scope(prof::SCATTER);
+				ScatterBatch out = buf.batch.out();
+				material->scatter_batch(buf.batch.hits(), out);
+			}
+			for (size_t b = 0; b < end - begin; ++b) {
+				const uint32_t k = buf.shade[begin + b].second;
+				const uint32_t path = buf.active[k];
+				PathState &p = paths[path];
+				const HitRecord &rec = buf.recs[k];
+				if (!buf.batch.valid(b)) {
+					continue;
+				}
+				const Ray scattered = buf.batch.scattered(b);
+				world.visit_material(rec, [&](const auto &mat) {
+					p.specular_bounce = mat.is_specular();
+					if (!p.specular_bounce) {
+						DirectSample ds;
+						if (sample_light(p.ray, rec, mat, scene, p.rand, ds)) {
+							buf.shadow_rays.push_back(ds.shadow);
+							buf.shadow_tmax.push_back(ds.tmax);
+							buf.shadow_path.push_back(path);
+							buf.shadow_contribution.push_back(p.throughput * ds.contribution);
+						}
+						p.bsdf_pdf = mat.pdf(p.ray, rec, glm::normalize(scattered.direction()));
+					}
+				});
+				p.throughput *= buf.batch.attenuation(b);
+				p.prev_p = rec.p;
+				const float spread = p.specular_bounce ? p.ray.cone_spread : std::max(p.ray.cone_spread, DIFFUSE_CONE_SPREAD);
+				p.ray = scattered;
+				p.ray.cone_width = rec.footprint;
+				p.ray.cone_spread = spread;
+				buf.next.push_back(path);
+			}
+			begin = end;
+		}
+
+		const size_t shadows = buf.shadow_rays.size();
+		buf.occluded.resize(shadows);
+		detail::rays_traced += shadows;
+		world.occluded_batch(buf.shadow_rays.data(), buf.shadow_tmax.data(), shadows, SHADOW_EPSILON, buf.occluded.data());
+		for (size_t s = 0; s < shadows; ++s) {
+			if (buf.occluded[s]) {
+				continue;
+			}
+			PathState &p = paths[buf.shadow_path[s]];
+			p.radiance += buf.shadow_contribution[s];
+			if (WithAOV) {
+				aovs[buf.shadow_path[s]].bounce[std::min(p.depth, AOV_MAX_BOUNCES - 1)] += buf.shadow_contribution[s];
+			}
+		}
+		// after the light samples, which count towards the bounce they were taken at
+		for (uint32_t path : buf.next) {
+			paths[path].depth++;
+		}
+		std::swap(buf.active, buf.next);
+	}
+}
+
+#endif //WAVEFRONT_H
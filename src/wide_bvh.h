@@ -0,0 +1,737 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+// 4 or 8 wide bounding volume hierarchy, collapsed from a binary BVH built by either builder.
+// Every wide node takes the place of a binary node and up to N - 1 of its descendants: the
+// inner child with the largest surface area is opened until the node has N children. The child
+// boxes are stored as structure of arrays, one row per plane, so a ray is tested against all of
+// them at once (AVX for 8, SSE for 4, a plain loop without __AVX2__). The slab test is the same
+// arithmetic as AABB::hit, so the boxes a ray enters, and the hits, match the binary tree.
+//
+// Closest hit traversal pushes the children a ray enters far to near with their entry distance,
+// and skips popped entries that start beyond the closest hit found since.
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <iostream>
+#include <algorithm>
+#include <glm/glm.hpp>
+#include "aabb.h"
+#include "ray.h"
+#include "hitable.h"
+#include "bvh.h"
+#include "trace.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace detail
+{
+
+// leaf references keep the offset of their first primitive in the 28 bits between the leaf flag
+// and the count, so wide trees hold fewer primitives than this
+static const size_t WIDE_BVH_MAX_PRIMITIVES = size_t(1) << 28;
+
+// index of the lowest set bit of a non zero mask
+inline int lowest_bit(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long i;
+	_BitScanForward(&i, mask);
+	return int(i);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// tests the N boxes of rows min x, y, z, max x, y, z; returns the mask of boxes the ray enters
+// within [tmin, tmax] and their entry distances
+template<int N>
+inline unsigned slab_test(const float (*bounds)[N], const SlabRay &ray, float tmin, float tmax, float *tnear)
+{
+	unsigned mask = 0;
+	for (int i = 0; i < N; ++i) {
+		float t_enter = tmin, t_exit = tmax;
+		for (int a = 0; a < 3; ++a) {
+			float t0 = (bounds[ray.near[a]][i] - ray.origin[a]) * ray.inv_dir[a];
+			float t1 = (bounds[ray.far[a]][i] - ray.origin[a]) * ray.inv_dir[a];
+			t_enter = t0 > t_enter ? t0 : t_enter;
+			t_exit = t1 < t_exit ? t1 : t_exit;
+		}
+		tnear[i] = t_enter;
+		mask |= unsigned(t_enter <= t_exit) << i;
+	}
+	return mask;
+}
+
+#ifdef __AVX2__
+// max and min return their second operand when either is nan, like the ternaries above
+template<>
+inline unsigned slab_test<8>(const float (*bounds)[8], const SlabRay &ray, float tmin, float tmax, float *tnear)
+{
+	__m256 t_enter = _mm256_set1_ps(tmin), t_exit = _mm256_set1_ps(tmax);
+	for (int a = 0; a < 3; ++a) {
+		const __m256 o = _mm256_set1_ps(ray.origin[a]), inv = _mm256_set1_ps(ray.inv_dir[a]);
+		__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[ray.near[a]]), o), inv);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[ray.far[a]]), o), inv);
+		t_enter = _mm256_max_ps(t0, t_enter);
+		t_exit = _mm256_min_ps(t1, t_exit);
+	}
+	_mm256_storeu_ps(tnear, t_enter);
+	return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ)));
+}
+
+template<>
+inline unsigned slab_test<4>(const float (*bounds)[4], const SlabRay &ray, float tmin, float tmax, float *tnear)
+{
+	__m128 t_enter = _mm_set1_ps(tmin), t_exit = _mm_set1_ps(tmax);
+	for (int a = 0; a < 3; ++a) {
+		const __m128 o = _mm_set1_ps(ray.origin[a]), inv = _mm_set1_ps(ray.inv_dir[a]);
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[ray.near[a]]), o), inv);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[ray.far[a]]), o), inv);
+		t_enter = _mm_max_ps(t0, t_enter);
+		t_exit = _mm_min_ps(t1, t_exit);
+	}
+	_mm_storeu_ps(tnear, t_enter);
+	return unsigned(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)));
+}
+#endif
+
+}
+
+template<int N>
+class WideBVH : public Accelerator
+{
+	static_assert(N == 4 || N == 8, "wide nodes have 4 or 8 children");
+
+public:
+	WideBVH(std::vector<std::unique_ptr<Hitable>> hitables, const AccelOptions &options = AccelOptions());
+
+	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override;
+	virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+	virtual AABB bounds() const override { return m_bounds; }
+
+	const std::vector<std::unique_ptr<Hitable>> &hitables() const { return m_hitables; }
+
+private:
+	// children are wide nodes by index or leaves as LEAF | offset << 3 | count, their primitives
+	// being [offset, offset + count), see detail::WIDE_BVH_MAX_PRIMITIVES. Unused slots are empty
+	// leaves with boxes no ray enters.
+	static const uint32_t LEAF = 0x80000000u;
+	static_assert(BVH::MAX_LEAF_SIZE < 8, "leaf sizes have 3 bits in a child reference");
+
+	// 6 * N planes and N child references: 112 bytes for BVH4, 224 for BVH8
+	struct alignas(sizeof(float) * N) Node
+	{
+		float bounds[6][N]; // min x, y, z, max x, y, z
+		uint32_t child[N];
+
+		Node()
+		{
+			const AABB empty;
+			for (int i = 0; i < N; ++i) {
+				set(i, empty, LEAF);
+			}
+		}
+
+		void set(int i, const AABB &b, uint32_t ref)
+		{
+			for (int a = 0; a < 3; ++a) {
+				bounds[a][i] = b.min[a];
+				bounds[3 + a][i] = b.max[a];
+			}
+			child[i] = ref;
+		}
+	};
+
+	struct Entry
+	{
+		uint32_t ref;
+		float t; // where the ray enters the child's box
+	};
+
+	// every wide level takes at least one binary level, and leaves N - 1 siblings on the stack
+	static const int STACK_SIZE = BVH::MAX_DEPTH * (N - 1) + 1;
+
+	uint32_t collapse(const BVH &bvh, uint32_t index, int depth);
+
+	bool hit_leaf(uint32_t ref, const Ray &r, float tmin, float &closest_so_far, HitRecord &rec) const;
+
+private:
+	std::vector<std::unique_ptr<Hitable>> m_hitables;
+	std::vector<Node> m_nodes;
+	uint32_t m_root = LEAF;
+	AABB m_bounds;
+};
+
+template<int N>
+WideBVH<N>::WideBVH(std::vector<std::unique_ptr<Hitable>> hitables, const AccelOptions &options)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	BVH bvh(std::move(hitables), options);
+	trace::Scope trace_collapse("bvh collapse", "build", "width", N);
+	m_stats.primitives = bvh.stats().primitives;
+	if (!bvh.m_nodes.empty()) {
+		// a wide node per binary node at most
+		m_nodes.reserve(bvh.m_nodes.size() / 2 + 1);
+		m_root = collapse(bvh, 0, 1);
+		m_bounds = bvh.m_nodes[0].bounds;
+		m_stats.sah_cost /= std::max(m_bounds.surface_area(), std::numeric_limits<float>::min());
+	}
+	m_hitables = std::move(bvh.m_hitables);
+	m_stats.nodes = m_nodes.size();
+	m_stats.node_bytes = m_nodes.size() * sizeof(Node);
+	m_stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// returns the reference to the subtree of binary node index
+template<int N>
+uint32_t WideBVH<N>::collapse(const BVH &bvh, uint32_t index, int depth)
+{
+	const BVH::Node &node = bvh.m_nodes[index];
+	m_stats.depth = std::max(m_stats.depth, depth);
+	if (node.count > 0) {
+		m_stats.leaves++;
+		m_stats.sah_cost += node.bounds.surface_area() * node.count;
+		return LEAF | node.offset << 3 | node.count;
+	}
+	m_stats.sah_cost += node.bounds.surface_area();
+
+	uint32_t children[N];
+	const int count = bvh.wide_children(index, N, children);
+
+	const uint32_t wide = uint32_t(m_nodes.size());
+	m_nodes.emplace_back();
+	for (int i = 0; i < count; ++i) {
+		const uint32_t ref = collapse(bvh, children[i], depth + 1);
+		m_nodes[wide].set(i, bvh.m_nodes[children[i]].bounds, ref);
+	}
+	return wide;
+}
+
+template<int N>
+bool WideBVH<N>::hit_leaf(uint32_t ref, const Ray &r, float tmin, float &closest_so_far, HitRecord &rec) const
+{
+	const uint32_t offset = (ref & ~LEAF) >> 3, end = offset + (ref & 7);
+	HitRecord temp_rec;
+	bool hit_any = false;
+	for (uint32_t i = offset; i < end; ++i) {
+		if (m_hitables[i]->hit(r, tmin, closest_so_far, temp_rec)) {
+			hit_any = true;
+			closest_so_far = temp_rec.t;
+			rec = temp_rec;
+		}
+	}
+	return hit_any;
+}
+
+template<int N>
+bool WideBVH<N>::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
+{
+	if (m_root & LEAF) {
+		return hit_leaf(m_root, r, tmin, tmax, rec);
+	}
+	const SlabRay ray(r.origin(), r.direction());
+	Entry stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = { m_root, tmin };
+	bool hit_any = false;
+	float closest_so_far = tmax;
+	while (top > 0) {
+		const Entry e = stack[--top];
+		if (e.t > closest_so_far) {
+			continue; // entered before the closest hit got closer
+		}
+		if (e.ref & LEAF) {
+			hit_any |= hit_leaf(e.ref, r, tmin, closest_so_far, rec);
+			continue;
+		}
+		const Node &node = m_nodes[e.ref];
+		float tnear[N];
+		unsigned mask = detail::slab_test<N>(node.bounds, ray, tmin, closest_so_far, tnear);
+		// insertion sort into the top of the stack, farthest deepest
+		const int first = top;
+		while (mask) {
+			const int i = detail::lowest_bit(mask);
+			mask &= mask - 1;
+			const Entry c = { node.child[i], tnear[i] };
+			int j = top++;
+			for (; j > first && stack[j - 1].t < c.t; --j) {
+				stack[j] = stack[j - 1];
+			}
+			stack[j] = c;
+		}
+	}
+	return hit_any;
+}
+
+template<int N>
+bool WideBVH<N>::occluded(const Ray &r, float tmin, float tmax) const
+{
+	const SlabRay ray(r.origin(), r.direction());
+	uint32_t stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = m_root;
+	while (top > 0) {
+		const uint32_t ref = stack[--top];
+		if (ref & LEAF) {
+			const uint32_t offset = (ref & ~LEAF) >> 3, end = offset + (ref & 7);
+			for (uint32_t i = offset; i < end; ++i) {
+				if (m_hitables[i]->occluded(r, tmin, tmax)) {
+					return true;
+				}
+			}
+			continue;
+		}
+		const Node &node = m_nodes[ref];
+		float tnear[N];
+		unsigned mask = detail::slab_test<N>(node.bounds, ray, tmin, tmax, tnear);
+		while (mask) {
+			const int i = detail::lowest_bit(mask);
+			mask &= mask - 1;
+			stack[top++] = node.child[i];
+		}
+	}
+	return false;
+}
+
+namespace detail
+{
+
+// 2^e for e in [-126, 127], built from the exponent bits
+inline float exp2i(int e)
+{
+	const uint32_t bits = uint32_t(e + 127) << 23;
+	float f;
+	std::memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+// the planes of quantized boxes are origin + q * 2^e. The product is exact, so with or without
+// fma the plane is the sum rounded once, the same value the builder checked
+template<int N, class Q>
+inline unsigned quantized_slab_test(const Q (*q)[N], const float *origin, const float *scale, const SlabRay &ray,
+	float tmin, float tmax, float *tnear)
+{
+	unsigned mask = 0;
+	for (int i = 0; i < N; ++i) {
+		float t_enter = tmin, t_exit = tmax;
+		for (int a = 0; a < 3; ++a) {
+			float near = origin[a] + float(q[ray.near[a]][i]) * scale[a];
+			float far = origin[a] + float(q[ray.far[a]][i]) * scale[a];
+			float t0 = (near - ray.origin[a]) * ray.inv_dir[a];
+			float t1 = (far - ray.origin[a]) * ray.inv_dir[a];
+			t_enter = t0 > t_enter ? t0 : t_enter;
+			t_exit = t1 < t_exit ? t1 : t_exit;
+		}
+		tnear[i] = t_enter;
+		mask |= unsigned(t_enter <= t_exit) << i;
+	}
+	return mask;
+}
+
+#ifdef __AVX2__
+inline __m256 to_float8(const uint8_t *q) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)q))); }
+inline __m256 to_float8(const uint16_t *q) { return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)q))); }
+inline __m128 to_float4(const uint16_t *q) { return _mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)q))); }
+
+inline __m128 to_float4(const uint8_t *q)
+{
+	int32_t v;
+	std::memcpy(&v, q, sizeof(v));
+	return _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)));
+}
+
+template<class Q>
+inline unsigned quantized_slab_test8(const Q (*q)[8], const float *origin, const float *scale, const SlabRay &ray,
+	float tmin, float tmax, float *tnear)
+{
+	__m256 t_enter = _mm256_set1_ps(tmin), t_exit = _mm256_set1_ps(tmax);
+	for (int a = 0; a < 3; ++a) {
+		const __m256 p = _mm256_set1_ps(origin[a]), s = _mm256_set1_ps(scale[a]);
+		const __m256 o = _mm256_set1_ps(ray.origin[a]), inv = _mm256_set1_ps(ray.inv_dir[a]);
+		__m256 near = _mm256_add_ps(_mm256_mul_ps(to_float8(q[ray.near[a]]), s), p);
+		__m256 far = _mm256_add_ps(_mm256_mul_ps(to_float8(q[ray.far[a]]), s), p);
+		t_enter = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near, o), inv), t_enter);
+		t_exit = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far, o), inv), t_exit);
+	}
+	_mm256_storeu_ps(tnear, t_enter);
+	return unsigned(_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ)));
+}
+
+template<class Q>
+inline unsigned quantized_slab_test4(const Q (*q)[4], const float *origin, const float *scale, const SlabRay &ray,
+	float tmin, float tmax, float *tnear)
+{
+	__m128 t_enter = _mm_set1_ps(tmin), t_exit = _mm_set1_ps(tmax);
+	for (int a = 0; a < 3; ++a) {
+		const __m128 p = _mm_set1_ps(origin[a]), s = _mm_set1_ps(scale[a]);
+		const __m128 o = _mm_set1_ps(ray.origin[a]), inv = _mm_set1_ps(ray.inv_dir[a]);
+		__m128 near = _mm_add_ps(_mm_mul_ps(to_float4(q[ray.near[a]]), s), p);
+		__m128 far = _mm_add_ps(_mm_mul_ps(to_float4(q[ray.far[a]]), s), p);
+		t_enter = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near, o), inv), t_enter);
+		t_exit = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far, o), inv), t_exit);
+	}
+	_mm_storeu_ps(tnear, t_enter);
+	return unsigned(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)));
+}
+
+template<>
+inline unsigned quantized_slab_test<8, uint8_t>(const uint8_t (*q)[8], const float *origin, const float *scale,
+	const SlabRay &ray, float tmin, float tmax, float *tnear)
+{
+	return quantized_slab_test8(q, origin, scale, ray, tmin, tmax, tnear);
+}
+
+template<>
+inline unsigned quantized_slab_test<8, uint16_t>(const uint16_t (*q)[8], const float *origin, const float *scale,
+	const SlabRay &ray, float tmin, float tmax, float *tnear)
+{
+	return quantized_slab_test8(q, origin, scale, ray, tmin, tmax, tnear);
+}
+
+template<>
+inline unsigned quantized_slab_test<4, uint8_t>(const uint8_t (*q)[4], const float *origin, const float *scale,
+	const SlabRay &ray, float tmin, float tmax, float *tnear)
+{
+	return quantized_slab_test4(q, origin, scale, ray, tmin, tmax, tnear);
+}
+
+template<>
+inline unsigned quantized_slab_test<4, uint16_t>(const uint16_t (*q)[4], const float *origin, const float *scale,
+	const SlabRay &ray, float tmin, float tmax, float *tnear)
+{
+	return quantized_slab_test4(q, origin, scale, ray, tmin, tmax, tnear);
+}
+#endif
+
+}
+
+// WideBVH with the child boxes quantized to 8 or 16 bits on a grid spanning the node, the grid
+// spacing a power of two per axis (Ylitie et al. 2017). Boxes are rounded outwards, and checked
+// in the float arithmetic traversal uses, so they contain the exact boxes and rays still find
+// every hit of the binary tree. Child references are compressed too: the inner children of a
+// node are consecutive nodes and the primitives of its leaf children consecutive primitives,
+// so each child only needs a byte.
+template<int N, class Q>
+class QuantizedBVH : public Accelerator
+{
+	static_assert(N == 4 || N == 8, "wide nodes have 4 or 8 children");
+
+public:
+	QuantizedBVH(std::vector<std::unique_ptr<Hitable>> hitables, const AccelOptions &options = AccelOptions());
+
+	virtual bool hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const override;
+	virtual bool occluded(const Ray &r, float tmin, float tmax) const override;
+	virtual AABB bounds() const override { return m_bounds; }
+
+	const std::vector<std::unique_ptr<Hitable>> &hitables() const { return m_hitables; }
+
+private:
+	static const uint32_t QMAX = (uint32_t(1) << (8 * sizeof(Q))) - 1;
+	// stack entries reference nodes by index and leaves as LEAF | offset << 3 | count, as in WideBVH
+	static const uint32_t LEAF = 0x80000000u;
+	static_assert(BVH::MAX_LEAF_SIZE < 8 && BVH::MAX_LEAF_SIZE * (N - 1) < 32, "leaves fit a child byte");
+
+	// BVH8 is 80 bytes with 8 bit and 128 with 16 bit boxes, BVH4 64 and 80 (WideBVH: 224, 112)
+	struct alignas(16) Node
+	{
+		float origin[3];
+		int8_t exponent[3];
+		uint8_t inner_mask;
+		uint32_t child_base; // first inner child
+		uint32_t prim_base;  // first primitive of the leaf children
+		// inner children: rank among them; leaves: offset from prim_base << 3 | count
+		uint8_t meta[N];
+		Q q[6][N]; // min x, y, z, max x, y, z
+	};
+
+	struct Entry
+	{
+		uint32_t ref;
+		float t;
+	};
+
+	static const int STACK_SIZE = BVH::MAX_DEPTH * (N - 1) + 1;
+
+	void collapse(const BVH &bvh, uint32_t index, uint32_t wide, std::vector<uint32_t> &order, int depth);
+	static void set_frame(Node &node, const AABB &b);
+	static void quantize(Node &node, int i, const AABB &b);
+
+	static void scales(const Node &node, float *scale)
+	{
+		for (int a = 0; a < 3; ++a) {
+			scale[a] = detail::exp2i(node.exponent[a]);
+		}
+	}
+
+	static uint32_t child_ref(const Node &node, int i)
+	{
+		if ((node.inner_mask >> i) & 1) {
+			return node.child_base + node.meta[i];
+		}
+		return LEAF | (node.prim_base + (node.meta[i] >> 3)) << 3 | (node.meta[i] & 7);
+	}
+
+	bool hit_leaf(uint32_t ref, const Ray &r, float tmin, float &closest_so_far, HitRecord &rec) const;
+
+private:
+	std::vector<std::unique_ptr<Hitable>> m_hitables;
+	std::vector<Node> m_nodes;
+	uint32_t m_root = LEAF;
+	AABB m_bounds;
+};
+
+template<int N, class Q>
+QuantizedBVH<N, Q>::QuantizedBVH(std::vector<std::unique_ptr<Hitable>> hitables, const AccelOptions &options)
+{
+	auto t0 = std::chrono::steady_clock::now();
+	BVH bvh(std::move(hitables), options);
+	trace::Scope trace_collapse("bvh collapse", "build", "width", N, "bits", int64_t(8 * sizeof(Q)));
+	m_stats.primitives = bvh.stats().primitives;
+	if (bvh.m_nodes.empty()) {
+		return;
+	}
+	m_bounds = bvh.m_nodes[0].bounds;
+	if (bvh.m_nodes[0].count > 0) {
+		m_root = LEAF | bvh.m_nodes[0].count;
+		m_hitables = std::move(bvh.m_hitables);
+		m_stats.leaves = 1;
+		m_stats.depth = 1;
+		m_stats.sah_cost = float(bvh.m_nodes[0].count);
+	} else {
+		// primitives are reordered again, each node's leaves together
+		std::vector<uint32_t> order;
+		order.reserve(bvh.m_hitables.size());
+		m_nodes.reserve(bvh.m_nodes.size() / 2 + 1);
+		m_nodes.emplace_back();
+		m_root = 0;
+		collapse(bvh, 0, 0, order, 1);
+		m_hitables.resize(order.size());
+		for (size_t i = 0; i < order.size(); ++i) {
+			m_hitables[i] = std::move(bvh.m_hitables[order[i]]);
+		}
+		m_stats.sah_cost /= std::max(m_bounds.surface_area(), std::numeric_limits<float>::min());
+	}
+	m_stats.nodes = m_nodes.size();
+	m_stats.node_bytes = m_nodes.size() * sizeof(Node);
+	m_stats.build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// the grid of a node starts at its min corner; the exponents are the smallest whose 2^e * QMAX
+// reaches the max corner in float arithmetic
+template<int N, class Q>
+void QuantizedBVH<N, Q>::set_frame(Node &node, const AABB &b)
+{
+	for (int a = 0; a < 3; ++a) {
+		node.origin[a] = b.min[a];
+		const float extent = b.max[a] - b.min[a];
+		int e = extent > 0.0f ? std::max(-126, std::ilogb(extent / float(QMAX))) : -126;
+		while (e < 127 && b.min[a] + float(QMAX) * detail::exp2i(e) < b.max[a]) {
+			e++;
+		}
+		node.exponent[a] = int8_t(e);
+	}
+}
+
+// rounds the box of child i outwards to the node's grid
+template<int N, class Q>
+void QuantizedBVH<N, Q>::quantize(Node &node, int i, const AABB &b)
+{
+	for (int a = 0; a < 3; ++a) {
+		const float p = node.origin[a], s = detail::exp2i(node.exponent[a]);
+		auto cell = [&](float v) { return uint32_t(std::min(std::max((v - p) / s, 0.0f), float(QMAX))); };
+		uint32_t lo = cell(b.min[a]), hi = std::min(cell(b.max[a]) + 1, QMAX);
+		// the planes are rounded sums; where s is finer than the float spacing around p the
+		// estimates can be off by more than a cell
+		while (lo > 0 && p + float(lo) * s > b.min[a]) {
+			lo--;
+		}
+		while (hi < QMAX && p + float(hi) * s < b.max[a]) {
+			hi++;
+		}
+		while (hi > lo && p + float(hi - 1) * s >= b.max[a]) {
+			hi--;
+		}
+		node.q[a][i] = Q(lo);
+		node.q[3 + a][i] = Q(hi);
+	}
+}
+
+// fills node wide from binary inner node index; its inner children get consecutive nodes and
+// its leaves consecutive primitives
+template<int N, class Q>
+void QuantizedBVH<N, Q>::collapse(const BVH &bvh, uint32_t index, uint32_t wide, std::vector<uint32_t> &order, int depth)
+{
+	m_stats.depth = std::max(m_stats.depth, depth);
+	m_stats.sah_cost += bvh.m_nodes[index].bounds.surface_area();
+	uint32_t children[N];
+	const int count = bvh.wide_children(index, N, children);
+
+	Node &node = m_nodes[wide];
+	set_frame(node, bvh.m_nodes[index].bounds);
+	for (int i = 0; i < N; ++i) {
+		for (int a = 0; a < 3; ++a) {
+			// boxes of unused slots are inverted, and their empty leaves harmless if entered
+			node.q[a][i] = Q(QMAX);
+			node.q[3 + a][i] = 0;
+		}
+		node.meta[i] = 0;
+	}
+	node.inner_mask = 0;
+	node.child_base = uint32_t(m_nodes.size());
+	node.prim_base = uint32_t(order.size());
+	uint8_t inner = 0, prims = 0;
+	for (int i = 0; i < count; ++i) {
+		const BVH::Node &c = bvh.m_nodes[children[i]];
+		quantize(node, i, c.bounds);
+		if (c.count == 0) {
+			node.inner_mask |= uint8_t(1 << i);
+			node.meta[i] = inner++;
+			continue;
+		}
+		node.meta[i] = uint8_t(prims << 3 | c.count);
+		prims += uint8_t(c.count);
+		for (uint32_t k = c.offset; k < c.offset + c.count; ++k) {
+			order.push_back(k);
+		}
+		m_stats.leaves++;
+		m_stats.sah_cost += c.bounds.surface_area() * c.count;
+		m_stats.depth = std::max(m_stats.depth, depth + 1);
+	}
+
+	// the node reference dies with the resize
+	const uint32_t base = node.child_base;
+	m_nodes.resize(m_nodes.size() + inner);
+	for (int i = 0; i < count; ++i) {
+		if (bvh.m_nodes[children[i]].count == 0) {
+			collapse(bvh, children[i], base + m_nodes[wide].meta[i], order, depth + 1);
+		}
+	}
+}
+
+template<int N, class Q>
+bool QuantizedBVH<N, Q>::hit_leaf(uint32_t ref, const Ray &r, float tmin, float &closest_so_far, HitRecord &rec) const
+{
+	const uint32_t offset = (ref & ~LEAF) >> 3, end = offset + (ref & 7);
+	HitRecord temp_rec;
+	bool hit_any = false;
+	for (uint32_t i = offset; i < end; ++i) {
+		if (m_hitables[i]->hit(r, tmin, closest_so_far, temp_rec)) {
+			hit_any = true;
+			closest_so_far = temp_rec.t;
+			rec = temp_rec;
+		}
+	}
+	return hit_any;
+}
+
+template<int N, class Q>
+bool QuantizedBVH<N, Q>::hit(const Ray &r, float tmin, float tmax, HitRecord &rec) const
+{
+	if (m_root & LEAF) {
+		return hit_leaf(m_root, r, tmin, tmax, rec);
+	}
+	const SlabRay ray(r.origin(), r.direction());
+	Entry stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = { m_root, tmin };
+	bool hit_any = false;
+	float closest_so_far = tmax;
+	while (top > 0) {
+		const Entry e = stack[--top];
+		if (e.t > closest_so_far) {
+			continue;
+		}
+		if (e.ref & LEAF) {
+			hit_any |= hit_leaf(e.ref, r, tmin, closest_so_far, rec);
+			continue;
+		}
+		const Node &node = m_nodes[e.ref];
+		float scale[3], tnear[N];
+		scales(node, scale);
+		unsigned mask = detail::quantized_slab_test<N, Q>(node.q, node.origin, scale, ray, tmin, closest_so_far, tnear);
+		const int first = top;
+		while (mask) {
+			const int i = detail::lowest_bit(mask);
+			mask &= mask - 1;
+			const Entry c = { child_ref(node, i), tnear[i] };
+			int j = top++;
+			for (; j > first && stack[j - 1].t < c.t; --j) {
+				stack[j] = stack[j - 1];
+			}
+			stack[j] = c;
+		}
+	}
+	return hit_any;
+}
+
+template<int N, class Q>
+bool QuantizedBVH<N, Q>::occluded(const Ray &r, float tmin, float tmax) const
+{
+	const SlabRay ray(r.origin(), r.direction());
+	uint32_t stack[STACK_SIZE];
+	int top = 0;
+	stack[top++] = m_root;
+	while (top > 0) {
+		const uint32_t ref = stack[--top];
+		if (ref & LEAF) {
+			const uint32_t offset = (ref & ~LEAF) >> 3, end = offset + (ref & 7);
+			for (uint32_t i = offset; i < end; ++i) {
+				if (m_hitables[i]->occluded(r, tmin, tmax)) {
+					return true;
+				}
+			}
+			continue;
+		}
+		const Node &node = m_nodes[ref];
+		float scale[3], tnear[N];
+		scales(node, scale);
+		unsigned mask = detail::quantized_slab_test<N, Q>(node.q, node.origin, scale, ray, tmin, tmax, tnear);
+		while (mask) {
+			const int i = detail::lowest_bit(mask);
+			mask &= mask - 1;
+			stack[top++] = child_ref(node, i);
+		}
+	}
+	return false;
+}
+
+// the scene's world for a primitive list
+inline std::unique_ptr<Hitable> make_accel(std::vector<std::unique_ptr<Hitable>> hitables, const AccelOptions &accel)
+{
+	if (accel.type == Accel::BVH) {
+		if (accel.width > 2 && hitables.size() >= detail::WIDE_BVH_MAX_PRIMITIVES) {
+			std::cerr << hitables.size() << " primitives are too many for a wide bvh, building a binary one" << std::endl;
+			return std::make_unique<BVH>(std::move(hitables), accel);
+		}
+		if (accel.width > 2 && accel.quantize_bits > 0) {
+			if (accel.width == 8) {
+				if (accel.quantize_bits > 8) {
+					return std::make_unique<QuantizedBVH<8, uint16_t>>(std::move(hitables), accel);
+				}
+				return std::make_unique<QuantizedBVH<8, uint8_t>>(std::move(hitables), accel);
+			}
+			if (accel.quantize_bits > 8) {
+				return std::make_unique<QuantizedBVH<4, uint16_t>>(std::move(hitables), accel);
+			}
+			return std::make_unique<QuantizedBVH<4, uint8_t>>(std::move(hitables), accel);
+		}
+		if (accel.width == 8) {
+			return std::make_unique<WideBVH<8>>(std::move(hitables), accel);
+		} else if (accel.width == 4) {
+			return std::make_unique<WideBVH<4>>(std::move(hitables), accel);
+		}
+		return std::make_unique<BVH>(std::move(hitables), accel);
+	}
+	return std::make_unique<HitableList>(std::move(hitables));
+}
+
+#endif //WIDE_BVH_H